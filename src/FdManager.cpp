@@ -26,6 +26,9 @@ namespace Server {
         }
         lock.unlock();
         RWMutexType::WriteLock writeLock(m_mutex);
+        if (m_datas.size() <= (size_t) fd) {
+            m_datas.resize(fd * 1.5);
+        }
         FdCtx::ptr ctx(new FdCtx(fd));
         m_datas[fd] = ctx;
         return ctx;
@@ -42,14 +45,14 @@ namespace Server {
 
     FdCtx::FdCtx(int fd) : m_isInit(false),
                            m_isSocket(false),
+                           m_isStream(false),
                            m_sysNonBlock(false),
                            m_isClosed(false),
                            m_userNonBlock(false),
                            m_fd(fd),
                            m_recvTimeout(-1),
                            m_sendTimeout(-1) {
-
-
+        init();
     }
 
     FdCtx::~FdCtx() {
@@ -82,6 +85,14 @@ namespace Server {
                 fcntl_f(m_fd, F_SETFL, false | O_NONBLOCK);
             }
             m_sysNonBlock = true;
+            int type = 0;
+            socklen_t len = sizeof(type);
+            m_isStream = getsockopt_f(m_fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+            // 持久注册模式下socket创建时就注册到epoll上，之后等待读写不再调用epoll_ctl
+            ioSchedule = IOSchedule::GetThis();
+            if (ioSchedule && ioSchedule->isPersistent()) {
+                ioSchedule->registerFd(m_fd);
+            }
         } else {
             m_sysNonBlock = false;
         }
@@ -26,6 +26,11 @@ namespace Server {
 
         bool isSocket() const { return m_isSocket; }
 
+        /**
+         * @brief 是否是流式socket(SOCK_STREAM)，只有流式socket读/写不满才说明缓冲区已经读空/写满
+         */
+        bool isStream() const { return m_isStream; }
+
         bool isClose() const { return m_isClosed; }
 
         void setUserNonblock(bool v) { m_userNonBlock = v; }
@@ -43,6 +48,7 @@ namespace Server {
     private:
         bool m_isInit: 1;
         bool m_isSocket: 1;
+        bool m_isStream: 1;
         bool m_sysNonBlock: 1;
         bool m_isClosed: 1;
         bool m_userNonBlock: 1;
@@ -5,8 +5,11 @@
 #include "Fiber.h"
 #include "Config.h"
 #include <atomic>
+#include <cstring>
 #include <utility>
+#include <vector>
 #include "Scheduler.h"
+#include "FiberStack.h"
 
 namespace Server {
 
@@ -18,50 +21,75 @@ namespace Server {
     static thread_local Fiber *t_fiber = nullptr; //　临时　sub fiber
     static thread_local Fiber::ptr t_thread_fiber = nullptr; //main_fiber
 
-    static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
-            Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024,
-                                     "fiber stack size");
+    ///栈从池里取，释放时还回池里
+    using StackAllocator = StackPool;
 
-    class MallocStackAllocator {
-    public:
-        static void *Alloc(size_t size) {
-            return malloc(size);
-        }
+    static ConfigVar<uint32_t>::ptr g_fiber_pool_local_max =
+            Config::Lookup<uint32_t>("fiber.pool.local_max", 16,
+                                     "max terminated fibers cached per thread for reuse");
+
+    static std::atomic<size_t> s_pool_local_max = {16};
 
-        static void Dealloc(void *vp, size_t size) {
-            return free(vp);
+    struct _FiberPoolIniter {
+        _FiberPoolIniter() {
+            s_pool_local_max = g_fiber_pool_local_max->getValue();
+            g_fiber_pool_local_max->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.pool.local_max changed from " << old_value << " to " << new_value;
+                s_pool_local_max = new_value;
+            });
         }
     };
 
-    using StackAllocator = MallocStackAllocator;
+    static _FiberPoolIniter s_fiber_pool_initer;
 
+    /**
+     * @brief 线程本地的协程池，缓存已经结束的协程，线程退出时删除
+     */
+    struct FiberCache {
+        std::vector<Fiber *> fibers;
+
+        ~FiberCache();
+    };
 
-    Fiber::Fiber(std::function<void()> cb, size_t stack_size, bool use_caller) :
+    static thread_local FiberCache t_fiber_cache;
+    /// 线程退出时协程池可能先于其他线程局部变量析构，之后释放的协程直接删除
+    static thread_local bool t_fiber_cache_destroyed = false;
+
+    FiberCache::~FiberCache() {
+        t_fiber_cache_destroyed = true;
+        for (auto fiber: fibers) {
+            delete fiber;
+        }
+    }
+
+
+    Fiber::Fiber(Task cb, size_t stack_size, bool use_caller, bool private_stack) :
             m_id(++s_fiber_id), m_cb(std::move(cb)) {
         ++s_fiber_count;
-        m_stack_size = stack_size ? stack_size : g_fiber_stack_size->getValue();
-        m_stack = StackAllocator::Alloc(m_stack_size);
-        if (getcontext(&m_ctx)) {
-            SERVER_ASSERT2(false, "getcontext");
+        if (!stack_size && !use_caller && !private_stack && SharedStack::Enabled()) {
+            ///共享栈模式：第一次切入时才绑定当前线程的共享栈，上下文也在那时构造
+            m_shared = true;
+            return;
+        }
+        if (stack_size) {
+            m_stack_size = stack_size;
+            m_stack = StackAllocator::Alloc(m_stack_size);
+        } else {
+            m_adaptiveStack = true;
+            chooseStack();
         }
-
-        m_ctx.uc_link = nullptr;
-        m_ctx.uc_stack.ss_size = m_stack_size;
-        m_ctx.uc_stack.ss_sp = m_stack;
         if (!use_caller) {
             /// 这里没有直接将cb作为this fiber执行的回调，而是静态设置为MainFunc，在MainFunc中再执行cb, Hook operation
-            makecontext(&m_ctx, MainFunc, 0);
+            context_make(m_ctx, m_stack, m_stack_size, MainFunc);
         } else {
-            makecontext(&m_ctx, MainFuncCaller, 0);
+            context_make(m_ctx, m_stack, m_stack_size, MainFuncCaller);
         }
     }
 
     Fiber::Fiber() {
         m_state = EXEC;
         SetThis(this);
-        if (getcontext(&m_ctx)) {
-            SERVER_ASSERT2(false, "getcontext");
-        }
+        ///线程主协程的上下文在第一次切出时保存
         s_fiber_count++;
     }
 
@@ -71,21 +99,25 @@ namespace Server {
 
     Fiber::ptr Fiber::GetThis() {
         if (t_fiber) {
-            return t_fiber->shared_from_this();
+            return ptr(t_fiber);
         }
         Fiber::ptr main_fiber(new Fiber);
         SERVER_ASSERT(t_fiber == main_fiber.get());
         t_thread_fiber = main_fiber;
-        return t_fiber->shared_from_this();
+        return main_fiber;
     }
 
 
     Fiber::~Fiber() {
         --s_fiber_count;
         LOGD(LOG_ROOT()) << "~Fiber,fiberId=" << m_id;
-        if (m_stack) {
+        if (m_stack || m_shared) {
             SERVER_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT)
-            StackAllocator::Dealloc(m_stack, m_stack_size);
+            recordStack();
+            if (m_stack) {
+                StackAllocator::Dealloc(m_stack, m_stack_size);
+            }
+            free(m_saved);
         } else {
             SERVER_ASSERT(!m_cb);
             SERVER_ASSERT(m_state == EXEC);
@@ -96,33 +128,142 @@ namespace Server {
         }
     }
 
-    void Fiber::reset(std::function<void()> cb) {
+    Fiber::ptr Fiber::Create(Task cb) {
+        auto &fibers = t_fiber_cache.fibers;
+        if (!t_fiber_cache_destroyed && !fibers.empty()) {
+            Fiber *fiber = fibers.back();
+            fibers.pop_back();
+            ///复用的协程是一个新协程，换一个id
+            fiber->m_id = ++s_fiber_id;
+            fiber->reset(std::move(cb));
+            return ptr(fiber);
+        }
+        ptr fiber(new Fiber(std::move(cb)));
+        fiber->m_poolable = true;
+        return fiber;
+    }
+
+    void Fiber::Recycle(Fiber *fiber) {
+        ///挂起中的协程不会回收，交给析构函数报错
+        bool finished = fiber->m_state == TERM || fiber->m_state == INIT || fiber->m_state == EXCEPT;
+        if (fiber->m_poolable && finished && !t_fiber_cache_destroyed) {
+            auto &fibers = t_fiber_cache.fibers;
+            if (fibers.size() < s_pool_local_max) {
+                ///异常结束的协程还持有回调，先释放回调捕获的对象；回调析构时可能又回收别的协程，所以先清再入池
+                fiber->m_cb = nullptr;
+                fibers.push_back(fiber);
+                return;
+            }
+        }
+        delete fiber;
+    }
+
+    void Fiber::reset(Task cb) {
         ///  m_stack must be exist when reset
-        SERVER_ASSERT(m_stack);
+        SERVER_ASSERT(m_stack || m_shared);
         /// m_state must be TERN or INIT or EXCEPT when reset, m_state in running can not be reset.
         SERVER_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
 
+        recordStack();
         m_cb = std::move(cb);
-        if (getcontext(&m_ctx)) {
-            SERVER_ASSERT2(false, "getcontext");
-        }
-        m_ctx.uc_link = nullptr;
-        m_ctx.uc_stack.ss_size = m_stack_size;
-        m_ctx.uc_stack.ss_sp = m_stack;
-        /// 这里没有直接将cb作为this fiber执行的回调，而是静态设置为MainFunc，在MainFunc中再执行ｃｂ
-        makecontext(&m_ctx, MainFunc, 0);
+        if (!m_shared) {
+            if (m_adaptiveStack) {
+                chooseStack();
+            }
+            /// 这里没有直接将cb作为this fiber执行的回调，而是静态设置为MainFunc，在MainFunc中再执行ｃｂ
+            context_make(m_ctx, m_stack, m_stack_size, MainFunc);
+        }
         m_state = INIT;
     }
 
+    void Fiber::chooseStack() {
+        ///采样的协程用fiber.stack_size，测出来的用量不受档位限制；不知道创建点的协程不采样
+        m_site = m_cb.site();
+        bool sample = m_site && StackProfiler::ShouldSample();
+        size_t size = sample ? StackPool::DefaultSize() : StackProfiler::SizeFor(m_site);
+        if (!m_stack || size != m_stack_size) {
+            if (m_stack) {
+                StackAllocator::Dealloc(m_stack, m_stack_size);
+            }
+            m_stack_size = size;
+            m_stack = StackAllocator::Alloc(m_stack_size);
+        }
+        m_paintDepth = sample ? StackProfiler::Paint(m_site, m_stack, m_stack_size) : 0;
+    }
+
+    void Fiber::recordStack() {
+        ///没有执行过的协程不记录
+        if (m_paintDepth && m_state != INIT) {
+            StackProfiler::Record(m_site, m_stack, m_stack_size, m_paintDepth);
+        }
+        m_paintDepth = 0;
+    }
+
+    void Fiber::enterSharedStack() {
+        if (!m_sharedStack) {
+            m_sharedStack = SharedStack::Next();
+            m_stack_size = m_sharedStack->size;
+            m_boundThread = GetThreadId();
+        }
+        SharedStack &stack = *m_sharedStack;
+        if (stack.occupant == this) {
+            ///上次切出之后没有别的协程用过这个栈
+            return;
+        }
+        if (stack.occupant) {
+            stack.occupant->saveSharedStack();
+        }
+        if (m_state == INIT) {
+            context_make(m_ctx, stack.stack, stack.size, MainFunc);
+        } else {
+            memcpy((char *) stack.stack + stack.size - m_savedSize, m_saved, m_savedSize);
+        }
+        stack.occupant = this;
+    }
+
+    void Fiber::saveSharedStack() {
+        char *top = (char *) m_sharedStack->stack + m_sharedStack->size;
+        auto *sp = (char *) context_sp(m_ctx);
+        size_t used = top - sp;
+        ///缓冲区按用到的大小分配，明显偏大时缩小，空闲协程只占实际用到的内存
+        if (used > m_savedCapacity || used < m_savedCapacity / 4) {
+            free(m_saved);
+            m_saved = (char *) malloc(used);
+            SERVER_ASSERT(m_saved || !used)
+            m_savedCapacity = used;
+        }
+        memcpy(m_saved, sp, used);
+        m_savedSize = used;
+    }
+
+    void Fiber::leaveSharedStack() {
+        ///执行结束，栈上没有要保存的数据了，下次执行可以换到别的线程和别的共享栈
+        if (m_sharedStack->occupant == this) {
+            m_sharedStack->occupant = nullptr;
+        }
+        m_sharedStack.reset();
+        m_boundThread = -1;
+        free(m_saved);
+        m_saved = nullptr;
+        m_savedSize = m_savedCapacity = 0;
+    }
+
     void Fiber::swapIn() {
         SetThis(this);
         SERVER_ASSERT(m_state != EXEC)
+        if (m_shared) {
+            enterSharedStack();
+        }
         m_state = EXEC;
         /// old fiber context ----> new fiber context
 //        LOGD(LOG_ROOT()) << "Fiber::swapIn==>" << "[FiberId:" <<
 //                         Scheduler::GetMainScheduleFiber()->m_id << "]" << "--->" << "[FiberId:" << m_id << "]";
-        if (swapcontext(&(Scheduler::GetMainScheduleFiber()->m_ctx), &m_ctx)) {
-            SERVER_ASSERT2(false, "swapcontext");
+        context_swap(Scheduler::GetMainScheduleFiber()->m_ctx, m_ctx);
+        /// 回到这里说明该协程的上下文已经保存完毕，YieldToHold切出的协程此时才置为HOLD
+        if (m_state == EXEC) {
+            m_state = HOLD;
+        } else if (m_shared && (m_state == TERM || m_state == EXCEPT)) {
+            leaveSharedStack();
         }
     }
 
@@ -131,9 +272,7 @@ namespace Server {
         SetThis(Scheduler::GetMainScheduleFiber());
 //        LOGD(LOG_ROOT()) << "Fiber::swapOut==>" << "[FiberId:" << m_id << "]" << "--->" << "[FiberId:"
 //                         << Scheduler::GetMainScheduleFiber()->m_id << "]";
-        if (swapcontext(&m_ctx, &(Scheduler::GetMainScheduleFiber()->m_ctx))) {
-            SERVER_ASSERT2(false, "swap context")
-        }
+        context_swap(m_ctx, Scheduler::GetMainScheduleFiber()->m_ctx);
     }
 
     void Fiber::call() {
@@ -141,32 +280,31 @@ namespace Server {
         m_state = EXEC;
         LOGD(LOG_ROOT()) << "Fiber::call==>" << "[FiberId:" << t_thread_fiber->m_id << "]"
                          << "--->" << "[FiberId:" << m_id << "]";
-        if (swapcontext(&t_thread_fiber->m_ctx, &m_ctx)) {
-            SERVER_ASSERT2(false, "swap context");
-        }
+        context_swap(t_thread_fiber->m_ctx, m_ctx);
     }
 
     void Fiber::back() {
         SetThis(t_thread_fiber.get());
         LOGD(LOG_ROOT()) << "Fiber::back==>" << "[FiberId:" << m_id << "]" << "--->"
                          << "[FiberId:" << t_thread_fiber->m_id << "]";
-        if (swapcontext(&m_ctx, &t_thread_fiber->m_ctx)) {
-            SERVER_ASSERT2(false, "swap context");
-        }
+        context_swap(m_ctx, t_thread_fiber->m_ctx);
     }
 
     void Fiber::YieldToReady() {
-        /// get current fiber
-        Fiber::ptr curFiber = GetThis();
+        /// get current fiber，调度方在swapIn期间持有引用，这里不用再加引用
+        Fiber *curFiber = t_fiber;
+        SERVER_ASSERT(curFiber)
         curFiber->m_state = READY;
         /// current fiber swap out to background
         curFiber->swapOut();
     }
 
     void Fiber::YieldToHold() {
-        /// get current fiber
-        Fiber::ptr curFiber = GetThis();
-        curFiber->m_state = HOLD;
+        /// get current fiber，调度方在swapIn期间持有引用，这里不用再加引用
+        Fiber *curFiber = t_fiber;
+        SERVER_ASSERT(curFiber)
+        /// 这里保持EXEC状态，由swapIn在上下文切换完成后再置为HOLD，
+        /// 否则其他线程可能在上下文保存完成之前就把该协程swapIn
         /// current fiber swap out to background
         curFiber->swapOut();
     }
@@ -176,7 +314,8 @@ namespace Server {
     }
 
     void Fiber::MainFunc() {
-        Fiber::ptr currentFiber = GetThis();
+        ///调度方在swapIn期间持有引用，这里用裸指针，切出时不用增减引用计数
+        Fiber *currentFiber = t_fiber;
         SERVER_ASSERT(currentFiber)
         LOGD(LOG_ROOT()) << " Fiber::MainFunc Execute";
         try {
@@ -190,16 +329,14 @@ namespace Server {
             currentFiber->m_state = EXCEPT;
             LOGE(LOG_ROOT()) << "Fiber Except";
         }
-        auto raw_ptr = currentFiber.get();
-        ///release this currentFiber reference, decrease a reference
-        currentFiber.reset();
         /// current fiber execute finish , return last fiber continue execute
         LOGD(LOG_ROOT()) << "Fiber will swapOut From MainFunc";
-        raw_ptr->swapOut();
+        currentFiber->swapOut();
     }
 
     void Fiber::MainFuncCaller() {
-        Fiber::ptr currentFiber = GetThis();
+        ///调度方在swapIn期间持有引用，这里用裸指针，切出时不用增减引用计数
+        Fiber *currentFiber = t_fiber;
         SERVER_ASSERT(currentFiber)
         LOGD(LOG_ROOT()) << "Fiber::MainFuncCaller Execute";
         try {
@@ -213,12 +350,9 @@ namespace Server {
             currentFiber->m_state = EXCEPT;
             LOGE(LOG_ROOT()) << "Fiber Except";
         }
-        auto raw_ptr = currentFiber.get();
-        ///release this currentFiber reference, decrease a reference
-        currentFiber.reset();
         /// current fiber execute finish , return last fiber continue execute
         LOGD(LOG_ROOT()) << "Fiber will back From MainFuncCaller";
-        raw_ptr->back();
+        currentFiber->back();
     }
 
     uint64_t Fiber::GetFiberId() {
@@ -226,5 +360,9 @@ namespace Server {
         return 0;
     }
 
+    bool Fiber::IsSharedStack() {
+        return t_fiber && t_fiber->m_shared;
+    }
+
 
 }
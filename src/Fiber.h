@@ -5,10 +5,13 @@
 #ifndef SERVER_FIBER_H
 #define SERVER_FIBER_H
 
+#include <atomic>
 #include <memory>
-#include <ucontext.h>
+#include "FiberContext.h"
+#include "FiberStack.h"
 #include "Thread.h"
 #include <functional>
+#include "Task.h"
 
 
 namespace Server {
@@ -21,15 +24,74 @@ namespace Server {
     /// [Server::Fiber::ptr fiber(new Server::Fiber(run_in_fiber))] can create a sub fiber
     /// sub_fiber->swapIn(); //switch sub_fiber execute, and suspend main fiber
     /// sub fiber swapOut by [YieldToReady], switch main fiber continue execute from suspend point
-    class Fiber : public std::enable_shared_from_this<Fiber> {
-        /**继承enable_shared_from_this，会提一个方法，可以获取当前类的智能指针
+    class Fiber {
+        /** 引用计数放在Fiber对象里(侵入式)，从裸指针随时可以得到Fiber::ptr，
          * 同时Fiber不能在栈上创建对象了，
          * */
         friend class Scheduler;
 
     public:
-        ///shard_ptr: https://blog.csdn.net/hj605635529/article/details/76984839
-        typedef std::shared_ptr<Fiber> ptr;
+        /**
+         * @brief 协程的智能指针，侵入式引用计数，不需要单独分配控制块
+         * 最后一个引用释放时，Fiber::Create创建的已结束协程连同栈一起回到当前线程的协程池
+         */
+        class ptr {
+        public:
+            ptr() noexcept = default;
+
+            ptr(std::nullptr_t) noexcept {}
+
+            explicit ptr(Fiber *fiber) noexcept : m_fiber(fiber) {
+                if (m_fiber) {
+                    m_fiber->m_refs.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            ptr(const ptr &other) noexcept : ptr(other.m_fiber) {}
+
+            ptr(ptr &&other) noexcept : m_fiber(other.m_fiber) {
+                other.m_fiber = nullptr;
+            }
+
+            ~ptr() {
+                if (m_fiber) {
+                    Release(m_fiber);
+                }
+            }
+
+            ptr &operator=(const ptr &other) {
+                ptr(other).swap(*this);
+                return *this;
+            }
+
+            ptr &operator=(ptr &&other) {
+                ptr(std::move(other)).swap(*this);
+                return *this;
+            }
+
+            void reset(Fiber *fiber = nullptr) {
+                ptr(fiber).swap(*this);
+            }
+
+            void swap(ptr &other) noexcept {
+                std::swap(m_fiber, other.m_fiber);
+            }
+
+            Fiber *get() const noexcept { return m_fiber; }
+
+            Fiber *operator->() const noexcept { return m_fiber; }
+
+            Fiber &operator*() const noexcept { return *m_fiber; }
+
+            explicit operator bool() const noexcept { return m_fiber != nullptr; }
+
+            bool operator==(const ptr &other) const noexcept { return m_fiber == other.m_fiber; }
+
+            bool operator==(std::nullptr_t) const noexcept { return m_fiber == nullptr; }
+
+        private:
+            Fiber *m_fiber = nullptr;
+        };
 
         /**
          * @brief 协程状态
@@ -52,12 +114,22 @@ namespace Server {
     public:
         explicit Fiber();
 
-        explicit Fiber(std::function<void()> cb, size_t stack_size = 0,bool use_caller =false);
+        /**
+         * @param[in] stack_size 栈大小，0表示fiber.stack_size
+         * @param[in] private_stack 开启共享栈时也使用独立的栈；指定了stack_size或use_caller的协程总是使用独立的栈
+         */
+        explicit Fiber(Task cb, size_t stack_size = 0, bool use_caller = false, bool private_stack = false);
 
         ~Fiber();
 
+        /**
+         * @brief 创建一个默认配置的协程，优先复用当前线程协程池里已经结束的协程和它的栈
+         * 池的大小是fiber.pool.local_max；池里的协程保持入池时的栈模式(独立栈或共享栈)
+         */
+        static ptr Create(Task cb);
+
         ///重置协程函数，并重置状态为INIT
-        void reset(std::function<void()> cb);
+        void reset(Task cb);
 
         ///切换当前协程执行(main fiber suspend), main fiber ----> sub fiber
         void swapIn();
@@ -79,6 +151,11 @@ namespace Server {
 
         State getState() const { return m_state; }
 
+        /**
+         * @brief 共享栈上的协程只能在绑定的线程上恢复执行，-1表示没有绑定
+         */
+        int getBoundThread() const { return m_boundThread; }
+
 
     public:
         ///设置当前协程
@@ -94,7 +171,7 @@ namespace Server {
         static void YieldToHold();
 
 
-        ///总协程数
+        ///总协程数，包括协程池里缓存的
         static uint64_t TotalFibers();
 
         ///m_cb execute hook callback
@@ -105,13 +182,78 @@ namespace Server {
         ///get fiber id
         static uint64_t GetFiberId();
 
+        /**
+         * @brief 当前协程是否运行在共享栈上
+         * 共享栈上的协程挂起后栈会被别的协程覆盖，挂起期间别人要访问的对象(IO缓冲区、超时节点等)不能放在栈上
+         */
+        static bool IsSharedStack();
+
+    private:
+        /**
+         * @brief 释放一个引用，最后一个引用释放时回收或者删除协程
+         */
+        static void Release(Fiber *fiber) {
+            if (fiber->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                Recycle(fiber);
+            }
+        }
+
+        /**
+         * @brief 没有引用的协程：可以复用的放进当前线程的协程池，否则删除
+         */
+        static void Recycle(Fiber *fiber);
+
+        /**
+         * @brief 按创建点选择栈大小(fiber.stack_profile.adaptive)，大小变了换一个栈，采样的协程刷栈
+         */
+        void chooseStack();
+
+        /**
+         * @brief 执行结束后记录采样协程的栈用量
+         */
+        void recordStack();
+
+        /**
+         * @brief 切入前准备共享栈：第一次执行时绑定当前线程的共享栈，栈被别的协程占着时先把它的数据存起来，再恢复自己的
+         */
+        void enterSharedStack();
+
+        /**
+         * @brief 把切出时栈上用到的部分拷贝到m_saved
+         */
+        void saveSharedStack();
+
+        /**
+         * @brief 执行结束，解除和共享栈、线程的绑定
+         */
+        void leaveSharedStack();
+
     private:
+        /// 引用计数，只在Fiber::ptr复制和析构时修改，切换协程时不碰
+        std::atomic<uint32_t> m_refs = {0};
+        /// 由Create创建，结束后可以回到协程池
+        bool m_poolable = false;
         uint64_t m_id = 0;
         uint64_t m_stack_size = 0;
         State m_state = INIT;
-        ucontext_t m_ctx{};
+        FiberContext m_ctx{};
         void *m_stack = nullptr;
-        std::function<void()> m_cb;
+        Task m_cb;
+        /// 没有指定栈大小，按创建点选择
+        bool m_adaptiveStack = false;
+        /// 栈顶刷过花纹的字节数，结束时记录用量，0表示这次没有采样
+        size_t m_paintDepth = 0;
+        /// 创建点，见Task::site
+        const void *m_site = nullptr;
+        /// 是否运行在共享栈上
+        bool m_shared = false;
+        /// 绑定的线程，-1表示没有绑定
+        int m_boundThread = -1;
+        SharedStack::ptr m_sharedStack;
+        /// 别的协程使用共享栈时保存的栈数据
+        char *m_saved = nullptr;
+        size_t m_savedSize = 0;
+        size_t m_savedCapacity = 0;
     };
 }
 
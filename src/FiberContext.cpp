@@ -0,0 +1,142 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "FiberContext.h"
+#include "Log.h"
+#include <cstdint>
+#include <cstring>
+
+#ifndef SERVER_FIBER_USE_UCONTEXT
+
+/**
+ * @brief 保存被调用者保存的寄存器到当前栈上，*from_sp = 当前栈指针，然后切到to_sp上恢复寄存器并返回
+ * 切换就是一次普通的函数调用，调用者保存的寄存器已经由编译器处理
+ */
+extern "C" void server_fiber_context_swap(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+/// 栈帧(从低到高)：mxcsr和x87控制字(8字节)、r15、r14、r13、r12、rbx、rbp、返回地址
+asm(R"(
+    .text
+    .globl server_fiber_context_swap
+    .hidden server_fiber_context_swap
+    .type server_fiber_context_swap, @function
+    .p2align 4
+server_fiber_context_swap:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size server_fiber_context_swap, .-server_fiber_context_swap
+)");
+#elif defined(__aarch64__)
+/// 栈帧(从低到高)：x19-x28、x29(fp)、x30(lr)、d8-d15，共160字节
+asm(R"(
+    .text
+    .globl server_fiber_context_swap
+    .hidden server_fiber_context_swap
+    .type server_fiber_context_swap, %function
+    .p2align 4
+server_fiber_context_swap:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    ret
+    .size server_fiber_context_swap, .-server_fiber_context_swap
+)");
+#endif
+
+#endif
+
+namespace Server {
+
+#ifdef SERVER_FIBER_USE_UCONTEXT
+
+    void context_make(FiberContext &ctx, void *stack, size_t size, void (*fn)()) {
+        if (getcontext(&ctx.ctx)) {
+            SERVER_ASSERT2(false, "getcontext");
+        }
+        ctx.ctx.uc_link = nullptr;
+        ctx.ctx.uc_stack.ss_size = size;
+        ctx.ctx.uc_stack.ss_sp = stack;
+        makecontext(&ctx.ctx, fn, 0);
+    }
+
+    void context_swap(FiberContext &from, FiberContext &to) {
+        if (swapcontext(&from.ctx, &to.ctx)) {
+            SERVER_ASSERT2(false, "swapcontext");
+        }
+    }
+
+#else
+
+    void context_make(FiberContext &ctx, void *stack, size_t size, void (*fn)()) {
+        ///栈顶按16字节对齐，伪造一个切出时保存的栈帧，第一次切换进来时ret到fn
+        auto top = (uintptr_t) stack + size;
+        top &= ~(uintptr_t) 15;
+#if defined(__x86_64__)
+        auto *frame = (uint64_t *) top - 9;
+        memset(frame, 0, 9 * sizeof(uint64_t));
+        ///mxcsr和x87控制字取默认值
+        uint32_t mxcsr = 0x1F80;
+        uint16_t fpucw = 0x037F;
+        memcpy(frame, &mxcsr, sizeof(mxcsr));
+        memcpy((char *) frame + 4, &fpucw, sizeof(fpucw));
+        ///frame[1..6]是r15到rbp，frame[7]是返回地址；ret之后rsp指向frame[8]，
+        ///相当于fn刚被call进来(rsp + 8按16字节对齐)，frame[8]作为fn的返回地址，fn不会返回
+        frame[7] = (uint64_t) fn;
+#elif defined(__aarch64__)
+        auto *frame = (uint64_t *) top - 20;
+        memset(frame, 0, 20 * sizeof(uint64_t));
+        ///x30(lr)，ret之后sp回到栈顶
+        frame[11] = (uint64_t) fn;
+#endif
+        ctx.sp = frame;
+    }
+
+    void context_swap(FiberContext &from, FiberContext &to) {
+        server_fiber_context_swap(&from.sp, to.sp);
+    }
+
+#endif
+}
@@ -0,0 +1,64 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_FIBERCONTEXT_H
+#define SERVER_FIBERCONTEXT_H
+
+#include <cstddef>
+
+///构建时定义SERVER_FIBER_UCONTEXT或者不是x86-64/aarch64时用ucontext，否则用汇编实现的切换
+///AddressSanitizer只认识swapcontext，不知道汇编切走的栈帧已经废弃，开启时也用ucontext
+#if defined(SERVER_FIBER_UCONTEXT) || !(defined(__x86_64__) || defined(__aarch64__)) || defined(__SANITIZE_ADDRESS__)
+#define SERVER_FIBER_USE_UCONTEXT 1
+#include <ucontext.h>
+#endif
+
+namespace Server {
+
+    /**
+     * @brief 协程的执行上下文
+     * 汇编实现只在切出时把被调用者保存的寄存器压到自己的栈上，上下文里只记下栈指针；
+     * 不像swapcontext那样每次切换都通过rt_sigprocmask系统调用保存和恢复信号掩码
+     */
+    struct FiberContext {
+#ifdef SERVER_FIBER_USE_UCONTEXT
+        ucontext_t ctx{};
+#else
+        void *sp = nullptr;
+#endif
+    };
+
+#ifdef SERVER_FIBER_USE_UCONTEXT
+    /// ucontext拿不到切出时的栈指针，不支持共享栈
+    constexpr bool CONTEXT_HAS_SP = false;
+#else
+    constexpr bool CONTEXT_HAS_SP = true;
+#endif
+
+    /**
+     * @brief 切出时的栈指针，栈上从这里到栈顶是正在使用的部分
+     * @pre CONTEXT_HAS_SP
+     */
+    inline void *context_sp(const FiberContext &ctx) {
+#ifdef SERVER_FIBER_USE_UCONTEXT
+        return nullptr;
+#else
+        return ctx.sp;
+#endif
+    }
+
+    /**
+     * @brief 在栈上构造上下文，第一次切换进去时执行fn
+     * @pre fn不能返回
+     */
+    void context_make(FiberContext &ctx, void *stack, size_t size, void (*fn)());
+
+    /**
+     * @brief 保存当前上下文到from，切换到to
+     * 切回from时从这里返回
+     */
+    void context_swap(FiberContext &from, FiberContext &to);
+}
+
+#endif //SERVER_FIBERCONTEXT_H
@@ -0,0 +1,626 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "FiberStack.h"
+#include "FiberContext.h"
+#include "Config.h"
+#include "Mutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Server {
+
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
+            Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024,
+                                     "fiber stack size");
+
+    static ConfigVar<uint32_t>::ptr g_stack_pool_local_max =
+            Config::Lookup<uint32_t>("fiber.stack_pool.local_max", 16,
+                                     "max idle fiber stacks cached per thread");
+
+    static ConfigVar<uint32_t>::ptr g_stack_pool_global_max =
+            Config::Lookup<uint32_t>("fiber.stack_pool.global_max", 256,
+                                     "max idle fiber stacks cached in the global overflow list");
+
+    static ConfigVar<std::string>::ptr g_stack_allocator =
+            Config::Lookup<std::string>("fiber.stack_allocator", "malloc",
+                                        "fiber stack allocator: malloc or mmap(guard page, lazy commit), "
+                                        "fixed when the first fiber stack is allocated");
+
+    static ConfigVar<std::string>::ptr g_stack_release =
+            Config::Lookup<std::string>("fiber.stack_release", "none",
+                                        "give back the memory of mmap stacks returned to the pool: none, dontneed or free");
+
+    static ConfigVar<bool>::ptr g_shared_stack_enable =
+            Config::Lookup<bool>("fiber.shared_stack.enable", false,
+                                 "run fibers on a few per-thread shared stacks and copy out the used part on switch");
+
+    static ConfigVar<uint32_t>::ptr g_shared_stack_count =
+            Config::Lookup<uint32_t>("fiber.shared_stack.count", 4,
+                                     "shared stacks per thread");
+
+    static ConfigVar<uint32_t>::ptr g_shared_stack_size =
+            Config::Lookup<uint32_t>("fiber.shared_stack.size", 1024 * 1024,
+                                     "size of each shared stack");
+
+    static ConfigVar<bool>::ptr g_stack_profile_enable =
+            Config::Lookup<bool>("fiber.stack_profile.enable", false,
+                                 "paint sampled fiber stacks and record their high-water mark per creation site");
+
+    static ConfigVar<uint32_t>::ptr g_stack_profile_sample_rate =
+            Config::Lookup<uint32_t>("fiber.stack_profile.sample_rate", 16,
+                                     "paint one of every N fibers, 1 paints all of them");
+
+    static ConfigVar<bool>::ptr g_stack_profile_adaptive =
+            Config::Lookup<bool>("fiber.stack_profile.adaptive", false,
+                                 "size new fibers from the observed stack usage of their creation site, "
+                                 "needs the mmap stack allocator so an overflow hits the guard page");
+
+    static std::atomic<size_t> s_stack_size = {1024 * 1024};
+    static std::atomic<size_t> s_local_max = {16};
+    static std::atomic<size_t> s_global_max = {256};
+    static std::atomic<int> s_stack_release = {0};
+    static std::atomic<bool> s_shared_stack = {false};
+    static std::atomic<size_t> s_shared_stack_count = {4};
+    static std::atomic<size_t> s_shared_stack_size = {1024 * 1024};
+    static std::atomic<bool> s_profile_enable = {false};
+    static std::atomic<uint32_t> s_profile_sample_rate = {16};
+    static std::atomic<bool> s_profile_adaptive = {false};
+
+    /**
+     * @brief 解析fiber.stack_release，返回madvise的参数，0表示不归还
+     */
+    static int parse_stack_release(const std::string &value) {
+        if (value == "dontneed") return MADV_DONTNEED;
+        if (value == "free") return MADV_FREE;
+        if (value != "none") {
+            LOGE(LOG_ROOT()) << "unknown fiber.stack_release=" << value << ", use none";
+        }
+        return 0;
+    }
+
+    struct _StackPoolIniter {
+        _StackPoolIniter() {
+            s_stack_size = g_fiber_stack_size->getValue();
+            s_local_max = g_stack_pool_local_max->getValue();
+            s_global_max = g_stack_pool_global_max->getValue();
+            s_stack_release = parse_stack_release(g_stack_release->getValue());
+            s_shared_stack = g_shared_stack_enable->getValue();
+            s_shared_stack_count = std::max<uint32_t>(1, g_shared_stack_count->getValue());
+            s_shared_stack_size = g_shared_stack_size->getValue();
+            s_profile_enable = g_stack_profile_enable->getValue();
+            s_profile_sample_rate = std::max<uint32_t>(1, g_stack_profile_sample_rate->getValue());
+            s_profile_adaptive = g_stack_profile_adaptive->getValue();
+            g_fiber_stack_size->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_size changed from " << old_value << " to " << new_value;
+                s_stack_size = new_value;
+            });
+            g_stack_pool_local_max->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_pool.local_max changed from " << old_value << " to " << new_value;
+                s_local_max = new_value;
+            });
+            g_stack_pool_global_max->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_pool.global_max changed from " << old_value << " to " << new_value;
+                s_global_max = new_value;
+            });
+            g_stack_release->addChangeCallback([](const std::string &old_value, const std::string &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_release changed from " << old_value << " to " << new_value;
+                s_stack_release = parse_stack_release(new_value);
+            });
+            g_shared_stack_enable->addChangeCallback([](const bool &old_value, const bool &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.shared_stack.enable changed from " << old_value << " to " << new_value;
+                if (new_value && !CONTEXT_HAS_SP) {
+                    LOGE(LOG_ROOT()) << "fiber.shared_stack.enable needs the assembly context switch, ignored";
+                }
+                s_shared_stack = new_value;
+            });
+            g_shared_stack_count->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.shared_stack.count changed from " << old_value << " to " << new_value;
+                s_shared_stack_count = std::max<uint32_t>(1, new_value);
+            });
+            g_shared_stack_size->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.shared_stack.size changed from " << old_value << " to " << new_value;
+                s_shared_stack_size = new_value;
+            });
+            g_stack_profile_enable->addChangeCallback([](const bool &old_value, const bool &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_profile.enable changed from " << old_value << " to " << new_value;
+                s_profile_enable = new_value;
+            });
+            g_stack_profile_sample_rate->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_profile.sample_rate changed from " << old_value << " to " << new_value;
+                s_profile_sample_rate = std::max<uint32_t>(1, new_value);
+            });
+            g_stack_profile_adaptive->addChangeCallback([](const bool &old_value, const bool &new_value) {
+                LOGI(LOG_ROOT()) << "fiber.stack_profile.adaptive changed from " << old_value << " to " << new_value;
+                s_profile_adaptive = new_value;
+            });
+        }
+    };
+
+    static _StackPoolIniter s_stack_pool_initer;
+
+    class MallocStackAllocator {
+    public:
+        static void *Alloc(size_t size) {
+            return malloc(size);
+        }
+
+        static void Dealloc(void *vp, size_t size) {
+            return free(vp);
+        }
+    };
+
+    /**
+     * @brief 栈底下面多映射一个PROT_NONE的保护页，栈溢出直接SIGSEGV而不是踩坏别的内存
+     * MAP_NORESERVE不预留交换空间，物理页在第一次访问时才分配，大量协程时常驻内存只和实际用到的栈深度有关
+     */
+    class MmapStackAllocator {
+    public:
+        static void *Alloc(size_t size) {
+            const size_t page = PageSize();
+            void *vp = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+            SERVER_ASSERT2(vp != MAP_FAILED, "mmap fiber stack")
+            if (mprotect(vp, page, PROT_NONE)) {
+                SERVER_ASSERT2(false, "mprotect fiber stack guard page")
+            }
+            return (char *) vp + page;
+        }
+
+        static void Dealloc(void *vp, size_t size) {
+            const size_t page = PageSize();
+            munmap((char *) vp - page, size + page);
+        }
+
+        /**
+         * @brief 归还空闲栈的物理页，只保留栈顶一页(马上又会用到)
+         */
+        static void Release(void *vp, size_t size, int advice) {
+            const size_t page = PageSize();
+            if (size <= page) return;
+            size_t len = (size - page) & ~(page - 1);
+            if (madvise(vp, len, advice) && advice == MADV_FREE) {
+                ///内核不支持MADV_FREE(4.5之前)，退回MADV_DONTNEED
+                s_stack_release = MADV_DONTNEED;
+                madvise(vp, len, MADV_DONTNEED);
+            }
+        }
+
+        static size_t PageSize() {
+            static const size_t page = sysconf(_SC_PAGESIZE);
+            return page;
+        }
+    };
+
+    /**
+     * @brief 按fiber.stack_allocator选择，第一次分配栈时确定，之后不再改变，保证栈由分配它的方式释放
+     */
+    class StackAllocator {
+    public:
+        static void *Alloc(size_t size) {
+            return UseMmap() ? MmapStackAllocator::Alloc(size) : MallocStackAllocator::Alloc(size);
+        }
+
+        static void Dealloc(void *vp, size_t size) {
+            if (UseMmap()) {
+                MmapStackAllocator::Dealloc(vp, size);
+            } else {
+                MallocStackAllocator::Dealloc(vp, size);
+            }
+        }
+
+        /**
+         * @brief 栈放回池里时按fiber.stack_release归还物理页，只对mmap的栈生效
+         */
+        static void Release(void *vp, size_t size) {
+            int advice = s_stack_release;
+            if (advice && UseMmap()) {
+                MmapStackAllocator::Release(vp, size, advice);
+            }
+        }
+
+        static bool HasGuardPage() {
+            return UseMmap();
+        }
+
+    private:
+        static bool UseMmap() {
+            static std::once_flag once;
+            static bool use_mmap = false;
+            std::call_once(once, [] {
+                const std::string allocator = g_stack_allocator->getValue();
+                use_mmap = allocator == "mmap";
+                if (!use_mmap && allocator != "malloc") {
+                    LOGE(LOG_ROOT()) << "unknown fiber.stack_allocator=" << allocator << ", use malloc";
+                }
+            });
+            return use_mmap;
+        }
+    };
+
+    /**
+     * @brief 一组同样大小的空闲栈
+     */
+    struct StackList {
+        size_t size = 0;
+        std::vector<void *> stacks;
+
+        /**
+         * @brief 栈大小改了，释放掉旧大小的栈
+         */
+        void resize(size_t new_size) {
+            if (size == new_size) return;
+            for (auto vp: stacks) {
+                StackAllocator::Dealloc(vp, size);
+            }
+            stacks.clear();
+            size = new_size;
+        }
+    };
+
+    /**
+     * @brief 栈大小对应的档位：第k档是fiber.stack_size >> k，不在档位上的大小不缓存
+     * @return -1表示不缓存
+     */
+    static int size_class(size_t size) {
+        const size_t base = s_stack_size;
+        for (int k = 0; k < StackPool::SIZE_CLASSES; k++) {
+            size_t class_size = base >> k;
+            if (class_size < StackPool::MIN_SIZE) {
+                break;
+            }
+            if (class_size == size) {
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief 全局溢出链表，每个档位一条
+     */
+    struct GlobalStackList {
+        Mutex mutex;
+        StackList lists[StackPool::SIZE_CLASSES];
+        std::atomic<size_t> count[StackPool::SIZE_CLASSES] = {};
+
+        /**
+         * @brief 放入栈，超出global_max的释放掉
+         */
+        void put(int k, std::vector<void *> &stacks, size_t size) {
+            {
+                Mutex::Lock lock(mutex);
+                StackList &list = lists[k];
+                list.resize(size);
+                while (!stacks.empty() && list.stacks.size() < s_global_max) {
+                    list.stacks.push_back(stacks.back());
+                    stacks.pop_back();
+                }
+                count[k] = list.stacks.size();
+            }
+            for (auto vp: stacks) {
+                StackAllocator::Dealloc(vp, size);
+            }
+            stacks.clear();
+        }
+
+        /**
+         * @brief 最多取出n个栈
+         */
+        void take(int k, std::vector<void *> &stacks, size_t size, size_t n) {
+            if (count[k].load(std::memory_order_relaxed) == 0) return;
+            Mutex::Lock lock(mutex);
+            StackList &list = lists[k];
+            if (list.size != size) return;
+            while (n-- > 0 && !list.stacks.empty()) {
+                stacks.push_back(list.stacks.back());
+                list.stacks.pop_back();
+            }
+            count[k] = list.stacks.size();
+        }
+    };
+
+    /// 不析构：线程退出时线程缓存还要还给它
+    static GlobalStackList &global_stacks() {
+        static auto *global = new GlobalStackList;
+        return *global;
+    }
+
+    /**
+     * @brief 线程缓存，线程退出时还给全局链表
+     */
+    struct LocalStackList {
+        StackList lists[StackPool::SIZE_CLASSES];
+
+        ~LocalStackList();
+    };
+
+    static thread_local LocalStackList t_stacks;
+    /// 线程缓存已经析构，之后在本线程释放的栈直接释放
+    static thread_local bool t_stacks_destroyed = false;
+
+    LocalStackList::~LocalStackList() {
+        t_stacks_destroyed = true;
+        for (int k = 0; k < StackPool::SIZE_CLASSES; k++) {
+            if (!lists[k].stacks.empty()) {
+                global_stacks().put(k, lists[k].stacks, lists[k].size);
+            }
+        }
+    }
+
+    void *StackPool::Alloc(size_t size) {
+        int k = size_class(size);
+        if (k >= 0 && !t_stacks_destroyed) {
+            StackList &local = t_stacks.lists[k];
+            local.resize(size);
+            if (local.stacks.empty()) {
+                ///一次取回一半的线程缓存，后面的分配不用再加锁
+                global_stacks().take(k, local.stacks, size, std::max<size_t>(1, s_local_max / 2));
+            }
+            if (!local.stacks.empty()) {
+                void *vp = local.stacks.back();
+                local.stacks.pop_back();
+                return vp;
+            }
+        }
+        return StackAllocator::Alloc(size);
+    }
+
+    void StackPool::Dealloc(void *vp, size_t size) {
+        const size_t local_max = s_local_max;
+        int k = size_class(size);
+        if (k < 0 || local_max == 0 || t_stacks_destroyed) {
+            StackAllocator::Dealloc(vp, size);
+            return;
+        }
+        StackList &local = t_stacks.lists[k];
+        local.resize(size);
+        StackAllocator::Release(vp, size);
+        local.stacks.push_back(vp);
+        if (local.stacks.size() > local_max) {
+            ///超出上限把一半还给全局链表，别的线程可以接着用
+            std::vector<void *> overflow(local.stacks.end() - (long) (local.stacks.size() / 2), local.stacks.end());
+            local.stacks.resize(local.stacks.size() - overflow.size());
+            global_stacks().put(k, overflow, size);
+        }
+    }
+
+    size_t StackPool::DefaultSize() {
+        return s_stack_size;
+    }
+
+    size_t StackPool::GlobalCached() {
+        size_t total = 0;
+        for (auto &count: global_stacks().count) {
+            total += count;
+        }
+        return total;
+    }
+
+    bool StackPool::HasGuardPage() {
+        return StackAllocator::HasGuardPage();
+    }
+
+    /// 刷栈的花纹
+    static constexpr uint64_t STACK_PAINT = 0x5AA5C33CF00FA55Aull;
+    /// 连续的有效样本数够了才按用量选择栈大小
+    static constexpr uint64_t ADAPTIVE_MIN_SAMPLES = 16;
+
+    /**
+     * @brief 一个创建点的统计
+     */
+    struct StackSite {
+        uint64_t samples = 0;
+        /// 最近连续的有效样本数(没有用满刷过的部分)
+        uint64_t exact = 0;
+        size_t maxUsed = 0;
+        /// 按用量选择的栈大小，0表示还没有选择(用fiber.stack_size)
+        size_t size = 0;
+    };
+
+    /**
+     * @brief 所有创建点的统计，选择的栈大小变化时generation加一，线程缓存据此失效
+     */
+    struct StackSites {
+        RWMutex mutex;
+        std::unordered_map<const void *, StackSite> sites;
+        std::atomic<uint64_t> generation = {0};
+    };
+
+    static StackSites &stack_sites() {
+        static auto *sites = new StackSites;
+        return *sites;
+    }
+
+    /**
+     * @brief 线程缓存的创建点栈大小，大部分查询不用加锁
+     */
+    struct LocalStackSites {
+        uint64_t generation = ~0ull;
+        size_t stackSize = 0;
+        std::unordered_map<const void *, size_t> sizes;
+    };
+
+    static thread_local LocalStackSites t_stack_sites;
+    static thread_local uint32_t t_sample_counter = 0;
+
+    /**
+     * @brief 用量的两倍向上取到档位，超过fiber.stack_size时用fiber.stack_size
+     */
+    static size_t adaptive_size(size_t used) {
+        const size_t base = s_stack_size;
+        size_t size = base;
+        for (int k = 1; k < StackPool::SIZE_CLASSES; k++) {
+            size_t class_size = base >> k;
+            if (class_size < StackPool::MIN_SIZE || class_size < used * 2) {
+                break;
+            }
+            size = class_size;
+        }
+        return size;
+    }
+
+    size_t StackProfiler::SizeFor(const void *site) {
+        const size_t base = s_stack_size;
+        if (!s_profile_adaptive || !site || !StackPool::HasGuardPage()) {
+            return base;
+        }
+        StackSites &global = stack_sites();
+        LocalStackSites &local = t_stack_sites;
+        uint64_t generation = global.generation.load(std::memory_order_acquire);
+        if (local.generation != generation || local.stackSize != base) {
+            local.sizes.clear();
+            local.generation = generation;
+            local.stackSize = base;
+        }
+        auto it = local.sizes.find(site);
+        if (it != local.sizes.end()) {
+            return it->second;
+        }
+        size_t size = base;
+        {
+            RWMutex::ReadLock lock(global.mutex);
+            auto site_it = global.sites.find(site);
+            if (site_it != global.sites.end() && site_it->second.size) {
+                size = site_it->second.size;
+            }
+        }
+        local.sizes.emplace(site, size);
+        return size;
+    }
+
+    bool StackProfiler::ShouldSample() {
+        if (!s_profile_enable && !s_profile_adaptive) {
+            return false;
+        }
+        return t_sample_counter++ % s_profile_sample_rate == 0;
+    }
+
+    size_t StackProfiler::Paint(const void *site, void *stack, size_t size) {
+        size_t used = 0;
+        {
+            StackSites &global = stack_sites();
+            RWMutex::ReadLock lock(global.mutex);
+            auto it = global.sites.find(site);
+            if (it != global.sites.end()) {
+                used = it->second.maxUsed;
+            }
+        }
+        size_t depth = std::min(size, adaptive_size(used)) & ~(sizeof(uint64_t) - 1);
+        auto *words = (uint64_t *) ((char *) stack + size - depth);
+        for (size_t i = 0; i < depth / sizeof(uint64_t); i++) {
+            words[i] = STACK_PAINT;
+        }
+        return depth;
+    }
+
+    void StackProfiler::Record(const void *site, const void *stack, size_t size, size_t depth) {
+        ///栈从高地址往低地址增长，从刷过的部分的底部往上第一个被改写的字就是最深到过的位置
+        auto *words = (const uint64_t *) ((const char *) stack + size - depth);
+        const size_t count = depth / sizeof(uint64_t);
+        size_t untouched = 0;
+        ///先按块比较跳过整块没动过的部分，块内不提前退出，编译器可以向量化
+        constexpr size_t BLOCK = 64;
+        while (untouched + BLOCK <= count) {
+            uint64_t diff = 0;
+            for (size_t i = 0; i < BLOCK; i++) {
+                diff |= words[untouched + i] ^ STACK_PAINT;
+            }
+            if (diff) {
+                break;
+            }
+            untouched += BLOCK;
+        }
+        while (untouched < count && words[untouched] == STACK_PAINT) {
+            ++untouched;
+        }
+        const size_t used = depth - untouched * sizeof(uint64_t);
+        if (untouched == 0 && depth == size) {
+            LOGE(LOG_ROOT()) << "fiber stack of site " << site << " used up all " << size << " bytes";
+        }
+        StackSites &global = stack_sites();
+        RWMutex::WriteLock lock(global.mutex);
+        StackSite &stat = global.sites[site];
+        ++stat.samples;
+        ///用满了刷过的部分，真实用量可能更大，重新积累有效样本
+        stat.exact = untouched == 0 ? 0 : stat.exact + 1;
+        stat.maxUsed = std::max(stat.maxUsed, used);
+        size_t new_size = stat.exact >= ADAPTIVE_MIN_SAMPLES ? adaptive_size(stat.maxUsed) : 0;
+        if (new_size != stat.size) {
+            stat.size = new_size;
+            global.generation.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    std::ostream &StackProfiler::Dump(std::ostream &os) {
+        StackSites &global = stack_sites();
+        RWMutex::ReadLock lock(global.mutex);
+        os << "[StackProfiler sites=" << global.sites.size() << " stack_size=" << s_stack_size << "]" << std::endl;
+        for (auto &item: global.sites) {
+            std::string name;
+            Dl_info info{};
+            if (dladdr(item.first, &info) && info.dli_sname) {
+                int status = 0;
+                char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+                name = status == 0 && demangled ? demangled : info.dli_sname;
+                free(demangled);
+            }
+            os << "    site=" << item.first << " samples=" << item.second.samples
+               << " max_used=" << item.second.maxUsed
+               << " size=" << (item.second.size ? item.second.size : (size_t) s_stack_size);
+            if (!name.empty()) {
+                os << " " << name;
+            }
+            os << std::endl;
+        }
+        return os;
+    }
+
+    SharedStack::SharedStack(size_t size) : stack(StackAllocator::Alloc(size)), size(size) {
+    }
+
+    SharedStack::~SharedStack() {
+        StackAllocator::Dealloc(stack, size);
+    }
+
+    bool SharedStack::Enabled() {
+        return CONTEXT_HAS_SP && s_shared_stack;
+    }
+
+    /**
+     * @brief 每个线程的共享栈，已经绑定的协程各自持有引用，线程退出后也不会被释放
+     */
+    struct LocalSharedStacks {
+        std::vector<SharedStack::ptr> stacks;
+        size_t next = 0;
+    };
+
+    static thread_local LocalSharedStacks t_shared_stacks;
+
+    SharedStack::ptr SharedStack::Next() {
+        LocalSharedStacks &local = t_shared_stacks;
+        const size_t count = s_shared_stack_count;
+        const size_t size = s_shared_stack_size;
+        if (local.stacks.size() != count || local.stacks[0]->size != size) {
+            ///配置改了，重新创建；旧的栈由还绑定在上面的协程持有到它们结束
+            local.stacks.clear();
+            for (size_t i = 0; i < count; i++) {
+                local.stacks.emplace_back(new SharedStack(size));
+            }
+            local.next = 0;
+        }
+        SharedStack::ptr stack = local.stacks[local.next];
+        local.next = (local.next + 1) % count;
+        return stack;
+    }
+}
@@ -0,0 +1,131 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_FIBERSTACK_H
+#define SERVER_FIBERSTACK_H
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+
+namespace Server {
+
+    class Fiber;
+
+    /**
+     * @brief 协程栈池
+     * 每个线程缓存一批释放掉的栈，超出fiber.stack_pool.local_max时把一半还给全局的溢出链表，
+     * 线程缓存空了再从全局链表批量取回，都没有时才向系统申请
+     * 按档位缓存fiber.stack_size >> k大小的栈，其他大小的栈直接申请和释放；修改fiber.stack_size后旧大小的栈逐渐被释放
+     * 默认用malloc分配栈；fiber.stack_allocator=mmap时用带保护页、延迟提交的mmap栈，放回池里时可以按fiber.stack_release归还物理页
+     */
+    class StackPool {
+    public:
+        /// 缓存的栈大小档位数：fiber.stack_size、一半、四分之一...
+        static constexpr int SIZE_CLASSES = 7;
+        /// 最小的档位
+        static constexpr size_t MIN_SIZE = 16 * 1024;
+
+        /**
+         * @brief 分配一个协程栈
+         * @param[in] size 栈大小
+         */
+        static void *Alloc(size_t size);
+
+        /**
+         * @brief 归还协程栈，可以在任意线程调用
+         * @param[in] size 必须和分配时的大小一致
+         */
+        static void Dealloc(void *vp, size_t size);
+
+        /**
+         * @brief 默认的栈大小，即fiber.stack_size
+         */
+        static size_t DefaultSize();
+
+        /**
+         * @brief 全局溢出链表中缓存的栈数量
+         */
+        static size_t GlobalCached();
+
+        /**
+         * @brief 栈下面有没有保护页，没有时栈溢出不会被发现
+         */
+        static bool HasGuardPage();
+    };
+
+    /**
+     * @brief 协程栈用量统计和按用量选择栈大小
+     * 按fiber.stack_profile.sample_rate采样的协程执行前把栈顶一段刷成固定的花纹，结束后从这段的底部往上找第一个被改写的位置，
+     * 得到栈用量的高水位，按创建点(见Task::site，不知道创建点的协程不采样)汇总
+     * 刷的深度是创建点已知最大用量的两倍(至少StackPool::MIN_SIZE)，开销跟实际用量成正比；用满了刷过的部分说明测到的只是下限，
+     * 下次刷的深度加倍，这样的样本不算作有效样本
+     * 开启fiber.stack_profile.adaptive后，连续的有效样本足够的创建点按最大用量的两倍选择StackPool的档位，采样的协程总是用fiber.stack_size
+     */
+    class StackProfiler {
+    public:
+        /**
+         * @brief 新协程的栈大小，没有开启adaptive或者样本不够时是fiber.stack_size
+         * @param[in] site 创建点，nullptr表示未知
+         */
+        static size_t SizeFor(const void *site);
+
+        /**
+         * @brief 这次创建的协程是否要刷栈采样
+         */
+        static bool ShouldSample();
+
+        /**
+         * @brief 按创建点的已知用量把栈顶一段刷成花纹
+         * @return 从栈顶算起刷过的字节数
+         */
+        static size_t Paint(const void *site, void *stack, size_t size);
+
+        /**
+         * @brief 测量刷过花纹的栈的高水位，记到创建点下
+         * @param[in] depth Paint的返回值
+         */
+        static void Record(const void *site, const void *stack, size_t size, size_t depth);
+
+        /**
+         * @brief 输出每个创建点的样本数、最大用量和选择的栈大小
+         */
+        static std::ostream &Dump(std::ostream &os);
+    };
+
+    /**
+     * @brief 共享栈：每个线程几个大栈，多个协程轮流在上面执行
+     * 栈上同一时刻只保存一个协程(occupant)的数据，别的协程要用这个栈时才把它用到的部分拷贝到它自己的堆上，
+     * 再切回来时拷贝回原来的地址；栈上的指针因此保持有效，但协程只能在绑定的线程上恢复执行
+     * 只在所属线程上访问，不加锁
+     */
+    struct SharedStack {
+        typedef std::shared_ptr<SharedStack> ptr;
+
+        explicit SharedStack(size_t size);
+
+        ~SharedStack();
+
+        SharedStack(const SharedStack &) = delete;
+
+        SharedStack &operator=(const SharedStack &) = delete;
+
+        void *stack;
+        size_t size;
+        /// 数据还在栈上的协程，nullptr表示栈空闲
+        Fiber *occupant = nullptr;
+
+        /**
+         * @brief 新创建的协程是否使用共享栈(fiber.shared_stack.enable，只有汇编实现的切换支持)
+         */
+        static bool Enabled();
+
+        /**
+         * @brief 轮流返回当前线程的fiber.shared_stack.count个共享栈之一
+         */
+        static ptr Next();
+    };
+}
+
+#endif //SERVER_FIBERSTACK_H
@@ -18,6 +18,8 @@ namespace Server {
     static thread_local bool t_hook_enable = false;
     static ConfigVar<int>::ptr g_tcp_connect_timeout = Config::Lookup("tcp.connect.timeout", 5000,
                                                                       "tcp connect timeout");
+    static ConfigVar<int>::ptr g_timeout_slack_percent = Config::Lookup("hook.timeout_slack_percent", 0,
+                                                                        "percent of an io timeout its timer may be delayed to share a wakeup");
 
 #define HOOK_FUN(XX) \
         XX(sleep)       \
@@ -53,6 +55,7 @@ namespace Server {
     }
 
     static uint64_t s_connect_timeout = -1;
+    static std::atomic<uint64_t> s_timeout_slack_percent = {0};
 
     struct _HookIniter {
         _HookIniter() {
@@ -62,11 +65,23 @@ namespace Server {
                 LOGI(LOG_ROOT()) << "tcp connect timeout changed from";
                 s_connect_timeout = new_value;
             });
+            s_timeout_slack_percent = std::max(0, g_timeout_slack_percent->getValue());
+            g_timeout_slack_percent->addChangeCallback([](const int &old_value, const int &new_value) {
+                LOGI(LOG_ROOT()) << "hook.timeout_slack_percent changed from " << old_value << " to " << new_value;
+                s_timeout_slack_percent = std::max(0, new_value);
+            });
         }
     };
 
     static _HookIniter s_hook_initer;
 
+    /**
+     * @brief IO超时定时器允许推迟的毫秒数
+     */
+    static uint64_t timeout_slack(uint64_t timeout_ms) {
+        return timeout_ms * s_timeout_slack_percent / 100;
+    }
+
     bool is_hook_enable() {
         return t_hook_enable;
     }
@@ -75,15 +90,101 @@ namespace Server {
         t_hook_enable = flag;
     }
 
-    struct timer_info {
-        int cancelled = 0;
+    /**
+     * @brief 等待IO的超时，放在等待的协程栈上，不需要分配内存
+     * 到期时在定时器分片的锁内取消fd上的事件：锁的顺序总是分片锁到fd锁，没有反过来的路径
+     */
+    struct io_timeout : Timeout {
+        io_timeout(IOSchedule *io_schedule, int fd, uint32_t event)
+                : Timeout(&io_timeout::OnTimeout), ioSchedule(io_schedule), fd(fd), event(event) {}
+
+        static void OnTimeout(Timeout *timeout) {
+            auto *self = static_cast<io_timeout *>(timeout);
+            //执行到这里就说明超时了，且ＩＯ任务没有完成，那么状态置为超时，执行cancelEvent：取消掉事件的监听
+            self->cancelled = ETIMEDOUT;
+            self->ioSchedule->cancelEvent(self->fd, static_cast<IOSchedule::Event>(self->event));
+        }
 
+        IOSchedule *ioSchedule;
+        int fd;
+        uint32_t event;
+        int cancelled = 0;
     };
 
+    /**
+     * @brief 构造一个io_uring请求，fd和user_data由uring_io/submitAndWait填写
+     */
+    static io_uring_sqe make_sqe(uint8_t opcode, const void *addr, uint32_t len, uint64_t off) {
+        io_uring_sqe sqe{};
+        sqe.opcode = opcode;
+        sqe.addr = (uint64_t) addr;
+        sqe.len = len;
+        sqe.off = off;
+        return sqe;
+    }
+
+    /**
+     * @brief io_uring模式下把一次socket IO交给io_uring，协程挂起直到完成，不需要先试一次系统调用再等待就绪
+     * @param[out] result 和对应系统调用的返回值一致，失败时设置errno
+     * @return false表示没有走io_uring(未启用、不是阻塞socket、提交队列满)，调用方继续走epoll路径
+     */
+    static bool uring_io(int fd, int timeout_so, const io_uring_sqe &sqe, ssize_t &result) {
+        if (!t_hook_enable) {
+            return false;
+        }
+        auto ioSchedule = IOSchedule::GetThis();
+        //共享栈上的协程挂起时缓冲区所在的栈会被别的协程覆盖，内核不能异步读写它，走epoll路径
+        if (!ioSchedule || !ioSchedule->hasUring() || Fiber::IsSharedStack()) {
+            return false;
+        }
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+        if (!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock()) {
+            return false;
+        }
+        uint64_t timeout_time = ctx->getTimeout(timeout_so);
+        int res;
+        do {
+            io_uring_sqe copy = sqe;
+            copy.fd = fd;
+            res = ioSchedule->submitAndWait(copy, timeout_time);
+        } while (res == -EINTR);
+        if (res == -EAGAIN) {
+            return false;
+        }
+        //超时由LINK_TIMEOUT取消请求
+        if (res == -ECANCELED && timeout_time != (uint64_t) -1) {
+            res = -ETIMEDOUT;
+        }
+        if (res < 0) {
+            errno = -res;
+            result = -1;
+        } else {
+            result = res;
+        }
+        return true;
+    }
+
+    static size_t iov_total(const struct iovec *iov, int iovcnt) {
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    /**
+     * @brief 接收时期望读满的字节数
+     * MSG_PEEK不取走数据，MSG_OOB读的是带外数据，读不满都不说明接收缓冲区已经读空，不检查
+     */
+    static size_t recv_expect(size_t len, int flags) {
+        return (flags & (MSG_PEEK | MSG_OOB)) ? 0 : len;
+    }
+
     // hook　io相关的操作
+    // expect: 请求读/写的字节数，流式socket读/写不满时记下没有就绪，下次跳过试探的系统调用；0表示不检查
     template<typename OriginFun, typename ... Args>
     static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
-                         uint32_t event, int timeout_so, Args &&... args) {
+                         uint32_t event, int timeout_so, size_t expect, Args &&... args) {
         //如果没有hook，那么就执行originFun
         if (!t_hook_enable) {
             return fun(fd, std::forward<Args>(args)...);
@@ -107,14 +208,22 @@ namespace Server {
         }
 
         uint64_t timeout_time = ctx->getTimeout(timeout_so);
-        std::shared_ptr<timer_info> tinfo(new timer_info);
+        auto ioSchedule = IOSchedule::GetThis();
+        //持久注册模式下已知没有就绪(上次EAGAIN或读/写不满之后没有新的边沿)，跳过一定返回EAGAIN的系统调用，直接等待
+        bool skip = ioSchedule && ioSchedule->isKnownNotReady(fd, static_cast<IOSchedule::Event>(event));
 
         retry:
-        ssize_t n = fun(fd, std::forward<Args>(args)...);
-        //当在父进程阻塞于慢系统调用时由父进程捕获到了一个有效信号时，内核会致使accept返回一个EINTR错误(被中断的系统调用)
-        //这个时候重新执行ｆｕｎ
-        while (n == -1 && errno == EINTR) {
+        ssize_t n = -1;
+        if (skip) {
+            skip = false;
+            errno = EAGAIN;
+        } else {
             n = fun(fd, std::forward<Args>(args)...);
+            //当在父进程阻塞于慢系统调用时由父进程捕获到了一个有效信号时，内核会致使accept返回一个EINTR错误(被中断的系统调用)
+            //这个时候重新执行ｆｕｎ
+            while (n == -1 && errno == EINTR) {
+                n = fun(fd, std::forward<Args>(args)...);
+            }
         }
         // 从字面上来看，是提示再试一次。这个错误经常出现在当应用程序进行一些非阻塞(non-blocking)操作
         // (对文件或socket)的时候。例如，以 O_NONBLOCK的标志打开文件/socket/FIFO，如果你连续做read
@@ -125,24 +234,17 @@ namespace Server {
         // Reactor：把 IO 的处理转换为对事件的处理。(select/epoll:  只检测 IO 是否就绪的问题，不解决具体IO 的操作)
         if (n == -1 && errno == EAGAIN) {
             //当返回EAGAIN，就代表ｉｏ事件是一个异步非阻塞的操作，这个时候就需要用定时器去处理
-            auto ioSchedule = IOSchedule::GetThis();
-            Timer::ptr timer;
-            //https://c.biancheng.net/view/7918.html，下面是设置一个条件变量
-            std::weak_ptr<timer_info> winfo(tinfo);
-            //如果设置了超时时间，就放到条件定时器中，等待timeout_time时间后就取消ｆｄ的ｅｖｅｎｔ事件监听
-            if (timeout_time != (uint64_t) -1) {
-                timer = ioSchedule->addConditionTimer(timeout_time, [winfo, fd, ioSchedule, event]() {
-                    //lock:如果当前 weak_ptr 已经过期，则该函数会返回一个空的 shared_ptr 指针；
-                    //反之，该函数返回一个和当前 weak_ptr 指向相同的 shared_ptr 指针。
-                    auto t = winfo.lock();
-                    if (!t || t->cancelled) {
-                        return;
-                    }
-                    //执行到这里就说明timeout_time时间到了，且ＩＯ任务没有被取消，
-                    //那么状态置为超时，执行cancelEvent：取消掉事件的监听
-                    t->cancelled = ETIMEDOUT;
-                    ioSchedule->cancelEvent(fd, static_cast<IOSchedule::Event>(event));
-                }, winfo);
+            io_timeout local_timeout(ioSchedule, fd, event);
+            //共享栈上的协程挂起后栈会被覆盖，超时节点要放到堆上
+            std::unique_ptr<io_timeout> heap_timeout;
+            if (Fiber::IsSharedStack()) {
+                heap_timeout.reset(new io_timeout(ioSchedule, fd, event));
+            }
+            io_timeout &timeout = heap_timeout ? *heap_timeout : local_timeout;
+            bool armed = timeout_time != (uint64_t) -1;
+            //如果设置了超时时间，等待timeout_time时间后就取消ｆｄ的ｅｖｅｎｔ事件监听
+            if (armed) {
+                ioSchedule->armTimeout(timeout, timeout_time, timeout_slack(timeout_time));
             }
 
             uint64_t now = 0;
@@ -155,27 +257,32 @@ namespace Server {
                                  << fd
                                  << ", "
                                  << event
-                                 << " used=" << (GetCurrentUS() - now);
-                //ｅｖｅｎｔ添加失败，就取消上面的条件定时器任务，然后返回－１
-                if (timer) {
-                    timer->cancel();
+                                 << " used=" << (GetMonotonicUS() - now);
+                //ｅｖｅｎｔ添加失败，就取消上面的超时，然后返回－１
+                if (armed) {
+                    ioSchedule->cancelTimeout(timeout);
                 }
                 return -1;
             } else {
-                //添加ｅｖｅｎｔ成功后，执行到这里会挂起，然后条件定时器执行回调中的cancelEvent的时候，会唤醒此处的挂起状态
+                //添加ｅｖｅｎｔ成功后，执行到这里会挂起，然后超时回调中的cancelEvent的时候，会唤醒此处的挂起状态
                 //以及ioSchedule->addEvent执行后，也会唤醒此处．
                 Fiber::YieldToHold();
-                if (timer) {
-                    timer->cancel();
+                //取消返回之后超时回调不会再执行，timeout可以随栈释放
+                if (armed) {
+                    ioSchedule->cancelTimeout(timeout);
                 }
-                //如果是定时任务取消的,返回，不进行ｒｅｔｒｙ　
-                if (tinfo->cancelled) {
-                    errno = tinfo->cancelled;
+                //如果是超时取消的,返回，不进行ｒｅｔｒｙ　
+                if (timeout.cancelled) {
+                    errno = timeout.cancelled;
                     return -1;
                 }
                 goto retry;
             }
         }
+        //流式socket读/写不满，说明接收缓冲区已经读空/发送缓冲区已经写满
+        if (n > 0 && (size_t) n < expect && ioSchedule && ctx->isStream()) {
+            ioSchedule->setNotReady(fd, static_cast<IOSchedule::Event>(event));
+        }
         return n;
     }
 
@@ -243,7 +350,7 @@ namespace Server {
 
         auto ctx = FdMgr::GetInstance()->get(fd);
 
-        if (!ctx || ctx->isSocket()) {
+        if (!ctx || ctx->isClose()) {
             errno = EBADF;
             return -1;
         }
@@ -251,31 +358,44 @@ namespace Server {
         if (!ctx->isSocket())
             return connect_f(fd, addr, addrlen);
 
-        if (!ctx->getUserNonblock()) {
+        if (ctx->getUserNonblock()) {
             return connect_f(fd, addr, addrlen);
         }
+
+        auto ioSchedule = IOSchedule::GetThis();
+        if (ioSchedule && ioSchedule->hasUring() && !Fiber::IsSharedStack()) {
+            io_uring_sqe sqe = make_sqe(IORING_OP_CONNECT, addr, 0, addrlen);
+            sqe.fd = fd;
+            int res;
+            do {
+                io_uring_sqe copy = sqe;
+                res = ioSchedule->submitAndWait(copy, timeout_ms);
+            } while (res == -EINTR);
+            if (res != -EAGAIN) {
+                if (res == -ECANCELED && timeout_ms != (uint64_t) -1) {
+                    res = -ETIMEDOUT;
+                }
+                if (res < 0) {
+                    errno = -res;
+                    return -1;
+                }
+                return 0;
+            }
+        }
         int retryNum = 1;
-        int now = GetCurrentUS();
+        uint64_t now = GetMonotonicUS();
         int n = connect_f(fd, addr, addrlen);
         if (n == 0) return 0;
         else if (n != -1 || errno != EINPROGRESS) return n;
-        auto ioSchedule = IOSchedule::GetThis();
-        Timer::ptr timer;
-        std::shared_ptr<timer_info> tinfo(new timer_info);
-        std::weak_ptr<timer_info> winfo(tinfo);
-        if (timeout_ms != (uint64_t) -1) {
-            timer = ioSchedule->addConditionTimer(timeout_ms, [winfo, fd, ioSchedule]() {
-                //lock:如果当前 weak_ptr 已经过期，则该函数会返回一个空的 shared_ptr 指针；
-                //反之，该函数返回一个和当前 weak_ptr 指向相同的 shared_ptr 指针。
-                auto t = winfo.lock();
-                if (!t || t->cancelled) {
-                    return;
-                }
-                //执行到这里就说明timeout_time时间到了，且WAIT任务没有被取消，
-                //那么状态置为超时，执行cancelEvent：取消掉事件的监听
-                t->cancelled = ETIMEDOUT;
-                ioSchedule->cancelEvent(fd, IOSchedule::WRITE);
-            }, winfo);
+        io_timeout local_timeout(ioSchedule, fd, IOSchedule::WRITE);
+        std::unique_ptr<io_timeout> heap_timeout;
+        if (Fiber::IsSharedStack()) {
+            heap_timeout.reset(new io_timeout(ioSchedule, fd, IOSchedule::WRITE));
+        }
+        io_timeout &timeout = heap_timeout ? *heap_timeout : local_timeout;
+        bool armed = timeout_ms != (uint64_t) -1;
+        if (armed) {
+            ioSchedule->armTimeout(timeout, timeout_ms, timeout_slack(timeout_ms));
         }
         int rt = ioSchedule->addEvent(fd, IOSchedule::WRITE);
         if (rt != 0) {
@@ -284,24 +404,24 @@ namespace Server {
                              << " addEvent("
                              << fd
                              << ", "
-                             << IOSchedule::WRITE
-                             << " used time=" << (GetCurrentUS() - now)
+                             << (int) IOSchedule::WRITE
+                             << " used time=" << (GetMonotonicUS() - now)
                              << " retry num=" << retryNum;
-            //ｅｖｅｎｔ添加失败，就取消上面的条件定时器任务，然后返回－１
-            if (timer) {
-                timer->cancel();
+            //ｅｖｅｎｔ添加失败，就取消上面的超时，然后返回－１
+            if (armed) {
+                ioSchedule->cancelTimeout(timeout);
             }
             return -1;
         } else {
-            //添加ｅｖｅｎｔ成功后，执行到这里会挂起，然后条件定时器执行回调中的cancelEvent的时候，会唤醒此处的挂起状态
+            //添加ｅｖｅｎｔ成功后，执行到这里会挂起，然后超时回调中的cancelEvent的时候，会唤醒此处的挂起状态
             //以及ioSchedule->addEvent执行后，也会唤醒此处．
             Fiber::YieldToHold();
-            if (timer) {
-                timer->cancel();
+            if (armed) {
+                ioSchedule->cancelTimeout(timeout);
             }
-            //如果是定时任务取消的,返回，不进行ｒｅｔｒｙ　
-            if (tinfo->cancelled) {
-                errno = tinfo->cancelled;
+            //如果是超时取消的,返回，不进行ｒｅｔｒｙ　
+            if (timeout.cancelled) {
+                errno = timeout.cancelled;
                 return -1;
             }
         }
@@ -322,8 +442,13 @@ namespace Server {
     }
 
     int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-        //先把ｓｏｅｃｋｅｔ挂到ｅｐｏｌｌ的树进行监听
-        int fd = do_io(s, accept_f, "accept", IOSchedule::READ, SO_RCVTIMEO, addr, addrlen);
+        ssize_t n;
+        io_uring_sqe sqe = make_sqe(IORING_OP_ACCEPT, addr, 0, (uint64_t) addrlen);
+        if (!uring_io(s, SO_RCVTIMEO, sqe, n)) {
+            //先把ｓｏｅｃｋｅｔ挂到ｅｐｏｌｌ的树进行监听
+            n = do_io(s, accept_f, "accept", IOSchedule::READ, SO_RCVTIMEO, 0, addr, addrlen);
+        }
+        int fd = (int) n;
         if (fd >= 0) {
             FdMgr::GetInstance()->get(fd, true);
         }
@@ -331,57 +456,128 @@ namespace Server {
     }
 
     ssize_t read(int fd, void *buf, size_t count) {
-        return do_io(fd, read_f, "read", IOSchedule::READ, SO_RCVTIMEO, buf, count);
+        ssize_t n;
+        if (uring_io(fd, SO_RCVTIMEO, make_sqe(IORING_OP_READ, buf, count, -1), n)) {
+            return n;
+        }
+        return do_io(fd, read_f, "read", IOSchedule::READ, SO_RCVTIMEO, count, buf, count);
     }
 
     ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-        return do_io(fd, readv_f, "readv", IOSchedule::READ, SO_RCVTIMEO, iov, iovcnt);
+        ssize_t n;
+        if (uring_io(fd, SO_RCVTIMEO, make_sqe(IORING_OP_READV, iov, iovcnt, -1), n)) {
+            return n;
+        }
+        return do_io(fd, readv_f, "readv", IOSchedule::READ, SO_RCVTIMEO, iov_total(iov, iovcnt), iov, iovcnt);
     }
 
     ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-        return do_io(sockfd, recv_f, "recv", IOSchedule::READ, SO_RCVTIMEO, buf, len, flags);
+        ssize_t n;
+        io_uring_sqe sqe = make_sqe(IORING_OP_RECV, buf, len, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(sockfd, SO_RCVTIMEO, sqe, n)) {
+            return n;
+        }
+        return do_io(sockfd, recv_f, "recv", IOSchedule::READ, SO_RCVTIMEO, recv_expect(len, flags), buf, len, flags);
     }
 
     ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
                      socklen_t *addrlen) {
-        return do_io(sockfd, recvfrom_f, "recvfrom", IOSchedule::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+        //io_uring没有recvfrom，用recvmsg代替
+        ssize_t n;
+        iovec iov{buf, len};
+        msghdr msg{};
+        msg.msg_name = src_addr;
+        msg.msg_namelen = (src_addr && addrlen) ? *addrlen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        io_uring_sqe sqe = make_sqe(IORING_OP_RECVMSG, &msg, 1, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(sockfd, SO_RCVTIMEO, sqe, n)) {
+            if (n >= 0 && src_addr && addrlen) {
+                *addrlen = msg.msg_namelen;
+            }
+            return n;
+        }
+        return do_io(sockfd, recvfrom_f, "recvfrom", IOSchedule::READ, SO_RCVTIMEO, recv_expect(len, flags),
+                     buf, len, flags, src_addr, addrlen);
     }
 
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-        return do_io(sockfd, recvmsg_f, "recvmsg", IOSchedule::READ, SO_RCVTIMEO, msg, flags);
+        ssize_t n;
+        io_uring_sqe sqe = make_sqe(IORING_OP_RECVMSG, msg, 1, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(sockfd, SO_RCVTIMEO, sqe, n)) {
+            return n;
+        }
+        return do_io(sockfd, recvmsg_f, "recvmsg", IOSchedule::READ, SO_RCVTIMEO, 0, msg, flags);
     }
 
     ssize_t write(int fd, const void *buf, size_t count) {
-        return do_io(fd, write_f, "write", IOSchedule::WRITE, SO_SNDTIMEO, buf, count);
+        ssize_t n;
+        if (uring_io(fd, SO_SNDTIMEO, make_sqe(IORING_OP_WRITE, buf, count, -1), n)) {
+            return n;
+        }
+        return do_io(fd, write_f, "write", IOSchedule::WRITE, SO_SNDTIMEO, count, buf, count);
     }
 
     ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-        return do_io(fd, writev_f, "writev", IOSchedule::WRITE, SO_SNDTIMEO, iov, iovcnt);
+        ssize_t n;
+        if (uring_io(fd, SO_SNDTIMEO, make_sqe(IORING_OP_WRITEV, iov, iovcnt, -1), n)) {
+            return n;
+        }
+        return do_io(fd, writev_f, "writev", IOSchedule::WRITE, SO_SNDTIMEO, iov_total(iov, iovcnt), iov, iovcnt);
     }
 
     ssize_t send(int s, const void *msg, size_t len, int flags) {
-        return do_io(s, send_f, "send", IOSchedule::WRITE, SO_SNDTIMEO, msg, len, flags);
+        ssize_t n;
+        io_uring_sqe sqe = make_sqe(IORING_OP_SEND, msg, len, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(s, SO_SNDTIMEO, sqe, n)) {
+            return n;
+        }
+        return do_io(s, send_f, "send", IOSchedule::WRITE, SO_SNDTIMEO, len, msg, len, flags);
     }
 
     ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to,
                    socklen_t tolen) {
-        return do_io(s, sendto_f, "sendto", IOSchedule::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+        //io_uring没有sendto，用sendmsg代替
+        ssize_t n;
+        iovec iov{const_cast<void *>(msg), len};
+        msghdr hdr{};
+        hdr.msg_name = const_cast<sockaddr *>(to);
+        hdr.msg_namelen = to ? tolen : 0;
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        io_uring_sqe sqe = make_sqe(IORING_OP_SENDMSG, &hdr, 1, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(s, SO_SNDTIMEO, sqe, n)) {
+            return n;
+        }
+        return do_io(s, sendto_f, "sendto", IOSchedule::WRITE, SO_SNDTIMEO, len, msg, len, flags, to, tolen);
     }
 
     ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+        ssize_t n;
+        io_uring_sqe sqe = make_sqe(IORING_OP_SENDMSG, msg, 1, 0);
+        sqe.msg_flags = flags;
+        if (uring_io(s, SO_SNDTIMEO, sqe, n)) {
+            return n;
+        }
         return do_io(s, sendmsg_f, "sendmsg", IOSchedule::WRITE,
-                     SO_SNDTIMEO, msg, flags);
+                     SO_SNDTIMEO, 0, msg, flags);
     }
 
-    int close_fun(int fd) {
+    int close(int fd) {
         if (!t_hook_enable) {
             return close_f(fd);
         }
-        auto ctx = FdMgr::GetInstance()->get(fd, true);
+        auto ctx = FdMgr::GetInstance()->get(fd);
         if (ctx) {
             auto iom = IOSchedule::GetThis();
             if (iom) {
                 iom->cancelAllEvent(fd);
+                iom->cancelUring(fd);
             }
             FdMgr::GetInstance()->del(fd);
         }
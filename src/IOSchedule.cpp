@@ -4,13 +4,85 @@
 
 #include "IOSchedule.h"
 #include "Log.h"
+#include "Config.h"
 #include <unistd.h>
 #include <string>
 #include <cstring>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 
 namespace Server {
 
+    static ConfigVar<bool>::ptr g_epoll_per_thread =
+            Config::Lookup<bool>("io.epoll.per_thread", false,
+                                 "each scheduler thread owns an epoll instance and the fds assigned to it");
+
+    static ConfigVar<std::string>::ptr g_epoll_fd_assign =
+            Config::Lookup<std::string>("io.epoll.fd_assign", "round_robin",
+                                        "fd assignment in per-thread epoll mode: round_robin, hash or current");
+
+    static ConfigVar<bool>::ptr g_epoll_persistent =
+            Config::Lookup<bool>("io.epoll.persistent", false,
+                                 "register sockets once with EPOLLIN|EPOLLOUT|EPOLLET and track readiness in user space");
+
+    static ConfigVar<int>::ptr g_epoll_max_events =
+            Config::Lookup<int>("io.epoll.max_events", 256, "max events returned by one epoll_wait");
+
+    static ConfigVar<int>::ptr g_epoll_max_timeout =
+            Config::Lookup<int>("io.epoll.max_timeout", 3000, "max milliseconds an idle thread blocks before rechecking");
+
+    static ConfigVar<int>::ptr g_epoll_busy_poll_us =
+            Config::Lookup<int>("io.epoll.busy_poll_us", 0,
+                                "microseconds to spin on epoll_wait(0) before blocking, 0 disables busy polling");
+
+    /// 配置修改后立即生效，空闲线程每次等待前重新读取
+    static std::atomic<int> s_epoll_max_events = {256};
+    static std::atomic<int> s_epoll_max_timeout = {3000};
+    static std::atomic<int> s_epoll_busy_poll_us = {0};
+
+    struct _IOScheduleIniter {
+        _IOScheduleIniter() {
+            s_epoll_max_events = std::max(1, g_epoll_max_events->getValue());
+            s_epoll_max_timeout = std::max(0, g_epoll_max_timeout->getValue());
+            s_epoll_busy_poll_us = std::max(0, g_epoll_busy_poll_us->getValue());
+            g_epoll_max_events->addChangeCallback([](const int &old_value, const int &new_value) {
+                LOGI(LOG_ROOT()) << "io.epoll.max_events changed from " << old_value << " to " << new_value;
+                s_epoll_max_events = std::max(1, new_value);
+            });
+            g_epoll_max_timeout->addChangeCallback([](const int &old_value, const int &new_value) {
+                LOGI(LOG_ROOT()) << "io.epoll.max_timeout changed from " << old_value << " to " << new_value;
+                s_epoll_max_timeout = std::max(0, new_value);
+            });
+            g_epoll_busy_poll_us->addChangeCallback([](const int &old_value, const int &new_value) {
+                LOGI(LOG_ROOT()) << "io.epoll.busy_poll_us changed from " << old_value << " to " << new_value;
+                s_epoll_busy_poll_us = std::max(0, new_value);
+            });
+        }
+    };
+
+    static _IOScheduleIniter s_io_schedule_initer;
+
+    static ConfigVar<bool>::ptr g_uring_enable =
+            Config::Lookup<bool>("io.uring.enable", false,
+                                 "submit hooked socket io to io_uring instead of waiting for epoll readiness");
+
+    static ConfigVar<uint32_t>::ptr g_uring_entries =
+            Config::Lookup<uint32_t>("io.uring.entries", 256, "io_uring submission queue size");
+
+    /// 本线程还有任务时，积攒到这么多sqe也要提交，避免前面的请求等太久
+    static const unsigned URING_SUBMIT_BATCH = 32;
+
+    /**
+     * @brief 一个正在等待完成的io_uring请求，放在发起请求的协程栈上，user_data指向它
+     */
+    struct UringRequest {
+        Fiber::ptr fiber;
+        Scheduler *scheduler = nullptr;
+        int32_t result = 0;
+    };
+
     enum EpollCtlOp {
     };
 
@@ -25,24 +97,69 @@ namespace Server {
     }
 
     IOSchedule::IOSchedule(size_t threads, bool use_caller, const std::string &name) :
-            Scheduler(threads, use_caller, name) {
+            Scheduler(threads, use_caller, name), TimerManager(slotCount() + 1) {
         LOGD(LOG_ROOT()) << "IOSchedule::IOSchedule";
         m_epfd = epoll_create(1);
         SERVER_ASSERT(m_epfd > 0)
-        int ret = pipe(m_tickleFds);
-        SERVER_ASSERT(ret == 0)
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SERVER_ASSERT(m_wakeFd >= 0)
         epoll_event event{};
         memset(&event, 0, sizeof(event));
         ///EPOLLET：缓冲区剩余未读尽的数据不会导致epoll_wait返回，只有新的事件满足才会触发
         ///设置监听的事件类型（EPOLLIN：监听读事件，当有读请求事件过来，epoll_wait解除阻塞）
         ///设置监听事件的触发方式：当前新的事件来临时，epoll_wait才解除阻塞
         event.events = EPOLLIN | EPOLLET;
-        event.data.fd = m_tickleFds[0];
-        ret = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-        SERVER_ASSERT(ret >= 0)
-        ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+        event.data.fd = m_wakeFd;
+        int ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakeFd, &event);
         SERVER_ASSERT(ret == 0)
-        contextArrayResize(64);
+        m_perThreadEpoll = g_epoll_per_thread->getValue();
+        m_persistent = g_epoll_persistent->getValue();
+        const std::string assign = g_epoll_fd_assign->getValue();
+        if (assign == "hash") {
+            m_fdAssign = ASSIGN_HASH;
+        } else if (assign == "current") {
+            m_fdAssign = ASSIGN_CURRENT;
+        } else if (assign != "round_robin") {
+            LOGE(LOG_ROOT()) << "unknown io.epoll.fd_assign=" << assign << ", use round_robin";
+        }
+        ///每个调度线程一个eventfd，空闲时作为follower在上面等待；每线程epoll模式下还有自己的epoll
+        for (size_t slot = 0; slot < slotCount(); slot++) {
+            std::unique_ptr<Waiter> waiter(new Waiter());
+            waiter->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            SERVER_ASSERT(waiter->eventFd >= 0)
+            if (m_perThreadEpoll) {
+                waiter->epfd = epoll_create(1);
+                SERVER_ASSERT(waiter->epfd > 0)
+                event.events = EPOLLIN | EPOLLET;
+                event.data.fd = waiter->eventFd;
+                ret = epoll_ctl(waiter->epfd, EPOLL_CTL_ADD, waiter->eventFd, &event);
+                SERVER_ASSERT(ret == 0)
+            }
+            m_waiters.emplace_back(std::move(waiter));
+        }
+        if (g_uring_enable->getValue()) {
+            m_uring.reset(new IoUring(g_uring_entries->getValue()));
+            if (!m_uring->isValid()) {
+                LOGE(LOG_ROOT()) << "io_uring unavailable, fall back to epoll";
+                m_uring.reset();
+            }
+        }
+        if (m_uring) {
+            ///ring fd可读表示有完成事件；每线程epoll模式下注册到每个线程的epoll上，只唤醒一个线程去收割
+            event.data.fd = m_uring->getFd();
+            if (m_perThreadEpoll) {
+                event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+                for (auto &waiter: m_waiters) {
+                    ret = epoll_ctl(waiter->epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+                    SERVER_ASSERT(ret == 0)
+                }
+            } else {
+                event.events = EPOLLIN | EPOLLET;
+                ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+                SERVER_ASSERT(ret == 0)
+            }
+        }
+        m_fdPages.reset(new std::atomic<FdPage *>[FD_MAX_PAGES]());
         start();
     }
 
@@ -51,77 +168,175 @@ namespace Server {
         LOGD(LOG_ROOT()) << "IOSchedule::~IOSchedule";
         stop();
         close(m_epfd);
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        for (auto &m_fdContext: m_fdContexts) {
-            delete m_fdContext;
+        close(m_wakeFd);
+        for (auto &waiter: m_waiters) {
+            close(waiter->eventFd);
+            if (waiter->epfd >= 0) {
+                close(waiter->epfd);
+            }
         }
+        for (size_t i = 0; i < FD_MAX_PAGES; i++) {
+            FdPage *page = m_fdPages[i].load(std::memory_order_relaxed);
+            if (!page) {
+                continue;
+            }
+            for (auto &slot: page->slots) {
+                delete slot.load(std::memory_order_relaxed);
+            }
+            delete page;
+        }
+        m_uring.reset();
     }
 
-    int IOSchedule::addEvent(int fd, IOSchedule::Event event, std::function<void()> callback) {
-        FdContext *fdContext = nullptr;
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_fdContexts.size() > fd) {
-            fdContext = m_fdContexts[fd];
-            lock.unlock();
-        } else {
-            lock.unlock();
-            RWMutexType::WriteLock lock2(m_mutex);
-            contextArrayResize(fd * 1.5);
-            fdContext = m_fdContexts[fd];
+    IOSchedule::FdContext *IOSchedule::contextOf(int fd, bool auto_create) {
+        if (fd < 0 || (size_t) fd >= FD_MAX_PAGES * FD_PAGE_SIZE) {
+            return nullptr;
+        }
+        ///页和FdContext发布后地址不再变化，查找只需要两次acquire load
+        std::atomic<FdPage *> &page_slot = m_fdPages[fd >> FD_PAGE_BITS];
+        FdPage *page = page_slot.load(std::memory_order_acquire);
+        if (!page) {
+            if (!auto_create) {
+                return nullptr;
+            }
+            auto *new_page = new FdPage();
+            if (page_slot.compare_exchange_strong(page, new_page, std::memory_order_acq_rel,
+                                                  std::memory_order_acquire)) {
+                page = new_page;
+            } else {
+                ///其他线程先发布了这一页
+                delete new_page;
+            }
+        }
+        std::atomic<FdContext *> &slot = page->slots[fd & (FD_PAGE_SIZE - 1)];
+        FdContext *fd_ctx = slot.load(std::memory_order_acquire);
+        if (!fd_ctx && auto_create) {
+            auto *new_ctx = new FdContext;
+            new_ctx->fd = fd;
+            if (slot.compare_exchange_strong(fd_ctx, new_ctx, std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+                fd_ctx = new_ctx;
+            } else {
+                delete new_ctx;
+            }
+        }
+        return fd_ctx;
+    }
+
+    bool IOSchedule::registerLocked(FdContext *fd_ctx) {
+        epoll_event ep_event{};
+        ep_event.data.ptr = fd_ctx;
+        ///边缘触发，就绪状态记在fd_ctx->ready里，之后不再修改注册
+        ep_event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        int ret = epoll_ctl(epollOf(fd_ctx), EPOLL_CTL_ADD, fd_ctx->fd, &ep_event);
+        if (ret < 0) {
+            epoll_error_log("epoll_ctl", fd_ctx->fd, EPOLL_CTL_ADD, ep_event.events, ret, fd_ctx->m_events);
+            return false;
+        }
+        fd_ctx->registered = true;
+        fd_ctx->ready = NONE;
+        fd_ctx->notReady = NONE;
+        return true;
+    }
+
+    bool IOSchedule::registerFd(int fd) {
+        ///io_uring模式下socket IO不经过epoll，只在回退时按需注册
+        if (!m_persistent || m_uring) {
+            return false;
+        }
+        FdContext *fdContext = contextOf(fd, true);
+        if (!fdContext) {
+            return false;
+        }
+        FdContext::MutexType::Lock lock(fdContext->mutex);
+        if (fdContext->registered) {
+            return true;
+        }
+        return registerLocked(fdContext);
+    }
+
+    bool IOSchedule::isKnownNotReady(int fd, Event event) {
+        FdContext *fd_ctx = contextOf(fd, false);
+        return fd_ctx && (fd_ctx->notReady.load(std::memory_order_acquire) & event);
+    }
+
+    void IOSchedule::setNotReady(int fd, Event event) {
+        FdContext *fd_ctx = contextOf(fd, false);
+        if (!fd_ctx) {
+            return;
+        }
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        ///只有持久注册的fd的每个边沿都会清除这个标记
+        if (fd_ctx->registered) {
+            fd_ctx->notReady.fetch_or(event, std::memory_order_release);
+        }
+    }
+
+    int IOSchedule::addEvent(int fd, IOSchedule::Event event, Task callback) {
+        FdContext *fdContext = contextOf(fd, true);
+        if (!fdContext) {
+            LOGE(LOG_ROOT()) << "addEvent fd=" << fd << " out of range";
+            return -1;
         }
 
         FdContext::MutexType::Lock lock2(fdContext->mutex);
         ///fdContext->m_events原来存在，新注册的事件event存在
         if (fdContext->m_events & event) {
             LOGE(LOG_ROOT()) << "addEvent assert fd="
-                             << fd << "event=" << event
+                             << fd << "event=" << (int) event
                              << " fd_ctx.event="
-                             << fdContext->m_events;
+                             << (int) fdContext->m_events;
             SERVER_ASSERT(!(fdContext->m_events && event))
         }
 
-        int op = fdContext->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-        epoll_event ep_event{};
-        ep_event.data.fd = fd;
-        ep_event.data.ptr = fdContext;
-        ///注册要监听的事件
-        ep_event.events = EPOLLET | fdContext->m_events | event;
-        int ret = epoll_ctl(m_epfd, op, fd, &ep_event);
-        if (ret < 0) {
-            epoll_error_log("epoll_ctl", fd, op, ep_event.events, ret, fdContext->m_events);
-            return -1;
+        if (m_persistent) {
+            if (!fdContext->registered && !registerLocked(fdContext)) {
+                return -1;
+            }
+        } else {
+            int op = fdContext->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            epoll_event ep_event{};
+            ep_event.data.fd = fd;
+            ep_event.data.ptr = fdContext;
+            ///注册要监听的事件
+            ep_event.events = EPOLLET | fdContext->m_events | event;
+            int ret = epoll_ctl(epollOf(fdContext), op, fd, &ep_event);
+            if (ret < 0) {
+                epoll_error_log("epoll_ctl", fd, op, ep_event.events, ret, fdContext->m_events);
+                return -1;
+            }
         }
         ++m_pendingEventCount;
         fdContext->m_events = (Event) (fdContext->m_events | event);
         FdContext::EventContext &eventContext = fdContext->getContext(event);
-        SERVER_ASSERT(!eventContext.scheduler && !eventContext.fiber && !eventContext.cb)
-        eventContext.scheduler = Scheduler::GetThis();
+        SERVER_ASSERT(eventContext.empty())
         if (callback) {
-            eventContext.cb.swap(callback);
+            auto *cb = new FdContext::Callback;
+            cb->scheduler = Scheduler::GetThis();
+            cb->cb = std::move(callback);
+            eventContext.target = cb;
         } else {
+            eventContext.target = Scheduler::GetThis();
             eventContext.fiber = Fiber::GetThis();
             SERVER_ASSERT2(eventContext.fiber->getState() == Fiber::EXEC, "state=" << eventContext.fiber->getState())
         }
+        if (fdContext->ready & event) {
+            ///没有人等待时已经来过边沿，不会再通知了，直接唤醒(可能是旧的就绪状态，调用方重试一次即可)
+            fdContext->ready = (Event) (fdContext->ready & ~event);
+            fdContext->triggerEvent(event);
+            --m_pendingEventCount;
+        }
         return 0;
     }
 
     bool IOSchedule::removeEvent(int fd, IOSchedule::Event event) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_fdContexts.size() <= fd) return false;
-        auto fd_ctx = m_fdContexts[fd];
-        lock.unlock();
+        FdContext *fd_ctx = contextOf(fd, false);
+        if (!fd_ctx) return false;
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
         if (!(fd_ctx->m_events & event)) return false;
         auto new_event = (Event) (fd_ctx->m_events & ~event);
-        int op = new_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event ep_event{};
-        ep_event.events = EPOLLET | new_event;
-        ep_event.data.ptr = fd_ctx;
-        int ret = epoll_ctl(m_epfd, op, fd_ctx->fd, &ep_event);
-        if (ret < 0) {
-            epoll_error_log("epoll_ctl", fd, op, ep_event.events, ret, fd_ctx->m_events);
+        if (!updateInterest(fd_ctx, new_event)) {
             return false;
         }
         --m_pendingEventCount;
@@ -133,22 +348,14 @@ namespace Server {
 
     ///找到event事件删除，并强制执行事件
     bool IOSchedule::cancelEvent(int fd, IOSchedule::Event event) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_fdContexts.size() < fd) return false;
-        auto fd_ctx = m_fdContexts[fd];
-        lock.unlock();
+        FdContext *fd_ctx = contextOf(fd, false);
+        if (!fd_ctx) return false;
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
         ///　没有找到对应的ｅｖｅｎｔ事件就退出
         if (!(fd_ctx->m_events & event)) return false;
         auto new_event = (Event) (fd_ctx->m_events & ~event);
-        int op = new_event ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event ep_event{};
-        ep_event.events = EPOLLET | new_event;
-        ep_event.data.ptr = fd_ctx;
-        int ret = epoll_ctl(m_epfd, op, fd_ctx->fd, &ep_event);
-        if (ret < 0) {
-            epoll_error_log("epoll_ctl", fd, op, ep_event.events, ret, fd_ctx->m_events);
+        if (!updateInterest(fd_ctx, new_event)) {
             return false;
         }
         --m_pendingEventCount;
@@ -157,22 +364,24 @@ namespace Server {
     }
 
     bool IOSchedule::cancelAllEvent(int fd) {
-        RWMutexType::ReadLock lock(m_mutex);
-        if (m_fdContexts.size() < fd) return false;
-        auto fd_ctx = m_fdContexts[fd];
-        lock.unlock();
+        FdContext *fd_ctx = contextOf(fd, false);
+        if (!fd_ctx) return false;
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if (!fd_ctx->m_events) return false;
+        if (!fd_ctx->m_events && !fd_ctx->registered) return false;
         int op = EPOLL_CTL_DEL;
         epoll_event ep_event{};
         ep_event.events = 0;
         ep_event.data.ptr = fd_ctx;
-        int ret = epoll_ctl(m_epfd, op, fd, &ep_event);
+        int ret = epoll_ctl(epollOf(fd_ctx), op, fd, &ep_event);
         if (ret < 0) {
             epoll_error_log("epoll_ctl", fd, op, ep_event.events, ret, fd_ctx->m_events);
             return false;
         }
+        ///持久注册在fd关闭前删除，fd号复用后重新注册
+        fd_ctx->registered = false;
+        fd_ctx->ready = NONE;
+        fd_ctx->notReady = NONE;
 
         if (fd_ctx->m_events & READ) {
             fd_ctx->triggerEvent(READ);
@@ -184,9 +393,141 @@ namespace Server {
             --m_pendingEventCount;
         }
         SERVER_ASSERT(fd_ctx->m_events == 0)
+        ///一般是fd要关闭了，fd号复用后重新分配调度线程
+        fd_ctx->owner = -1;
+        return true;
+    }
+
+    int IOSchedule::submitAndWait(io_uring_sqe &sqe, uint64_t timeout_ms) {
+        SERVER_ASSERT(m_uring)
+        UringRequest req;
+        req.fiber = Fiber::GetThis();
+        req.scheduler = Scheduler::GetThis();
+        sqe.user_data = (uint64_t) &req;
+
+        ///超时用链接在后面的LINK_TIMEOUT实现，到期时内核取消前面的请求，它自己的cqe(user_data为0)直接丢弃
+        io_uring_sqe timeout_sqe{};
+        __kernel_timespec ts{};
+        const io_uring_sqe *link = nullptr;
+        if (timeout_ms != (uint64_t) -1) {
+            ts.tv_sec = (int64_t) (timeout_ms / 1000);
+            ts.tv_nsec = (int64_t) (timeout_ms % 1000) * 1000000;
+            sqe.flags |= IOSQE_IO_LINK;
+            timeout_sqe.opcode = IORING_OP_LINK_TIMEOUT;
+            timeout_sqe.fd = -1;
+            timeout_sqe.addr = (uint64_t) &ts;
+            timeout_sqe.len = 1;
+            timeout_sqe.user_data = 0;
+            link = &timeout_sqe;
+        }
+
+        ++m_pendingEventCount;
+        if (!m_uring->push(sqe, link)) {
+            ///提交队列满了，先把积攒的请求提交掉再试一次
+            m_uring->flush();
+            if (!m_uring->push(sqe, link)) {
+                --m_pendingEventCount;
+                return -EAGAIN;
+            }
+        }
+        ///由afterTask或idle统一提交，协程切出后才会被恢复
+        Fiber::YieldToHold();
+        return req.result;
+    }
+
+    void IOSchedule::cancelUring(int fd) {
+        if (!m_uring) {
+            return;
+        }
+        io_uring_sqe sqe{};
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = fd;
+        sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe.user_data = 0;
+        if (!m_uring->push(sqe)) {
+            m_uring->flush();
+            if (!m_uring->push(sqe)) {
+                LOGE(LOG_ROOT()) << "cancelUring fd=" << fd << " submission queue full";
+                return;
+            }
+        }
+        ///取消请求在io_uring_enter中同步按fd查找，必须在close之前提交
+        m_uring->flush();
+    }
+
+    void IOSchedule::reapCompletions() {
+        if (!m_uring) {
+            return;
+        }
+        while (m_uring->hasCompletions()) {
+            size_t count = m_uring->reap([this](const io_uring_cqe &cqe) {
+                if (cqe.user_data == 0) {
+                    return;
+                }
+                auto *req = (UringRequest *) cqe.user_data;
+                Fiber::ptr fiber = std::move(req->fiber);
+                Scheduler *scheduler = req->scheduler;
+                req->result = cqe.res;
+                ///post之后协程随时可能恢复，req所在的栈不能再访问
+                scheduler->post(std::move(fiber));
+                --m_pendingEventCount;
+            });
+            if (count == 0) {
+                ///其他线程正在收割
+                break;
+            }
+        }
+    }
+
+    void IOSchedule::afterTask(int slot) {
+        ///任务可能执行了很久，刷新一下缓存的时间，之后添加的定时器才不会提前到期
+        UpdateCachedClock();
+        if (!m_uring) {
+            return;
+        }
+        unsigned pending = m_uring->pending();
+        if (pending && (pending >= URING_SUBMIT_BATCH || !hasLocalTasks(slot))) {
+            m_uring->flush();
+        }
+    }
+
+    bool IOSchedule::updateInterest(FdContext *fd_ctx, Event new_events) {
+        ///持久注册的fd一直关注读写事件
+        if (fd_ctx->registered || fd_ctx->m_events == NONE) {
+            return true;
+        }
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event ep_event{};
+        ep_event.events = EPOLLET | new_events;
+        ep_event.data.ptr = fd_ctx;
+        int ret = epoll_ctl(epollOf(fd_ctx), op, fd_ctx->fd, &ep_event);
+        if (ret < 0) {
+            epoll_error_log("epoll_ctl", fd_ctx->fd, op, ep_event.events, ret, fd_ctx->m_events);
+            return false;
+        }
         return true;
     }
 
+    int IOSchedule::epollOf(FdContext *fd_ctx) {
+        if (!m_perThreadEpoll) {
+            return m_epfd;
+        }
+        if (fd_ctx->owner < 0) {
+            ///use_caller的线程只有在stop()时才参与调度，不给它分配fd
+            int first = (m_mainThreadId != -1 && slotCount() > 1) ? 1 : 0;
+            int count = (int) slotCount() - first;
+            int slot = GetSlot();
+            if (m_fdAssign == ASSIGN_CURRENT && Scheduler::GetThis() == this && slot >= first) {
+                fd_ctx->owner = slot;
+            } else if (m_fdAssign == ASSIGN_HASH) {
+                fd_ctx->owner = first + fd_ctx->fd % count;
+            } else {
+                fd_ctx->owner = first + (int) (m_nextOwner++ % count);
+            }
+        }
+        return m_waiters[fd_ctx->owner]->epfd;
+    }
+
     IOSchedule *IOSchedule::GetThis() {
         return dynamic_cast<IOSchedule *>(Scheduler::GetThis());
     }
@@ -196,14 +537,65 @@ namespace Server {
         if (!hasIdleThreads()) {
             return;
         }
-        /// tickle的作用就是通知有事件请求到来，这里是直接往管道的写端写入数据＂Ｔ＂
-        size_t rt = write(m_tickleFds[1], "T", 1);
-        SERVER_ASSERT(rt == 1)
+        /// 优先唤醒一个follower，leader继续等待IO事件；每线程epoll模式下没有leader
+        if (!wakeFollower() && !m_perThreadEpoll) {
+            wakeLeader();
+        }
+    }
+
+    void IOSchedule::tickle(int slot) {
+        Waiter &waiter = *m_waiters[slot];
+        ///和followerWait/leaderWait中的屏障配对：要么这里看到对方在等待，要么对方睡眠前看到了新任务
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int state = waiter.state.load();
+        if (state == Waiter::FOLLOWER) {
+            removeSleeper(slot);
+            uint64_t one = 1;
+            size_t rt = write(waiter.eventFd, &one, sizeof(one));
+            SERVER_ASSERT(rt == sizeof(one))
+        } else if (state == Waiter::LEADER) {
+            wakeLeader();
+        }
+    }
+
+    bool IOSchedule::wakeFollower() {
+        int slot = -1;
+        {
+            Mutex::Lock lock(m_sleepersMutex);
+            if (m_sleepers.empty()) {
+                return false;
+            }
+            slot = m_sleepers.back();
+            m_sleepers.pop_back();
+        }
+        uint64_t one = 1;
+        size_t rt = write(m_waiters[slot]->eventFd, &one, sizeof(one));
+        SERVER_ASSERT(rt == sizeof(one))
+        return true;
+    }
+
+    void IOSchedule::wakeLeader() {
+        uint64_t one = 1;
+        size_t rt = write(m_wakeFd, &one, sizeof(one));
+        SERVER_ASSERT(rt == sizeof(one))
+    }
+
+    void IOSchedule::wakeAll() {
+        while (wakeFollower());
+        wakeLeader();
+    }
+
+    void IOSchedule::removeSleeper(int slot) {
+        Mutex::Lock lock(m_sleepersMutex);
+        auto it = std::find(m_sleepers.begin(), m_sleepers.end(), slot);
+        if (it != m_sleepers.end()) {
+            m_sleepers.erase(it);
+        }
     }
 
     bool IOSchedule::stopping(uint64_t &timeout) {
         timeout = getNextTimer();
-        return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+        return !hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping();
 
     }
 
@@ -213,115 +605,284 @@ namespace Server {
         return stopping(timeout);
     }
 
-    ///如果没有事件（任务）处理，就陷入epoll_wait
+    /**
+     * @brief 阻塞等待的超时时间：有任务时不阻塞，否则取最近的定时器和io.epoll.max_timeout中较小的
+     */
+    static int wait_timeout(bool has_tasks, uint64_t next_timeout) {
+        if (has_tasks) {
+            return 0;
+        }
+        uint64_t max_timeout = s_epoll_max_timeout;
+        return (int) std::min(next_timeout, max_timeout);
+    }
+
+    ///如果没有事件（任务）处理，就陷入等待：一个线程作为leader陷入epoll_wait，其他线程在各自的eventfd上等待
     void IOSchedule::idle() {
         LOGD(LOG_ROOT()) << "IOSchedule::idle";
-        const uint64_t MAX_EVENTS = 256;
-        auto *events = new epoll_event[MAX_EVENTS]();
-        std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr) {
-            delete[] ptr;
-        });
+        ///每个调度线程的idle协程只分配一次，io.epoll.max_events修改后按新的大小重新分配
+        std::vector<epoll_event> events;
+        const int slot = GetSlot();
+        SERVER_ASSERT(slot >= 0 && slot < (int) m_waiters.size())
+        Waiter &waiter = *m_waiters[slot];
 
         while (true) {
-            uint64_t next_timeout = 0;
-            if (stopping(next_timeout)) {
+            ///每轮刷新一次缓存的时间，定时器和日志都用它
+            UpdateCachedClock();
+            if (m_uring) {
+                ///睡眠之前把还没提交的请求提交掉，顺便收割已经完成的
+                m_uring->flush();
+                reapCompletions();
+            }
+            if (stopping()) {
                 LOGD(LOG_ROOT()) << "name=" << getName() << " idle stopping exit";
+                ///其他空闲线程可能还在等待，叫醒它们一起退出
+                wakeAll();
                 break;
             }
 
+            const int max_events = s_epoll_max_events;
+            if ((int) events.size() != max_events) {
+                events.assign(max_events, epoll_event{});
+            }
+            if (m_perThreadEpoll) {
+                ownerWait(waiter, slot, events.data(), max_events);
+            } else if (m_hasLeader.exchange(true)) {
+                followerWait(waiter, slot);
+            } else {
+                leaderWait(waiter, events.data(), max_events);
+            }
+
+            ///　到这里说明已经处理完所有的触发事件,让出处理这些事件的协程的执行权
+            ///  返回到 idle_fiber->swapIn();（返回到原来的挂起点，继续向下执行）
+            Fiber::YieldToHold();
+        }
+    }
+
+    void IOSchedule::followerWait(Waiter &waiter, int slot) {
+        waiter.state = Waiter::FOLLOWER;
+        {
+            Mutex::Lock lock(m_sleepersMutex);
+            m_sleepers.push_back(slot);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        ///登记之后再检查一次：登记前投递的任务、leader已经离开、调度器正在停止，都不能睡眠
+        if (!hasPendingTasks(slot) && m_hasLeader && !stopping()) {
+            pollfd pfd{};
+            pfd.fd = waiter.eventFd;
+            pfd.events = POLLIN;
+            ///只等本线程分片里的定时器，共享分片由leader等待
+            int timeout = wait_timeout(false, getNextTimer(slot));
             int rt;
             do {
-                static const int MAX_TIME_OUT = 3000;
-                if (next_timeout != ~0ull) {
-                    next_timeout = next_timeout > MAX_TIME_OUT ? MAX_TIME_OUT : next_timeout;
-                } else next_timeout = MAX_TIME_OUT;
-                /// 陷入到epoll_wait中５ｓ，如果没有事件回来，这里也会唤醒,epoll_wait return wake events
-                rt = epoll_wait(m_epfd, shared_events.get(), 64, (int) next_timeout);
-                ///https://blog.csdn.net/hnlyyk/article/details/51444617
-                ///预防在没有事件回来时，操作系统强制中断epoll_wait慢系统调用
-                if (rt < 0 && errno == EINTR) {
-                } else break;
-            } while (true);
-
-            /// 启动定时任务
-            std::vector<std::function<void(void)>> cbs;
-            listExpiredTimer(cbs);
-            if (!cbs.empty()) {
-                post(cbs.begin(), cbs.end());
-                cbs.clear();
-            }
-
-            /// epoll_wait 返回的触发的事件数,IOSchedule的构造函数里面监听就是m_tickleFds[0]，
-            /// m_tickleFds[0]是一个只读的ｆｄ，任务就是起一个通知的作用，报告有事情请求过来了．
-            for (int i = 0; i < rt; i++) {
-                auto &event = events[i];
-                if (event.data.fd == m_tickleFds[0]) {
-                    uint8_t dummy[256];
-                    /// ＥＴ触发方式，所以m_tickleFds[0]指向的缓冲区可能还有残余数据，
-                    /// 这里读干净
-                    while (read(m_tickleFds[0], &dummy, 1) > 0);
-                    continue;
-                }
-                auto *fdContext = (FdContext *) event.data.ptr;
-                FdContext::MutexType::Lock lock(fdContext->mutex);
-                if (event.events & (EPOLLIN | EPOLLOUT)) {
-                    event.events |= (EPOLLIN | EPOLLOUT) & fdContext->m_events;
-                }
-                /// 记录要触发的事件
-                int real_events = NONE;
-                if (event.events & EPOLLIN) {
-                    real_events |= READ;
-                }
-                if (event.events & EPOLLOUT) {
-                    real_events |= WRITE;
-                }
-                ///　没有触发的事件可以处理,就是没有读事件（ＧＥＴ请求），写事件（ｐｏｓｔ请求）
-                if ((fdContext->m_events & real_events) == NONE) {
-                    continue;
-                }
+                rt = poll(&pfd, 1, timeout);
+            } while (rt < 0 && errno == EINTR);
+        }
+        waiter.state = Waiter::RUNNING;
+        removeSleeper(slot);
+        uint64_t dummy;
+        while (read(waiter.eventFd, &dummy, sizeof(dummy)) > 0);
+
+        std::vector<Task> cbs;
+        listExpiredTimers(cbs, slot);
+        if (!cbs.empty()) {
+            post(cbs);
+        }
+    }
 
-                /// fdContext->m_events - real_events，从当前事件fdContext->m_events上减掉触发的事件real_events
-                int remind_events = (fdContext->m_events & ~real_events);
-                /// fdContext->m_events 减去 已经触发的real_events后，如果还有剩余事件，就修改，否则就整个直接删除掉
-                int op = remind_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-                /// 将剩余的事件重新进行监听
-                event.events = EPOLLET | remind_events;
-                int ret2 = epoll_ctl(m_epfd, op, fdContext->fd, &event);
-                if (ret2 < 0) {
-                    epoll_error_log("epoll_ctl", fdContext->fd, op, event.events, ret2, fdContext->m_events);
-                    continue;
+    void IOSchedule::leaderWait(Waiter &waiter, epoll_event *events, int max_events) {
+        waiter.state = Waiter::LEADER;
+        ///超时算出来之前先当作不会醒来，这期间插入的定时器都会叫醒leader
+        m_leaderWakeTime = ~0ull;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int slot = GetSlot();
+        ///屏障之后才读定时器，之后插入到本线程分片最前面的定时器一定能唤醒这里
+        uint64_t next_timeout = getNextTimer();
+        ///正在执行任务的线程顾不上自己分片里的定时器，leader按它们的到期时间醒来代为处理
+        for (size_t other = 0; other < slotCount(); other++) {
+            if ((int) other != slot && m_waiters[other]->state.load(std::memory_order_relaxed) == Waiter::RUNNING) {
+                next_timeout = std::min(next_timeout, getNextTimer(other));
+            }
+        }
+        ///已经有任务了，只检查一下IO事件，不阻塞
+        int timeout = wait_timeout(hasPendingTasks(slot), next_timeout);
+        m_leaderWakeTime = GetCachedMS() + timeout;
+        /// 陷入到epoll_wait中，如果没有事件回来，超时也会唤醒,epoll_wait return wake events
+        int rt = waitEvents(m_epfd, slot, events, max_events, timeout);
+        m_leaderWakeTime = 0;
+        waiter.state = Waiter::RUNNING;
+        m_hasLeader = false;
+
+        /// 启动定时任务
+        std::vector<Task> cbs;
+        listExpiredTimers(cbs, slot);
+
+        ///本线程要去处理事件和任务了，叫醒一个follower接替leader继续等待IO事件
+        if (rt > 0 || !cbs.empty()) {
+            wakeFollower();
+        }
+
+        if (!cbs.empty()) {
+            post(cbs);
+            cbs.clear();
+        }
+        processEvents(m_epfd, m_wakeFd, events, rt);
+    }
+
+    void IOSchedule::ownerWait(Waiter &waiter, int slot, epoll_event *events, int max_events) {
+        waiter.state = Waiter::FOLLOWER;
+        {
+            Mutex::Lock lock(m_sleepersMutex);
+            m_sleepers.push_back(slot);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int timeout = wait_timeout(hasPendingTasks(slot), getNextTimer());
+        int rt = waitEvents(waiter.epfd, slot, events, max_events, timeout);
+        waiter.state = Waiter::RUNNING;
+        removeSleeper(slot);
+
+        ///每个线程按自己分片和共享分片最近的定时器超时，共享分片里的定时器谁先醒谁处理
+        std::vector<Task> cbs;
+        listExpiredTimers(cbs, slot);
+        if (!cbs.empty()) {
+            post(cbs);
+            cbs.clear();
+        }
+        processEvents(waiter.epfd, waiter.eventFd, events, rt);
+    }
+
+    int IOSchedule::waitEvents(int epfd, int slot, epoll_event *events, int max_events, int timeout) {
+        int rt = 0;
+        const int busy_poll_us = s_epoll_busy_poll_us;
+        if (timeout != 0 && busy_poll_us > 0) {
+            ///先不阻塞地轮询一段时间，事件很快就到的时候省掉一次睡眠和唤醒
+            uint64_t begin = GetMonotonicUS();
+            do {
+                rt = epoll_wait(epfd, events, max_events, 0);
+                if (rt > 0 || hasPendingTasks(slot)) {
+                    return rt;
                 }
+            } while (GetMonotonicUS() - begin < (uint64_t) busy_poll_us);
+        }
+        do {
+            rt = epoll_wait(epfd, events, max_events, timeout);
+            ///https://blog.csdn.net/hnlyyk/article/details/51444617
+            ///预防在没有事件回来时，操作系统强制中断epoll_wait慢系统调用
+        } while (rt < 0 && errno == EINTR);
+        return rt;
+    }
+
+    void IOSchedule::processEvents(int epfd, int wake_fd, epoll_event *events, int count) {
+        /// epoll_wait 返回的触发的事件数,IOSchedule的构造函数里面监听了唤醒用的eventfd，
+        /// 它只起一个通知的作用，报告有任务过来了．
+        ///每线程epoll模式下fd的事件都在所属线程上处理，等待者也留在这个线程执行，不唤醒其他线程
+        const int owner = m_perThreadEpoll ? GetThreadId() : -1;
+        for (int i = 0; i < count; i++) {
+            auto &event = events[i];
+            if (event.data.fd == wake_fd) {
+                uint64_t dummy;
+                /// 读一次就把eventfd的计数清零
+                while (read(wake_fd, &dummy, sizeof(dummy)) > 0);
+                continue;
+            }
+            if (m_uring && event.data.fd == m_uring->getFd()) {
+                reapCompletions();
+                continue;
+            }
+            auto *fdContext = (FdContext *) event.data.ptr;
+            FdContext::MutexType::Lock lock(fdContext->mutex);
+            ///出错或挂断时读写等待都要唤醒，由重试的系统调用拿到错误
+            if (event.events & (EPOLLERR | EPOLLHUP)) {
+                event.events |= (EPOLLIN | EPOLLOUT) & (fdContext->registered ? ~0u : fdContext->m_events);
+            }
+            /// 记录要触发的事件
+            int real_events = NONE;
+            if (event.events & EPOLLIN) {
+                real_events |= READ;
+            }
+            if (event.events & EPOLLOUT) {
+                real_events |= WRITE;
+            }
+            if (fdContext->registered) {
+                ///持久注册：有人等待就唤醒，没人等待就记下就绪状态，不需要epoll_ctl
+                fdContext->notReady.fetch_and(~real_events, std::memory_order_release);
+                fdContext->ready = (Event) (fdContext->ready | (real_events & ~fdContext->m_events));
+                real_events &= fdContext->m_events;
                 if (real_events & READ) {
-                    fdContext->triggerEvent(READ);
+                    fdContext->triggerEvent(READ, owner);
                     --m_pendingEventCount;
                 }
                 if (real_events & WRITE) {
-                    fdContext->triggerEvent(WRITE);
+                    fdContext->triggerEvent(WRITE, owner);
                     --m_pendingEventCount;
                 }
+                continue;
+            }
+            ///　没有触发的事件可以处理,就是没有读事件（ＧＥＴ请求），写事件（ｐｏｓｔ请求）
+            if ((fdContext->m_events & real_events) == NONE) {
+                continue;
+            }
+
+            /// fdContext->m_events - real_events，从当前事件fdContext->m_events上减掉触发的事件real_events
+            int remind_events = (fdContext->m_events & ~real_events);
+            /// fdContext->m_events 减去 已经触发的real_events后，如果还有剩余事件，就修改，否则就整个直接删除掉
+            int op = remind_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            /// 将剩余的事件重新进行监听
+            event.events = EPOLLET | remind_events;
+            int ret2 = epoll_ctl(epfd, op, fdContext->fd, &event);
+            if (ret2 < 0) {
+                epoll_error_log("epoll_ctl", fdContext->fd, op, event.events, ret2, fdContext->m_events);
+                continue;
+            }
+            if (real_events & READ) {
+                fdContext->triggerEvent(READ, owner);
+                --m_pendingEventCount;
+            }
+            if (real_events & WRITE) {
+                fdContext->triggerEvent(WRITE, owner);
+                --m_pendingEventCount;
             }
-            ///　到这里说明已经处理完所有的触发事件,让出处理这些事件的协程的执行权
-            ///  返回到 idle_fiber->swapIn();（返回到原来的挂起点，继续向下执行）
-            Fiber::ptr curFiber = Fiber::GetThis();
-            auto raw_ptr = curFiber.get();
-            curFiber.reset();
-            raw_ptr->swapOut();
         }
     }
 
-    void IOSchedule::contextArrayResize(size_t size) {
-        m_fdContexts.resize(size);
-        for (size_t i = 0; i < m_fdContexts.size(); i++) {
-            if (m_fdContexts[i] == nullptr) {
-                auto fdContext = new FdContext;
-                fdContext->fd = i;
-                m_fdContexts[i] = fdContext;
+    void IOSchedule::listExpiredTimers(std::vector<Task> &cbs, int slot) {
+        ///刚从等待中醒来，先刷新缓存的时间
+        UpdateCachedClock();
+        listExpiredTimer(cbs);
+        ///其他调度线程正忙于执行任务时，它分片里到期的定时器由空闲线程代为取出
+        for (size_t other = 0; other < slotCount(); other++) {
+            if ((int) other != slot && m_waiters[other]->state.load(std::memory_order_relaxed) == Waiter::RUNNING) {
+                listExpiredTimer(cbs, other);
             }
         }
     }
 
-    void IOSchedule::onTimerInsertedAtFront() {
-        tickle();
+    size_t IOSchedule::currentTimerShard() {
+        ///调度循环里创建的定时器归本线程，其他线程(包括stop之前的use_caller线程)创建的放在共享分片
+        if (Scheduler::GetThis() == this && IsScheduling()) {
+            return GetSlot();
+        }
+        return sharedTimerShard();
+    }
+
+    void IOSchedule::onTimerInsertedAtFront(size_t shard) {
+        if (shard != sharedTimerShard() && shard == currentTimerShard()) {
+            ///本线程自己插入的，回到idle时会重新计算超时；本线程一直忙的话由leader代为处理，
+            ///只有比leader醒来的时间还早时才需要叫醒它
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint64_t wake_time = m_leaderWakeTime;
+            if (wake_time != 0 && getNextTimer(shard) + GetCachedMS() < wake_time) {
+                wakeLeader();
+            }
+        } else if (shard != sharedTimerShard()) {
+            ///只有分片所属的线程在等待这个分片的定时器
+            tickle((int) shard);
+        } else if (m_perThreadEpoll) {
+            ///叫醒一个空闲线程重新计算超时时间
+            tickle();
+        } else {
+            ///只有leader在等待定时器，让它重新计算超时时间
+            wakeLeader();
+        }
     }
 
     IOSchedule::FdContext::EventContext &IOSchedule::FdContext::getContext(IOSchedule::Event event) {
@@ -336,21 +897,27 @@ namespace Server {
     }
 
     void IOSchedule::FdContext::resetContext(IOSchedule::FdContext::EventContext &ctx) {
-        ctx.scheduler = nullptr;
-        ctx.fiber.reset();
-        ctx.cb = nullptr;
+        if (ctx.fiber) {
+            ctx.fiber.reset();
+        } else {
+            delete (Callback *) ctx.target;
+        }
+        ctx.target = nullptr;
     }
 
-    void IOSchedule::FdContext::triggerEvent(IOSchedule::Event event) {
+    void IOSchedule::FdContext::triggerEvent(IOSchedule::Event event, int thread) {
         SERVER_ASSERT(event & m_events)
         m_events = (Event) (m_events & ~event);
         EventContext &ctx = getContext(event);
-        if (ctx.cb) {
-            ctx.scheduler->post(ctx.cb);
+        void *target = ctx.target;
+        ctx.target = nullptr;
+        if (ctx.fiber) {
+            ((Scheduler *) target)->post(&ctx.fiber, thread);
         } else {
-            ctx.scheduler->post(ctx.fiber);
+            auto *callback = (Callback *) target;
+            callback->scheduler->post(&callback->cb, thread);
+            delete callback;
         }
-        ctx.scheduler = nullptr;
     }
 
 
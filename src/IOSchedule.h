@@ -7,6 +7,7 @@
 
 #include "Scheduler.h"
 #include "Timer.h"
+#include "IoUring.h"
 #include <sys/epoll.h>
 #include <csignal>
 
@@ -33,10 +34,12 @@ namespace Server {
         /**
          * @brief IO事件类型
          */
-        enum Event {
+        enum Event : uint8_t {
             NONE = 0x0,
+            /// EPOLLIN
             READ = 0x1,
-            WRITE = 0x2
+            /// EPOLLOUT
+            WRITE = 0x4
         };
 
     public:
@@ -48,7 +51,7 @@ namespace Server {
          * @brief register new event to listen
          * @return 0:success, -1:error
          * */
-        int addEvent(int fd, Event event, std::function<void()> read_callback = nullptr);
+        int addEvent(int fd, Event event, Task read_callback = nullptr);
 
         bool removeEvent(int fd, Event event);
 
@@ -56,45 +59,107 @@ namespace Server {
 
         bool cancelAllEvent(int fd);
 
+        /**
+         * @brief 持久注册模式下把fd以EPOLLIN|EPOLLOUT|EPOLLET注册到epoll上，之后等待事件不再调用epoll_ctl
+         * @return false表示没有启用持久注册模式或注册失败，第一次addEvent时还会再注册
+         */
+        bool registerFd(int fd);
+
+        /**
+         * @brief 持久注册模式下fd是否已知没有就绪：上次IO返回EAGAIN或者读/写不满，之后还没有新的边沿
+         * 这时可以跳过试探的系统调用直接等待；这之间到达的边沿记在FdContext::ready里，addEvent会立即返回
+         */
+        bool isKnownNotReady(int fd, Event event);
+
+        /**
+         * @brief 记录fd在event方向上没有就绪，下一个边沿到达时清除
+         */
+        void setNotReady(int fd, Event event);
+
+        /**
+         * @brief 是否启用了持久注册模式(io.epoll.persistent)
+         */
+        bool isPersistent() const { return m_persistent; }
+
         static IOSchedule *GetThis();
 
         bool stopping(uint64_t &timeout);
 
+        /**
+         * @brief 是否启用了io_uring(io.uring.enable且内核支持)
+         */
+        bool hasUring() const { return m_uring != nullptr; }
+
+        /**
+         * @brief 把sqe交给io_uring，挂起当前协程直到完成
+         * sqe先放进提交队列，同一轮调度中所有协程的sqe由一次io_uring_enter提交
+         * @param[in] sqe 要提交的请求，user_data会被覆盖
+         * @param[in] timeout_ms 超时时间，-1表示不超时，超时后请求被取消，返回-ECANCELED
+         * @return cqe的res：成功时>=0，失败时为-errno；提交队列满时返回-EAGAIN
+         * @pre hasUring()，在本调度器的协程中调用
+         */
+        int submitAndWait(io_uring_sqe &sqe, uint64_t timeout_ms = -1);
+
+        /**
+         * @brief 取消fd上所有还没有完成的io_uring请求，关闭fd之前调用
+         */
+        void cancelUring(int fd);
+
     protected:
         void tickle() override;
 
+        void tickle(int slot) override;
+
         bool stopping() override;
 
         void idle() override;
 
-        void contextArrayResize(size_t size);
+        void onTimerInsertedAtFront(size_t shard) override;
+
+        /**
+         * @brief 调度线程的定时器放在slot对应的分片
+         */
+        size_t currentTimerShard() override;
 
-        void onTimerInsertedAtFront() override;
+        /**
+         * @brief 本线程没有其他任务了，或者积攒的sqe足够多时，提交io_uring请求
+         */
+        void afterTask(int slot) override;
 
     public:
         /**
-         * @brief Socket事件上下文
+         * @brief Socket事件上下文，正好占一条cache line，相邻fd之间没有伪共享
          */
-        struct FdContext {
-            typedef Mutex MutexType;
+        struct alignas(64) FdContext {
+            /// 临界区只有几条指令(非持久模式下加一次epoll_ctl)，用1字节的自旋锁
+            typedef CASLock MutexType;
+
+            /**
+             * @brief 注册的回调，很少使用，放在堆上不占FdContext的空间
+             */
+            struct Callback {
+                Scheduler *scheduler = nullptr;
+                Task cb;
+            };
 
             /**
              * @brief 事件
              */
             struct EventContext {
-                /// 事件执行的调度器
-                Scheduler *scheduler;
                 /// 事件协程
                 Fiber::ptr fiber;
-                /// 事件的回调函数
-                std::function<void()> cb;
+                /// fiber不为空时是协程所在的Scheduler*，否则是注册回调时的Callback*，都为空表示没有等待者
+                void *target = nullptr;
+
+                bool empty() const { return !fiber && !target; }
             };
 
             /**
              * @brief 触发事件
              * @param[in] event 事件类型
+             * @param[in] thread 等待者在哪个线程恢复执行，-1表示任意线程
              */
-            void triggerEvent(Event event);
+            void triggerEvent(Event event, int thread = -1);
 
             /**
              * @brief 获取事件上下文类
@@ -109,27 +174,181 @@ namespace Server {
              */
             void resetContext(EventContext &ctx);
 
-            ~FdContext() = default;
+            ~FdContext() {
+                resetContext(read);
+                resetContext(write);
+            }
 
-            /// 事件关联的句柄
-            int fd = 0;
             /// 读事件上下文
             EventContext read;
             /// 写事件上下文
             EventContext write;
+            /// 事件关联的句柄
+            int fd = 0;
+            /// 每线程epoll模式下负责该fd的调度线程slot，-1表示还没有分配
+            int16_t owner = -1;
             /// 当前的事件
             Event m_events = NONE;
+            /// 持久注册模式下没有人等待时到达的就绪事件
+            Event ready = NONE;
+            /// 持久注册模式下是否已经注册到epoll上
+            bool registered = false;
+            /// 持久注册模式下已知没有就绪的方向，hook层不加锁读写
+            std::atomic<uint8_t> notReady = {NONE};
             /// 事件的Mutex
             MutexType mutex;
         };
 
+        static_assert(sizeof(FdContext) == 64, "FdContext should fit in one cache line");
+
+    private:
+        /**
+         * @brief 空闲线程的等待状态
+         * 同一时刻只有一个leader在epoll_wait上等待IO事件和定时器，其他空闲线程(follower)在各自的eventfd上等待，
+         * 这样指定线程的任务只唤醒目标线程，普通任务只唤醒一个follower
+         */
+        struct Waiter {
+            enum State {
+                RUNNING,
+                FOLLOWER,
+                LEADER
+            };
+            /// follower在这个eventfd上等待
+            int eventFd = -1;
+            /// 每线程epoll模式下本线程的epoll，eventFd注册在上面
+            int epfd = -1;
+            std::atomic<int> state = {RUNNING};
+        };
+
+        /**
+         * @brief 作为leader在epoll_wait上等待，处理IO事件和到期的定时器
+         */
+        void leaderWait(Waiter &waiter, epoll_event *events, int max_events);
+
+        /**
+         * @brief 作为follower在自己的eventfd上等待
+         */
+        void followerWait(Waiter &waiter, int slot);
+
+        /**
+         * @brief 每线程epoll模式：在本线程的epoll上等待自己负责的fd和eventfd
+         */
+        void ownerWait(Waiter &waiter, int slot, epoll_event *events, int max_events);
+
+        /**
+         * @brief epoll_wait，配置了io.epoll.busy_poll_us时先轮询一段时间再阻塞
+         * @param[in] slot 当前线程的slot，轮询期间有新任务就返回
+         * @return epoll_wait返回的事件数
+         */
+        int waitEvents(int epfd, int slot, epoll_event *events, int max_events, int timeout);
+
+        /**
+         * @brief 处理epoll_wait返回的事件
+         * @param[in] epfd 事件所在的epoll
+         * @param[in] wake_fd 这个epoll上的唤醒eventfd
+         */
+        void processEvents(int epfd, int wake_fd, epoll_event *events, int count);
+
+        /**
+         * @brief 取出fd的上下文，不加锁
+         * @param[in] auto_create 页或FdContext不存在时是否创建
+         * @return fd超出范围，或者不存在且auto_create为false时返回nullptr
+         */
+        FdContext *contextOf(int fd, bool auto_create);
+
+        /**
+         * @brief 持久注册fd
+         * @pre 持有fd_ctx->mutex
+         */
+        bool registerLocked(FdContext *fd_ctx);
+
+        /**
+         * @brief 把fd在epoll上关注的事件改为new_events，持久注册的fd不需要修改
+         * @pre 持有fd_ctx->mutex
+         */
+        bool updateInterest(FdContext *fd_ctx, Event new_events);
+
+        /**
+         * @brief fd所在的epoll，每线程epoll模式下第一次注册事件时给fd分配调度线程
+         * @pre 持有fd_ctx->mutex
+         */
+        int epollOf(FdContext *fd_ctx);
+
+        /**
+         * @brief 取出本线程分片、共享分片以及正在执行任务的线程分片中到期的定时器
+         */
+        void listExpiredTimers(std::vector<Task> &cbs, int slot);
+
+        /**
+         * @brief 唤醒一个睡眠中的follower
+         * @return false表示没有睡眠中的follower
+         */
+        bool wakeFollower();
+
+        /**
+         * @brief 唤醒epoll_wait中的leader，没有leader时下一个leader的epoll_wait会立即返回
+         */
+        void wakeLeader();
+
+        /**
+         * @brief 唤醒所有空闲线程
+         */
+        void wakeAll();
+
+        void removeSleeper(int slot);
+
+        /**
+         * @brief 收割io_uring的完成事件，恢复等待的协程
+         */
+        void reapCompletions();
+
     private:
         int m_epfd = 0;
-        int m_tickleFds[2];
+        /// leader的唤醒eventfd，注册在m_epfd上
+        int m_wakeFd = -1;
+        /// 下标与调度线程的slot一致
+        std::vector<std::unique_ptr<Waiter>> m_waiters;
+        /// 睡眠中的follower，后睡的先唤醒(缓存更热)
+        std::vector<int> m_sleepers;
+        Mutex m_sleepersMutex;
+        /// 是否有线程正在作为leader等待
+        std::atomic<bool> m_hasLeader = {false};
+        /// leader在epoll_wait上等到什么时候(ms)，0表示没有leader在等待
+        std::atomic<uint64_t> m_leaderWakeTime = {0};
+        /// 每个调度线程一个epoll，fd固定分配给一个线程
+        bool m_perThreadEpoll = false;
+        /// fd只注册一次，就绪状态记在FdContext里
+        bool m_persistent = false;
+        /// fd分配方式
+        enum FdAssign {
+            /// 依次分配给每个调度线程
+            ASSIGN_ROUND_ROBIN,
+            /// fd % 线程数
+            ASSIGN_HASH,
+            /// 分配给注册事件的线程(accept所在的线程)，非调度线程注册时退化为ROUND_ROBIN
+            ASSIGN_CURRENT
+        };
+        FdAssign m_fdAssign = ASSIGN_ROUND_ROBIN;
+        std::atomic<uint32_t> m_nextOwner = {0};
         ///等待执行的事件数,剩余要执行的任务数
         std::atomic<size_t> m_pendingEventCount = {0};
-        RWMutexType m_mutex{};
-        std::vector<FdContext *> m_fdContexts;
+        /// 每页的FdContext数
+        static constexpr int FD_PAGE_BITS = 10;
+        static constexpr size_t FD_PAGE_SIZE = 1 << FD_PAGE_BITS;
+        /// 一级表的页数，支持的最大fd为FD_MAX_PAGES * FD_PAGE_SIZE
+        static constexpr size_t FD_MAX_PAGES = 4096;
+
+        /**
+         * @brief 二级表的一页，FdContext第一次用到时才分配
+         */
+        struct FdPage {
+            std::atomic<FdContext *> slots[FD_PAGE_SIZE] = {};
+        };
+
+        /// fd ---> FdContext的两级表，页和FdContext一旦发布就不会移动或释放(直到调度器析构)
+        std::unique_ptr<std::atomic<FdPage *>[]> m_fdPages;
+        /// io_uring后端，没有启用时为空；ring fd注册在epoll上，完成事件和IO事件一起等待
+        IoUring::ptr m_uring;
     };
 
 } // Server
@@ -0,0 +1,118 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "IoUring.h"
+#include "Log.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace Server {
+
+    static int io_uring_setup(unsigned entries, io_uring_params *params) {
+        return (int) syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    IoUring::IoUring(unsigned entries) {
+        io_uring_params params{};
+        memset(&params, 0, sizeof(params));
+        int fd = io_uring_setup(entries, &params);
+        if (fd < 0) {
+            LOGE(LOG_ROOT()) << "io_uring_setup(" << entries << ") errno=" << errno << " " << strerror(errno);
+            return;
+        }
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_CQ_RING);
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe *) mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                       IORING_OFF_SQES);
+        if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED) {
+            LOGE(LOG_ROOT()) << "io_uring mmap errno=" << errno << " " << strerror(errno);
+            close(fd);
+            return;
+        }
+
+        auto *sq = (char *) m_sqRing;
+        m_sqHead = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.tail);
+        m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqEntries = params.sq_entries;
+
+        auto *cq = (char *) m_cqRing;
+        m_cqHead = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.tail);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_fd = fd;
+    }
+
+    IoUring::~IoUring() {
+        if (m_sqes && m_sqes != MAP_FAILED) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqRing && m_cqRing != MAP_FAILED) {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        if (m_sqRing && m_sqRing != MAP_FAILED) {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool IoUring::push(const io_uring_sqe &sqe, const io_uring_sqe *link) {
+        unsigned count = link ? 2 : 1;
+        CASLock::Lock lock(m_submitLock);
+        unsigned head = m_sqHead->load(std::memory_order_acquire);
+        unsigned tail = m_sqTail->load(std::memory_order_relaxed);
+        if (tail - head + count > m_sqEntries) {
+            return false;
+        }
+        m_sqes[tail & m_sqMask] = sqe;
+        m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+        ++tail;
+        if (link) {
+            m_sqes[tail & m_sqMask] = *link;
+            m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+            ++tail;
+        }
+        ///内核看到新的tail之前，sqe必须已经写好
+        m_sqTail->store(tail, std::memory_order_release);
+        m_unsubmitted += count;
+        return true;
+    }
+
+    int IoUring::flush() {
+        unsigned count = m_unsubmitted.exchange(0);
+        if (count == 0) {
+            return 0;
+        }
+        int ret;
+        do {
+            ret = io_uring_enter(m_fd, count, 0, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            ///内核暂时处理不了(EAGAIN/EBUSY)，下次再提交
+            m_unsubmitted += count;
+            return -errno;
+        }
+        if ((unsigned) ret < count) {
+            m_unsubmitted += count - ret;
+        }
+        return ret;
+    }
+}
@@ -0,0 +1,118 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_IOURING_H
+#define SERVER_IOURING_H
+
+#include <linux/io_uring.h>
+#include <atomic>
+#include <memory>
+#include "Mutex.h"
+
+namespace Server {
+
+    /**
+     * @brief io_uring的简单封装，直接使用系统调用(不依赖liburing)
+     * 任意线程都可以push，push只把sqe放进提交队列，flush时一次系统调用提交所有sqe
+     * 完成队列同一时刻只有一个线程收割
+     */
+    class IoUring {
+    public:
+        typedef std::unique_ptr<IoUring> ptr;
+
+        /**
+         * @param[in] entries 提交队列大小，内核会向上取2的幂
+         */
+        explicit IoUring(unsigned entries);
+
+        ~IoUring();
+
+        /**
+         * @brief 内核是否支持，初始化是否成功
+         */
+        bool isValid() const { return m_fd >= 0; }
+
+        /**
+         * @brief io_uring的fd，有完成事件时可读，可以注册到epoll上
+         */
+        int getFd() const { return m_fd; }
+
+        /**
+         * @brief 把sqe(以及链接在后面的sqe)放进提交队列，不进入内核
+         * @return false表示提交队列满了
+         */
+        bool push(const io_uring_sqe &sqe, const io_uring_sqe *link = nullptr);
+
+        /**
+         * @brief 还没有提交给内核的sqe数
+         */
+        unsigned pending() const { return m_unsubmitted.load(std::memory_order_relaxed); }
+
+        /**
+         * @brief 一次系统调用提交所有sqe
+         * @return 提交的sqe数，失败返回-errno
+         */
+        int flush();
+
+        /**
+         * @brief 完成队列是否有cqe
+         */
+        bool hasCompletions() const {
+            return m_cqHead->load(std::memory_order_relaxed) != m_cqTail->load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief 收割所有完成的cqe，其他线程正在收割时直接返回0
+         * @param[in] cb 对每个cqe调用cb(const io_uring_cqe &)
+         * @return 收割的cqe数
+         */
+        template<class Callback>
+        size_t reap(Callback cb) {
+            if (!m_reapLock.tryLock()) {
+                return 0;
+            }
+            size_t count = 0;
+            unsigned head = m_cqHead->load(std::memory_order_relaxed);
+            unsigned tail = m_cqTail->load(std::memory_order_acquire);
+            for (; head != tail; ++head, ++count) {
+                cb(m_cqes[head & m_cqMask]);
+            }
+            m_cqHead->store(head, std::memory_order_release);
+            m_reapLock.unlock();
+            return count;
+        }
+
+    public:
+        IoUring(const IoUring &) = delete;
+
+        IoUring &operator=(const IoUring &) = delete;
+
+    private:
+        int m_fd = -1;
+        /// 提交队列
+        void *m_sqRing = nullptr;
+        size_t m_sqRingSize = 0;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sqesSize = 0;
+        std::atomic<unsigned> *m_sqHead = nullptr;
+        std::atomic<unsigned> *m_sqTail = nullptr;
+        unsigned *m_sqArray = nullptr;
+        unsigned m_sqMask = 0;
+        unsigned m_sqEntries = 0;
+        /// 完成队列
+        void *m_cqRing = nullptr;
+        size_t m_cqRingSize = 0;
+        io_uring_cqe *m_cqes = nullptr;
+        std::atomic<unsigned> *m_cqHead = nullptr;
+        std::atomic<unsigned> *m_cqTail = nullptr;
+        unsigned m_cqMask = 0;
+
+        /// 多个线程push时保护提交队列
+        CASLock m_submitLock;
+        std::atomic<unsigned> m_unsubmitted = {0};
+        CASLock m_reapLock;
+    };
+}
+
+#endif //SERVER_IOURING_H
@@ -30,7 +30,7 @@
     if(logger->getLeveL() <= level) \
         Server::LogEventWrap(Server::LogEvent::ptr(new Server::LogEvent(logger, level, \
                         __FILE__, __LINE__, 0, Server::GetThreadId(),\
-                        Server::GetFiberId(), time(0), Server::Thread::GetName()))).getSS()
+                        Server::GetFiberId(), Server::GetCachedTime(), Server::Thread::GetName()))).getSS()
 
 #define LOGD(logger)  LOG_LEVEL(logger, Server::LogLevel::DEBUG)
 
@@ -0,0 +1,88 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_MPSCQUEUE_H
+#define SERVER_MPSCQUEUE_H
+
+#include <atomic>
+
+namespace Server {
+
+    /**
+     * @brief 无锁多生产者单消费者侵入式队列(Vyukov)
+     * T需要有成员 std::atomic<T *> next，并且可以默认构造(用作哨兵节点)
+     * push可以在任意线程调用，pop同一时刻只能有一个线程调用
+     * 队列本身不能可靠地判断是否为空(pop重新压入哨兵节点时，刚压入的节点可能还在链表上)，调用方另外维护计数
+     */
+    template<class T>
+    class MpscQueue {
+    public:
+        MpscQueue() : m_head(&m_stub), m_tail(&m_stub) {
+            m_stub.next.store(nullptr, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 压入一个节点
+         */
+        void push(T *node) {
+            push(node, node);
+        }
+
+        /**
+         * @brief 压入一条已经用next串好的链表[first, last]，只需要一次原子交换
+         */
+        void push(T *first, T *last) {
+            last->next.store(nullptr, std::memory_order_relaxed);
+            T *prev = m_head.exchange(last, std::memory_order_acq_rel);
+            /// 在这一步之前消费者看不到first，pop会暂时返回nullptr
+            prev->next.store(first, std::memory_order_release);
+        }
+
+        /**
+         * @brief 弹出一个节点，只能由消费者线程调用
+         * @return nullptr表示队列为空，或者生产者正在压入中
+         */
+        T *pop() {
+            T *tail = m_tail;
+            T *next = tail->next.load(std::memory_order_acquire);
+            if (tail == &m_stub) {
+                if (!next) {
+                    return nullptr;
+                }
+                m_tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next) {
+                m_tail = next;
+                return tail;
+            }
+            if (tail != m_head.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            ///只剩最后一个节点，重新压入哨兵节点后才能把它取出来
+            push(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next) {
+                m_tail = next;
+                return tail;
+            }
+            return nullptr;
+        }
+
+    public:
+        MpscQueue(const MpscQueue &) = delete;
+
+        MpscQueue &operator=(const MpscQueue &) = delete;
+
+    private:
+        /// 生产者端
+        alignas(64) std::atomic<T *> m_head;
+        /// 消费者端
+        alignas(64) T *m_tail;
+        T m_stub;
+    };
+}
+
+#endif //SERVER_MPSCQUEUE_H
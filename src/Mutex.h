@@ -131,7 +131,7 @@ namespace Server {
         }
 
         ~ReadScopedLockImpl() {
-            m_mutex.unlock();
+            unlock();
         }
 
         void lock() {
@@ -279,6 +279,13 @@ namespace Server {
 
         }
 
+        /**
+         * 尝试获取锁，不自旋
+         * */
+        bool tryLock() {
+            return !std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire);
+        }
+
         void unlock() {
             /**
              * release：解锁并唤醒任何等带中的进程
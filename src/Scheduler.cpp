@@ -4,8 +4,10 @@
 
 #include "Scheduler.h"
 
+#include <algorithm>
 #include <utility>
 #include "Log.h"
+#include "Config.h"
 
 namespace Server {
 
@@ -13,10 +15,31 @@ namespace Server {
 
     static thread_local Scheduler *t_scheduler = nullptr; // 当前schedule
     static thread_local Fiber *t_main_schedule_fiber = nullptr; // main schedule fiber
+    static thread_local int t_slot = -1; // 当前线程在调度器中的本地队列下标
+    static thread_local bool t_scheduling = false; // 当前线程是否在执行调度循环
+    static thread_local uint32_t t_steal_seed = 0; // 随机选择窃取对象
 
-    static bool isStateNotTermOrExcept(const Fiber::ptr &fiber) {
-        return fiber->getState() != Fiber::TERM || fiber->getState() != Fiber::EXCEPT;
-    }
+    /// 每次从全局队列搬到本地队列的任务数
+    static const size_t GLOBAL_BATCH_SIZE = 32;
+
+    static ConfigVar<uint32_t>::ptr g_background_budget =
+            Config::Lookup<uint32_t>("scheduler.background_budget", 64,
+                                     "run one background task after this many other tasks");
+
+    /// 配置修改后立即生效，take()每次读取最新值
+    static std::atomic<uint32_t> s_background_budget = {64};
+
+    struct _SchedulerIniter {
+        _SchedulerIniter() {
+            s_background_budget = g_background_budget->getValue();
+            g_background_budget->addChangeCallback([](const uint32_t &old_value, const uint32_t &new_value) {
+                LOGI(LOG_ROOT()) << "scheduler.background_budget changed from " << old_value << " to " << new_value;
+                s_background_budget = new_value;
+            });
+        }
+    };
+
+    static _SchedulerIniter s_scheduler_initer;
 
     static bool isStateNotTermAndExcept(const Fiber::ptr &fiber) {
         return fiber->getState() != Fiber::TERM && fiber->getState() != Fiber::EXCEPT;
@@ -46,16 +69,42 @@ namespace Server {
             t_main_schedule_fiber = m_scheduleFiber.get();
             m_mainThreadId = GetThreadId();
             m_threadIds.emplace_back(m_mainThreadId);
+            t_slot = 0;
         } else {
             m_mainThreadId = -1;
         }
         m_threadCount = threads;
+        ///use_caller线程占用第0个WorkerQueue，工作线程依次排在后面
+        for (size_t index = 0; index < m_threadCount + (use_caller ? 1 : 0); index++) {
+            m_workers.emplace_back(new WorkerQueue());
+        }
+        if (use_caller) {
+            m_workers[0]->threadId = m_mainThreadId;
+        }
     }
 
     Scheduler::~Scheduler() {
         SERVER_ASSERT(m_stopping)
         if (GetThis() == this) {
             t_scheduler = nullptr;
+            t_slot = -1;
+        }
+        for (auto &worker: m_workers) {
+            while (FiberAndThread *task = worker->local.steal()) {
+                FreeTask(task);
+            }
+            while (FiberAndThread *task = worker->inbox.pop()) {
+                FreeTask(task);
+            }
+        }
+        while (FiberAndThread *task = m_task_queue.pop()) {
+            FreeTask(task);
+        }
+        while (FiberAndThread *task = m_criticalQueue.pop()) {
+            FreeTask(task);
+        }
+        for (auto &item: m_backgroundTasks) {
+            FreeTask(item.second);
         }
     }
 
@@ -79,9 +128,17 @@ namespace Server {
         SERVER_ASSERT(m_threads.empty())
         m_threads.resize(m_threadCount);
         ///创建指定的工作线程，，每个线程都持有调度方法Scheduler::run
+        int first_slot = m_mainThreadId != -1 ? 1 : 0;
         for (size_t index = 0; index < m_threadCount; index++) {
-            m_threads[index].reset(new Thread(std::bind(&Scheduler::run, this), m_name + std::to_string(index)));
+            int slot = first_slot + (int) index;
+            m_threads[index].reset(new Thread([this, slot]() {
+                t_slot = slot;
+                ///线程自己也登记一次id，Thread构造返回前就开始运行的任务也能找到它的收件箱
+                m_workers[slot]->threadId = GetThreadId();
+                run();
+            }, m_name + std::to_string(index)));
             m_threadIds.emplace_back(m_threads[index]->getId());
+            m_workers[slot]->threadId = m_threads[index]->getId();
         }
         lock.unlock();
 //        if (m_scheduleFiber) {
@@ -137,6 +194,37 @@ namespace Server {
         LOGI(logger) << "Scheduler::tickle";
     }
 
+    void Scheduler::tickle(int slot) {
+        tickle();
+    }
+
+    int Scheduler::GetSlot() {
+        return t_slot;
+    }
+
+    bool Scheduler::IsScheduling() {
+        return t_scheduling;
+    }
+
+    bool Scheduler::hasPendingTasks(int slot) const {
+        if (slot >= 0 && m_workers[slot]->inboxCount > 0) {
+            return true;
+        }
+        if (m_criticalTaskCount > 0 || m_globalTaskCount > 0 || m_backgroundTaskCount > 0) {
+            return true;
+        }
+        for (auto &worker: m_workers) {
+            if (!worker->local.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool Scheduler::hasLocalTasks(int slot) const {
+        return m_workers[slot]->inboxCount > 0 || !m_workers[slot]->local.empty();
+    }
+
     ///协程调度模块的核心部分：协调协程与线程之间的调度
     void Scheduler::run() {
         LOGD(logger) << m_name << " Scheduler::run";
@@ -146,82 +234,72 @@ namespace Server {
         if (GetThreadId() != m_mainThreadId) {
             t_main_schedule_fiber = Fiber::GetThis().get();
         }
-        Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+        const int slot = t_slot;
+        SERVER_ASSERT(slot >= 0 && slot < (int) m_workers.size())
+        t_scheduling = true;
+        ///idle协程和任务交替执行，不放在共享栈上，免得每次切换都要拷贝
+        Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this), 0, false, true));
         ///注意：这里调用的是Fiber的默认构造函数，状态初始置为EXEC
         Fiber::ptr cb_fiber; //this fiber finish  callback task
-        FiberAndThread ft;
         while (true) {
-            ft.reset();
             bool tickle_me = false;
-            bool is_active = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                ///从消息队列中取出任务
-                auto it = m_task_queue.begin();
-                while (it != m_task_queue.end()) {
-                    /// 不在该任务指定的thread上,那么这个thread就不处理该任务，只是发出通知
-                    if (it->threadId != -1 && it->threadId != GetThreadId()) {
-                        ++it;
-                        /// 通知其他线程处理该任务
-                        tickle_me = true;
-                        continue;
-                    }
-                    ///首先要有协程或要执行的任务
-                    SERVER_ASSERT(it->fiber || it->cb)
-                    ///其次协程不能处于忙碌执行状态
-                    if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                        ++it;
-                        continue;
-                    }
-                    ///取出任务
-                    ft = *it;
-                    is_active = true;
-                    ///从消息队列中删除任务
-                    m_task_queue.erase(it);
-                    ++m_activeThreadCount;
-                    break;
+            ///从消息队列中取出任务
+            FiberAndThread *ft = take(slot, tickle_me);
+            if (ft && ft->fiber && ft->fiber->getState() == Fiber::EXEC) {
+                ///协程不能处于忙碌执行状态，放回队列，等它切出后再执行
+                if (ft->threadId != -1) {
+                    ++m_workers[slot]->inboxCount;
+                    m_workers[slot]->inbox.push(ft);
+                } else {
+                    m_workers[slot]->local.push(ft);
                 }
-                tickle_me |= it != m_task_queue.end();
+                ++m_taskCount;
+                --m_activeThreadCount;
+                ft = nullptr;
+                tickle_me = true;
             }
 
-            if (tickle_me)
+            if (tickle_me || (ft && m_taskCount > 0 && hasIdleThreads()))
                 tickle(); ///通知其他线程
 
             ///如果有要执行的协程,且状态不是结束状态
-            if (ft.fiber && isStateNotTermAndExcept(ft.fiber)) {
-                ft.fiber->swapIn();
+            if (ft && ft->fiber && isStateNotTermAndExcept(ft->fiber)) {
+                ft->fiber->swapIn();
                 --m_activeThreadCount;
-                if (ft.fiber->getState() == Fiber::READY) {
+                if (ft->fiber->getState() == Fiber::READY) {
                     /// 如果ft.fiber在READY狀態中，丢进消息队列
-                    post(ft.fiber);
-                } else if(isStateNotTermAndExcept(ft.fiber)){
-                    ///　ft.fiber如果没有结束，进入暂停状态
-                    ft.fiber->m_state = Fiber::HOLD;
+                    repost(ft);
+                } else {
+                    ///　ft.fiber如果没有结束，swapIn返回时已经置为暂停状态
+                    FreeTask(ft);
                 }
-                ft.reset();
+                afterTask(slot);
                 ///如果有要执行的cb,就把这个cb给cb_fiber协程，它就是用来执行cb的一个临时协程
-            } else if (ft.cb) {
+            } else if (ft && ft->cb) {
                 if (cb_fiber)
-                    cb_fiber->reset(ft.cb);
+                    cb_fiber->reset(std::move(ft->cb));
                 else
-                    cb_fiber.reset(new Fiber(ft.cb));
+                    cb_fiber = Fiber::Create(std::move(ft->cb));
 
-                ft.reset();
                 cb_fiber->swapIn();
                 --m_activeThreadCount;
                 ///cb_fiber协程执行完后，回到这里，然后在执行到这里
                 if (cb_fiber->getState() == Fiber::READY) {
-                    post(cb_fiber);
-                    cb_fiber.reset();
-                } else if (isStateTermOrExcept(cb_fiber)) {
-                    cb_fiber->reset(nullptr);
+                    ft->fiber.swap(cb_fiber);
+                    repost(ft);
                 } else {
-                    ///cb_fiber->getState() != Fiber::TERM 没有结束
-                    cb_fiber->m_state = Fiber::HOLD;
-                    cb_fiber.reset();
+                    FreeTask(ft);
+                    if (isStateTermOrExcept(cb_fiber)) {
+                        cb_fiber->reset(nullptr);
+                    } else {
+                        ///cb_fiber->getState() != Fiber::TERM 没有结束，已经处于HOLD状态
+                        cb_fiber.reset();
+                    }
                 }
+                afterTask(slot);
             } else {
-                if (is_active) {
+                if (ft) {
+                    FreeTask(ft);
                     --m_activeThreadCount;
                     continue;
                 }
@@ -240,6 +318,273 @@ namespace Server {
                 }
             }
         }
+        t_scheduling = false;
+        ///离开调度循环后没有人再刷新缓存的时间，改回直接读时钟，免得这个线程之后一直用停住的时间
+        ClearCachedClock();
+        ///hook只在调度线程里生效，use_caller的线程回到调用者后按普通线程处理，进程退出时静态对象析构里的close不再走hook
+        set_hook_enable(false);
+    }
+
+    void Scheduler::enqueue(FiberAndThread *first, FiberAndThread *last, size_t count) {
+        m_taskCount += count;
+        int thread_id = first->threadId;
+        if (thread_id != -1) {
+            int slot = slotOf(thread_id);
+            if (slot >= 0) {
+                ///指定了线程的任务直接放进该线程的收件箱，其他线程不用扫描，只有它能执行，只唤醒它
+                m_workers[slot]->inboxCount += count;
+                m_workers[slot]->inbox.push(first, last);
+                if (hasIdleThreads()) {
+                    tickle(slot);
+                }
+                return;
+            }
+            LOGE(logger) << m_name << " post to unknown thread " << thread_id << ", run it on any thread";
+            for (FiberAndThread *task = first;; task = task->next.load(std::memory_order_relaxed)) {
+                ///共享栈上的协程只能回到绑定的线程，那个线程不在这个调度器里，换到任意线程执行会踩坏别的协程的栈
+                SERVER_ASSERT2(!task->fiber || task->fiber->getBoundThread() == -1,
+                               m_name << " fiber bound to thread " << task->fiber->getBoundThread())
+                task->threadId = -1;
+                if (task == last) {
+                    break;
+                }
+            }
+        }
+        if (first->priority == CRITICAL) {
+            m_criticalTaskCount += count;
+            m_criticalQueue.push(first, last);
+            wakeIdle(count);
+            return;
+        }
+        if (first->priority == BACKGROUND) {
+            MutexType::Lock lock(m_backgroundMutex);
+            for (FiberAndThread *task = first;;) {
+                FiberAndThread *next = task->next.load(std::memory_order_relaxed);
+                task->next.store(nullptr, std::memory_order_relaxed);
+                m_backgroundTasks.emplace(task->deadline ? task->deadline : ~0ull, task);
+                if (task == last) {
+                    break;
+                }
+                task = next;
+            }
+            m_backgroundTaskCount += count;
+            m_backgroundDeadline = m_backgroundTasks.begin()->first;
+            lock.unlock();
+            wakeIdle(count);
+            return;
+        }
+        if (t_scheduler == this && t_slot >= 0) {
+            ///调度线程自己投递的任务，放入本地队列
+            WorkerQueue &worker = *m_workers[t_slot];
+            for (FiberAndThread *task = first;;) {
+                ///压入本地队列后任务可能马上被窃取执行，先取出下一个节点
+                FiberAndThread *next = task->next.load(std::memory_order_relaxed);
+                task->next.store(nullptr, std::memory_order_relaxed);
+                worker.local.push(task);
+                if (task == last) {
+                    break;
+                }
+                task = next;
+            }
+            wakeIdle(count);
+            return;
+        }
+        m_globalTaskCount += count;
+        m_task_queue.push(first, last);
+        wakeIdle(count);
+    }
+
+    void Scheduler::wakeIdle(size_t count) {
+        for (size_t wakeups = std::min(count, m_idleThreadCount.load()); wakeups > 0; --wakeups) {
+            tickle();
+        }
+    }
+
+    int Scheduler::slotOf(int thread_id) const {
+        for (size_t slot = 0; slot < m_workers.size(); slot++) {
+            if (m_workers[slot]->threadId == thread_id) {
+                return (int) slot;
+            }
+        }
+        return -1;
+    }
+
+    Scheduler::FiberAndThread *Scheduler::take(int slot, bool &tickle_me) {
+        if (m_taskCount == 0) {
+            return nullptr;
+        }
+        FiberAndThread *task = nullptr;
+        WorkerQueue &worker = *m_workers[slot];
+        ///计数先于节点可见，pop可能暂时返回nullptr，下一轮再取
+        if (worker.inboxCount > 0) {
+            task = worker.inbox.pop();
+            if (task) {
+                --worker.inboxCount;
+            }
+        }
+
+        if (!task && m_criticalTaskCount > 0 && m_criticalConsumer.tryLock()) {
+            task = m_criticalQueue.pop();
+            if (task) {
+                --m_criticalTaskCount;
+            }
+            m_criticalConsumer.unlock();
+        }
+
+        ///后台任务到了截止时间，或者本线程已经连续执行了太多其他任务，先执行一个后台任务
+        if (!task && m_backgroundTaskCount > 0
+            && (worker.sinceBackground >= s_background_budget || m_backgroundDeadline <= GetCachedMS())) {
+            task = takeBackground();
+        }
+
+        ///本地队列按FIFO顺序取，和原来消息队列的执行顺序保持一致
+        while (!task && !worker.local.empty()) {
+            task = worker.local.steal();
+        }
+
+        if (!task && m_globalTaskCount > 0 && m_globalConsumer.tryLock()) {
+            ///抢到全局队列的消费权，取一个任务执行，再搬一批到本地队列，其他空闲线程可以从这里窃取
+            task = m_task_queue.pop();
+            for (size_t index = 0; task && index < GLOBAL_BATCH_SIZE; index++) {
+                FiberAndThread *other = m_task_queue.pop();
+                if (!other) {
+                    break;
+                }
+                --m_globalTaskCount;
+                worker.local.push(other);
+            }
+            if (task) {
+                --m_globalTaskCount;
+            }
+            m_globalConsumer.unlock();
+        }
+
+        if (!task) {
+            task = steal(slot);
+        }
+
+        if (!task && m_backgroundTaskCount > 0) {
+            task = takeBackground();
+        }
+
+        if (task) {
+            if (task->priority == BACKGROUND) {
+                worker.sinceBackground = 0;
+            } else if (m_backgroundTaskCount > 0) {
+                ++worker.sinceBackground;
+            }
+        }
+
+        if (task) {
+            ///先增加活跃线程数再减少任务数，stopping()不会看到两者同时为0
+            ++m_activeThreadCount;
+            --m_taskCount;
+        } else if (hasPendingTasks(-1)) {
+            ///任务正在被其他线程搬运或窃取，通知其他线程再取一次；其他线程收件箱里的任务投递时已经唤醒了目标线程
+            tickle_me = true;
+        }
+        return task;
+    }
+
+    Scheduler::FiberAndThread *Scheduler::steal(int slot) {
+        size_t count = m_workers.size();
+        if (count <= 1) {
+            return nullptr;
+        }
+        if (t_steal_seed == 0) {
+            t_steal_seed = (uint32_t) GetThreadId() | 1;
+        }
+        /// xorshift随机数，挑一个起始的窃取对象，然后依次尝试其他线程
+        t_steal_seed ^= t_steal_seed << 13;
+        t_steal_seed ^= t_steal_seed >> 17;
+        t_steal_seed ^= t_steal_seed << 5;
+        size_t start = t_steal_seed % count;
+        for (size_t i = 0; i < count; i++) {
+            size_t victim = (start + i) % count;
+            if (victim == (size_t) slot) {
+                continue;
+            }
+            if (FiberAndThread *task = m_workers[victim]->local.steal()) {
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    Scheduler::FiberAndThread *Scheduler::takeBackground() {
+        MutexType::Lock lock(m_backgroundMutex);
+        if (m_backgroundTasks.empty()) {
+            return nullptr;
+        }
+        auto it = m_backgroundTasks.begin();
+        FiberAndThread *task = it->second;
+        m_backgroundTasks.erase(it);
+        --m_backgroundTaskCount;
+        m_backgroundDeadline = m_backgroundTasks.empty() ? ~0ull : m_backgroundTasks.begin()->first;
+        return task;
+    }
+
+    void Scheduler::repost(FiberAndThread *task) {
+        ///复用原来的任务节点，保留优先级和截止时间
+        task->cb = nullptr;
+        task->threadId = task->boundThread(-1);
+        enqueue(task, task, 1);
+    }
+
+    /**
+     * @brief FiberAndThread节点池：每个线程缓存一批空闲节点，多出来的整批放到全局池
+     * 投递线程和执行线程通常不是同一个，全局池负责把节点从执行线程还给投递线程
+     */
+    static const size_t TASK_CACHE_SIZE = 256;
+    static const size_t TASK_BATCH_SIZE = 64;
+
+    struct Scheduler::TaskCache {
+        std::vector<FiberAndThread *> nodes;
+
+        ~TaskCache() {
+            for (auto node: nodes) {
+                delete node;
+            }
+        }
+
+        static thread_local TaskCache t_local;
+        /// 全局池，每个元素是一批节点
+        static Mutex s_mutex;
+        static std::vector<std::vector<FiberAndThread *>> s_pool;
+    };
+
+    thread_local Scheduler::TaskCache Scheduler::TaskCache::t_local;
+    Mutex Scheduler::TaskCache::s_mutex;
+    std::vector<std::vector<Scheduler::FiberAndThread *>> Scheduler::TaskCache::s_pool;
+
+    Scheduler::FiberAndThread *Scheduler::AllocTask() {
+        auto &nodes = TaskCache::t_local.nodes;
+        if (nodes.empty()) {
+            Mutex::Lock lock(TaskCache::s_mutex);
+            if (!TaskCache::s_pool.empty()) {
+                nodes.swap(TaskCache::s_pool.back());
+                TaskCache::s_pool.pop_back();
+            }
+        }
+        if (nodes.empty()) {
+            return new FiberAndThread();
+        }
+        FiberAndThread *task = nodes.back();
+        nodes.pop_back();
+        return task;
+    }
+
+    void Scheduler::FreeTask(FiberAndThread *task) {
+        task->reset();
+        task->next.store(nullptr, std::memory_order_relaxed);
+        auto &nodes = TaskCache::t_local.nodes;
+        nodes.push_back(task);
+        if (nodes.size() >= TASK_CACHE_SIZE) {
+            std::vector<FiberAndThread *> batch(nodes.end() - TASK_BATCH_SIZE, nodes.end());
+            nodes.resize(nodes.size() - TASK_BATCH_SIZE);
+            Mutex::Lock lock(TaskCache::s_mutex);
+            TaskCache::s_pool.emplace_back(std::move(batch));
+        }
     }
 
     void Scheduler::setThis() {
@@ -256,8 +601,7 @@ namespace Server {
     }
 
     bool Scheduler::stopping() {
-        MutexType::Lock lock(m_mutex);
-        return m_auto_stop && m_stopping && m_task_queue.empty() && m_activeThreadCount == 0;
+        return m_auto_stop && m_stopping && m_taskCount == 0 && m_activeThreadCount == 0;
     }
 
     std::ostream &Scheduler::dump(std::ostream &os) {
@@ -265,6 +609,9 @@ namespace Server {
            << " size=" << m_threadCount
            << " active_count=" << m_activeThreadCount
            << " idle_count=" << m_idleThreadCount
+           << " task_count=" << m_taskCount
+           << " critical_count=" << m_criticalTaskCount
+           << " background_count=" << m_backgroundTaskCount
            << " stopping=" << m_stopping
            << " ]" << std::endl << "    ";
         for (size_t i = 0; i < m_threadIds.size(); ++i) {
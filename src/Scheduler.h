@@ -9,10 +9,15 @@
 #include "Mutex.h"
 #include "Thread.h"
 #include <list>
+#include <map>
 #include <utility>
 #include <vector>
 #include <functional>
 #include "Hook.h"
+#include "WorkStealingQueue.h"
+#include "MpscQueue.h"
+#include "Task.h"
+#include "Util.h"
 
 ///协程调度：协程在线程之际切换，一个线程中有一堆协程，如果这个线程很繁忙，那么它底下的协程可以切换到其他空闲的线程上执行。
 ///scheduler ----》 N个线程Thread ----》M个线程Thread ----》 多个协程
@@ -28,6 +33,18 @@ namespace Server {
         typedef std::shared_ptr<Scheduler> ptr;
         typedef Mutex MutexType;
 
+        /**
+         * @brief 任务优先级，调度线程先取高优先级的任务
+         */
+        enum Priority {
+            /// 健康检查、管理命令等，优先于其他任务执行
+            CRITICAL = 0,
+            /// 普通请求
+            NORMAL = 1,
+            /// 后台任务，其他队列空闲时才执行，超过截止时间或等待太久会被提前执行
+            BACKGROUND = 2
+        };
+
     public:
         /**
          * @brief 构造函数
@@ -71,35 +88,82 @@ namespace Server {
          */
         template<class FiberOrCb>
         void post(FiberOrCb fc, int thread = -1) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                need_tickle = scheduleNoLock(fc, thread);
+            FiberAndThread *task = AllocTask();
+            task->assign(std::move(fc), thread);
+            if (!task->fiber && !task->cb) {
+                FreeTask(task);
+                return;
             }
-            ///m_fibers is empty
-            if (need_tickle) {
-                tickle();
+            enqueue(task, task, 1);
+        }
+
+        /**
+         * @brief 按优先级调度协程
+         * @param[in] fc task unit
+         * @param[in] priority 优先级
+         * @param[in] deadline_ms 后台任务最迟多少毫秒后开始执行，0表示没有截止时间
+         * @param[in] thread task unit执行的线程id,-1标识任意线程，指定线程的任务只进入该线程的收件箱，不区分优先级
+         */
+        template<class FiberOrCb>
+        void post(FiberOrCb fc, Priority priority, uint64_t deadline_ms = 0, int thread = -1) {
+            FiberAndThread *task = AllocTask();
+            task->assign(std::move(fc), thread);
+            if (!task->fiber && !task->cb) {
+                FreeTask(task);
+                return;
             }
+            task->priority = priority;
+            task->deadline = deadline_ms ? GetCachedMS() + deadline_ms : 0;
+            enqueue(task, task, 1);
+        }
+
+        /**
+         * @brief 批量调度协程，所有任务一次入队，按新任务数唤醒空闲线程
+         * @param[in,out] tasks 回调或协程数组，元素被移走后置空
+         * @param[in] thread 执行的线程id,-1标识任意线程
+         */
+        template<class FiberOrCb>
+        void post(std::vector<FiberOrCb> &tasks, int thread = -1) {
+            post(tasks.begin(), tasks.end(), thread);
         }
 
         /**
          * @brief 批量调度协程
          * @param[in] begin 协程数组的开始
          * @param[in] end 协程数组的结束
+         * @param[in] thread 执行的线程id,-1标识任意线程
          */
         template<class InputIterator>
-        void post(InputIterator begin, InputIterator end) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while (begin != end) {
-                    need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                    begin++;
+        void post(InputIterator begin, InputIterator end, int thread = -1) {
+            ///先在本地串成链表，再整条压入队列
+            ///绑定了线程的协程会改写各自的threadId，enqueue按链表头的threadId投递，threadId变化时先把前面的一段压入
+            FiberAndThread *first = nullptr;
+            FiberAndThread *last = nullptr;
+            size_t count = 0;
+            for (; begin != end; ++begin) {
+                FiberAndThread *task = AllocTask();
+                task->assign(&*begin, thread);
+                if (!task->fiber && !task->cb) {
+                    FreeTask(task);
+                    continue;
                 }
-                if (need_tickle)
-                    tickle();
+                if (last && last->threadId != task->threadId) {
+                    enqueue(first, last, count);
+                    first = last = nullptr;
+                    count = 0;
+                }
+                if (last) {
+                    last->next.store(task, std::memory_order_relaxed);
+                } else {
+                    first = task;
+                }
+                last = task;
+                ++count;
             }
-
+            if (count == 0) {
+                return;
+            }
+            enqueue(first, last, count);
         }
 
     protected:
@@ -108,6 +172,12 @@ namespace Server {
          */
         virtual void tickle();
 
+        /**
+         * @brief 通知指定的调度线程有任务了(指定线程的任务)，默认和tickle()一样
+         * @param[in] slot 调度线程的WorkerQueue下标
+         */
+        virtual void tickle(int slot);
+
         /**
          * @brief 协程调度函数
          */
@@ -123,6 +193,12 @@ namespace Server {
          */
         virtual void idle();
 
+        /**
+         * @brief 调度线程执行完一个任务(协程切出或结束)后调用
+         * @param[in] slot 当前线程的WorkerQueue下标
+         */
+        virtual void afterTask(int slot) {}
+
         /**
          * @brief 设置当前的协程调度器
          */
@@ -133,19 +209,30 @@ namespace Server {
          */
         bool hasIdleThreads() { return m_idleThreadCount > 0; }
 
-    private:
         /**
-         * @brief 协程调度启动(无锁)
+         * @brief 是否还有slot线程可以执行的任务(收件箱、公共队列、任意线程的本地队列)，空闲线程睡眠前再检查一次
          */
-        template<class FiberOrCb>
-        bool scheduleNoLock(FiberOrCb fc, int thread) {
-            bool need_tickle = m_task_queue.empty();
-            FiberAndThread ft(fc, thread);
-            if (ft.fiber || ft.cb) {
-                m_task_queue.push_back(ft);
-            }
-            return need_tickle;
-        }
+        bool hasPendingTasks(int slot) const;
+
+        /**
+         * @brief slot线程自己的收件箱或本地队列中是否还有任务
+         */
+        bool hasLocalTasks(int slot) const;
+
+        /**
+         * @brief 当前线程在调度器中的WorkerQueue下标，-1表示不是调度线程
+         */
+        static int GetSlot();
+
+        /**
+         * @brief 当前线程是否正在执行调度循环，use_caller的线程在stop之前不算
+         */
+        static bool IsScheduling();
+
+        /**
+         * @brief 调度线程数(包括use_caller的线程)
+         */
+        size_t slotCount() const { return m_workers.size(); }
 
     private:
         /**
@@ -155,42 +242,156 @@ namespace Server {
             ///协程
             Fiber::ptr fiber;
             ///协程要执行回调
-            std::function<void()> cb;
+            Task cb;
             ///指定在ThreadId线程上处理该任务
-            int threadId;
-
-            ///外面在栈上定义的智能指针，传递进来，用这个构造函数，因为栈的生命周期会管理外面在栈上定义的智能指针
-            FiberAndThread(Fiber::ptr f, int thread) : fiber(std::move(f)), threadId(thread) {}
+            int threadId = -1;
+            ///优先级
+            Priority priority = NORMAL;
+            ///后台任务的截止时间(ms)，0表示没有
+            uint64_t deadline = 0;
+            ///MpscQueue链表指针
+            std::atomic<FiberAndThread *> next = {nullptr};
+
+            ///外面在栈上定义的智能指针，传递进来，用这个重载，因为栈的生命周期会管理外面在栈上定义的智能指针
+            void assign(Fiber::ptr f, int thread) {
+                fiber = std::move(f);
+                threadId = boundThread(thread);
+            }
 
-            ///当外面在堆上定义智能指针的指针的时候，生命周期是整个程序，那么使用这个构造函数，内部通过swap释放外面的指针智针
-            FiberAndThread(Fiber::ptr *f, int thread) : threadId(thread) {
+            ///当外面在堆上定义智能指针的指针的时候，生命周期是整个程序，那么使用这个重载，内部通过swap释放外面的指针智针
+            void assign(Fiber::ptr *f, int thread) {
                 ///swap之后，f智能指针变为空值，它的引用也就减1
                 fiber.swap(*f);
+                threadId = boundThread(thread);
             }
 
-            FiberAndThread(std::function<void()> f, int thread) : cb(std::move(f)), threadId(thread) {
+            ///共享栈上的协程只能回到绑定的线程执行
+            int boundThread(int thread) const {
+                if (fiber && fiber->getBoundThread() != -1) {
+                    return fiber->getBoundThread();
+                }
+                return thread;
             }
 
-            FiberAndThread(std::function<void()> *f, int thread) : threadId(thread) {
-                cb.swap(*f);
+            void assign(Task f, int thread) {
+                cb = std::move(f);
+                threadId = thread;
             }
 
-            FiberAndThread() : threadId(-1) {}
+            ///传入回调的指针，回调被移走，外面的对象不再持有它
+            template<class F, class = std::enable_if_t<!std::is_function_v<F>>>
+            void assign(F *f, int thread) {
+                cb = Task(std::move(*f));
+                threadId = thread;
+            }
 
             void reset() {
                 fiber = nullptr;
                 cb = nullptr;
                 threadId = -1;
+                priority = NORMAL;
+                deadline = 0;
             }
         };
 
+        /// 线程本地的FiberAndThread节点缓存
+        struct TaskCache;
+
+        /**
+         * @brief 从节点池中取出一个空的FiberAndThread，稳定状态下不需要分配内存
+         */
+        static FiberAndThread *AllocTask();
+
+        /**
+         * @brief 清空FiberAndThread并归还到节点池
+         */
+        static void FreeTask(FiberAndThread *task);
+
+        /**
+         * @brief 每个调度线程的任务队列
+         */
+        struct WorkerQueue {
+            /// 本地队列(Chase-Lev)，只有本线程push，空闲线程可以从这里窃取
+            WorkStealingQueue<FiberAndThread> local;
+            /// 收件箱：指定在本线程执行的任务，任意线程无锁投递，只有本线程消费，不会被窃取
+            MpscQueue<FiberAndThread> inbox;
+            /// 收件箱中的任务数，压入前增加、取出后减少，判断收件箱是否有任务只看它
+            std::atomic<size_t> inboxCount = {0};
+            /// 本线程id，-1表示线程还没有启动
+            std::atomic<int> threadId = {-1};
+            /// 上次执行后台任务以来执行的其他任务数，只有本线程访问
+            uint32_t sinceBackground = 0;
+        };
+
+    private:
+        /**
+         * @brief 任务入队：指定线程的任务进入该线程的收件箱，CRITICAL和BACKGROUND任务进入各自的全局队列，
+         *        当前调度线程投递的普通任务进入本线程的本地队列，其他情况进入全局队列
+         * @param[in] first,last 用next串好的任务链表，所有任务的threadId和priority相同
+         * @param[in] count 链表中的任务数
+         * 入队后按任务数唤醒空闲线程(不超过空闲线程数)，指定线程的任务只唤醒目标线程
+         * @pre 绑定了线程的共享栈协程只能投递到包含该线程的调度器，否则断言失败
+         */
+        void enqueue(FiberAndThread *first, FiberAndThread *last, size_t count);
+
+        /**
+         * @brief 唤醒min(count, 空闲线程数)个空闲线程
+         */
+        void wakeIdle(size_t count);
+
+        /**
+         * @brief 根据线程id查找对应的WorkerQueue下标
+         * @return -1表示不是本调度器的线程
+         */
+        int slotOf(int thread_id) const;
+
+        /**
+         * @brief 取出一个可以在当前线程执行的任务：收件箱 ---> CRITICAL队列 ---> 到期或饥饿的后台任务
+         *        ---> 本地队列 ---> 全局队列 ---> 窃取其他线程的本地队列 ---> 后台任务
+         * @param[in] slot 当前线程的WorkerQueue下标
+         * @param[out] tickle_me 是否需要通知其他线程
+         */
+        FiberAndThread *take(int slot, bool &tickle_me);
+
+        /**
+         * @brief 随机挑选其他线程的本地队列进行窃取
+         */
+        FiberAndThread *steal(int slot);
+
+        /**
+         * @brief 取出截止时间最早的后台任务
+         */
+        FiberAndThread *takeBackground();
+
+        /**
+         * @brief 执行完的协程处于READY状态，按原来的优先级重新入队
+         */
+        void repost(FiberAndThread *task);
+
     private:
         MutexType m_mutex;
         /// thread pool
         std::vector<Thread::ptr> m_threads;
-        /// FiberAndThread queue, 需要执行的task在这个队列里面，消息队列（待执行的任务队列）
+        /// 全局任务队列：非调度线程投递的任务放在这里，同一时刻只有抢到m_globalConsumer的线程消费
         /// FiberAndThread里面包含了：Fiber、Thread、function ，都可以作为执行的task unit
-        std::list<FiberAndThread> m_task_queue;
+        MpscQueue<FiberAndThread> m_task_queue;
+        CASLock m_globalConsumer;
+        /// 每个调度线程一组队列，下标与m_threadIds一致
+        std::vector<std::unique_ptr<WorkerQueue>> m_workers;
+        /// 全局队列中的任务数，为0时不用加锁
+        std::atomic<size_t> m_globalTaskCount = {0};
+        /// CRITICAL任务队列，同一时刻只有抢到m_criticalConsumer的线程消费
+        MpscQueue<FiberAndThread> m_criticalQueue;
+        CASLock m_criticalConsumer;
+        std::atomic<size_t> m_criticalTaskCount = {0};
+        /// 后台任务按截止时间排序，没有截止时间的排在最后，相同截止时间按投递顺序
+        std::multimap<uint64_t, FiberAndThread *> m_backgroundTasks;
+        MutexType m_backgroundMutex;
+        std::atomic<size_t> m_backgroundTaskCount = {0};
+        /// 最早的后台任务截止时间，不加锁判断是否有后台任务到期
+        std::atomic<uint64_t> m_backgroundDeadline = {~0ull};
+        /// 所有队列中的任务总数
+        std::atomic<size_t> m_taskCount = {0};
         /// use_caller为true时有效, 调度协程：main fiber是用来做调度的协程
         Fiber::ptr m_scheduleFiber;
         /// 协程调度器名称
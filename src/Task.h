@@ -0,0 +1,206 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_TASK_H
+#define SERVER_TASK_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Server {
+
+    /**
+     * @brief 只能移动的回调任务，代替std::function<void()>
+     * 小于INLINE_SIZE的可调用对象直接放在内部缓冲区，不需要分配内存，更大的才放到堆上
+     */
+    class Task {
+    public:
+        /// 内部缓冲区大小，整个Task正好占一条cache line
+        static constexpr size_t INLINE_SIZE = 56;
+
+        Task() noexcept = default;
+
+        Task(std::nullptr_t) noexcept {}
+
+        /**
+         * @brief 从任意可调用对象构造，空的std::function和空指针构造出空Task
+         */
+        template<class F, class D = std::decay_t<F>,
+                class = std::enable_if_t<!std::is_same_v<D, Task> && std::is_invocable_v<D &>>>
+        Task(F &&f) {
+            if constexpr (std::is_pointer_v<std::remove_reference_t<F>> || IsStdFunction<D>::value) {
+                if (!f) {
+                    return;
+                }
+            }
+            if constexpr (IsInline<D>) {
+                ::new(static_cast<void *>(m_buffer)) D(std::forward<F>(f));
+                m_ops = &InlineOps<D>::ops;
+            } else {
+                *reinterpret_cast<D **>(m_buffer) = new D(std::forward<F>(f));
+                m_ops = &HeapOps<D>::ops;
+            }
+        }
+
+        Task(Task &&other) noexcept {
+            moveFrom(other);
+        }
+
+        Task &operator=(Task &&other) noexcept {
+            if (this != &other) {
+                clear();
+                moveFrom(other);
+            }
+            return *this;
+        }
+
+        Task &operator=(std::nullptr_t) noexcept {
+            clear();
+            return *this;
+        }
+
+        ~Task() {
+            clear();
+        }
+
+        void operator()() {
+            m_ops->invoke(m_buffer);
+        }
+
+        explicit operator bool() const noexcept {
+            return m_ops != nullptr;
+        }
+
+        /**
+         * @brief 创建点的标识，用来按创建点统计
+         * 函数指针是指向的函数；std::function和std::bind的结果要到运行时才知道调用谁，同一类型可能来自任意创建点，返回nullptr；
+         * 其他类型每种一个标识(它的调用函数)；空Task返回nullptr
+         */
+        const void *site() const noexcept {
+            return m_ops ? m_ops->site(m_buffer) : nullptr;
+        }
+
+        void swap(Task &other) noexcept {
+            Task tmp(std::move(other));
+            other = std::move(*this);
+            *this = std::move(tmp);
+        }
+
+    public:
+        Task(const Task &) = delete;
+
+        Task &operator=(const Task &) = delete;
+
+    private:
+        /**
+         * @brief 可调用对象的操作表，每种类型一份
+         */
+        struct Ops {
+            void (*invoke)(void *buffer);
+
+            /// 把src里的对象移动到dst，并析构src里的对象
+            void (*relocate)(void *dst, void *src) noexcept;
+
+            void (*destroy)(void *buffer) noexcept;
+
+            const void *(*site)(const void *buffer) noexcept;
+        };
+
+        template<class D>
+        static constexpr bool IsInline = sizeof(D) <= INLINE_SIZE
+                                         && alignof(D) <= alignof(std::max_align_t)
+                                         && std::is_nothrow_move_constructible_v<D>;
+
+        template<class D>
+        struct IsStdFunction : std::false_type {
+        };
+
+        template<class R, class... Args>
+        struct IsStdFunction<std::function<R(Args...)>> : std::true_type {
+        };
+
+        /**
+         * @param[in] f 可调用对象
+         * @param[in] invoke 这种类型的调用函数
+         */
+        template<class D>
+        static const void *SiteOf(const D *f, void (*invoke)(void *)) noexcept {
+            if constexpr (std::is_pointer_v<D>) {
+                return reinterpret_cast<const void *>(*f);
+            } else if constexpr (IsStdFunction<D>::value || std::is_bind_expression_v<D>) {
+                return nullptr;
+            } else {
+                return reinterpret_cast<const void *>(invoke);
+            }
+        }
+
+        template<class D>
+        struct InlineOps {
+            static void invoke(void *buffer) {
+                (*static_cast<D *>(buffer))();
+            }
+
+            static void relocate(void *dst, void *src) noexcept {
+                ::new(dst) D(std::move(*static_cast<D *>(src)));
+                static_cast<D *>(src)->~D();
+            }
+
+            static void destroy(void *buffer) noexcept {
+                static_cast<D *>(buffer)->~D();
+            }
+
+            static const void *site(const void *buffer) noexcept {
+                return SiteOf<D>(static_cast<const D *>(buffer), invoke);
+            }
+
+            static constexpr Ops ops = {invoke, relocate, destroy, site};
+        };
+
+        template<class D>
+        struct HeapOps {
+            static void invoke(void *buffer) {
+                (**static_cast<D **>(buffer))();
+            }
+
+            static void relocate(void *dst, void *src) noexcept {
+                *static_cast<D **>(dst) = *static_cast<D **>(src);
+            }
+
+            static void destroy(void *buffer) noexcept {
+                delete *static_cast<D **>(buffer);
+            }
+
+            static const void *site(const void *buffer) noexcept {
+                return SiteOf<D>(*static_cast<D *const *>(buffer), invoke);
+            }
+
+            static constexpr Ops ops = {invoke, relocate, destroy, site};
+        };
+
+        void moveFrom(Task &other) noexcept {
+            if (other.m_ops) {
+                other.m_ops->relocate(m_buffer, other.m_buffer);
+                m_ops = other.m_ops;
+                other.m_ops = nullptr;
+            }
+        }
+
+        void clear() noexcept {
+            if (m_ops) {
+                const Ops *ops = m_ops;
+                m_ops = nullptr;
+                ops->destroy(m_buffer);
+            }
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char m_buffer[INLINE_SIZE];
+        const Ops *m_ops = nullptr;
+    };
+}
+
+#endif //SERVER_TASK_H
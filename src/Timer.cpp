@@ -4,36 +4,67 @@
 
 #include "Timer.h"
 #include "Log.h"
+#include "Config.h"
 #include <utility>
+#include <algorithm>
+#include <bit>
 
 namespace Server {
 
-    Timer::Timer(uint64_t ms, std::function<void()> cb, TimerManager *manager, bool recurring)
-            : m_recurring(recurring), m_ms(ms), m_cb(std::move(cb)), m_manager(manager) {
+    Timer::Timer(uint64_t ms, Task cb, TimerManager *manager, bool recurring, uint64_t slack)
+            : m_recurring(recurring), m_ms(ms), m_slack(slack), m_manager(manager) {
+        if (m_recurring) {
+            m_recurringCb = std::make_shared<Task>(std::move(cb));
+        } else {
+            m_cb = std::move(cb);
+        }
 
-        /* 定期器的启动时间　＋　周期*/
-        m_next = Server::GetCurrentMS() + m_ms;
+        /* 定期器的启动时间　＋　周期，用单调时钟，系统时间被调整也不影响*/
+        m_next = deadlineFrom(Server::GetCachedMS());
     }
 
-    Timer::Timer(uint64_t next) {
+    Timer::Timer(uint64_t next) : m_next(next) {
 
     }
 
-    TimerManager::TimerManager() {
-        m_preTime = GetCurrentMS();
+    static ConfigVar<bool>::ptr g_timer_wheel =
+            Config::Lookup<bool>("timer.wheel", false,
+                                 "keep timers in a hierarchical timing wheel instead of an ordered set");
+
+    TimerManager::TimerManager(size_t shards) : m_shardCount(std::max<size_t>(shards, 1)) {
+        m_shards.reset(new TimerShard[m_shardCount]);
+        uint64_t now_ms = GetCachedMS();
+        for (size_t i = 0; i < m_shardCount; i++) {
+            m_shards[i].timeouts.reset(new TimingWheel(now_ms));
+            if (g_timer_wheel->getValue()) {
+                m_shards[i].wheel.reset(new TimingWheel(now_ms));
+            }
+        }
     }
 
     TimerManager::~TimerManager() {
-
+        for (size_t i = 0; i < m_shardCount; i++) {
+            if (m_shards[i].wheel) {
+                ///释放时间轮上定时器对自己的引用
+                std::vector<TimerNode *> nodes;
+                m_shards[i].wheel->clear(nodes);
+                for (auto node: nodes) {
+                    static_cast<Timer *>(node)->m_wheelRef.reset();
+                }
+            }
+            ///超时的存储属于调用方，只是摘下
+            std::vector<TimerNode *> nodes;
+            m_shards[i].timeouts->clear(nodes);
+        }
     }
 
     bool Timer::cancel() {
-        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+        TimerManager::MutexType::Lock lock(m_manager->m_shards[m_shard].mutex);
         LOGD(LOG_ROOT()) << "Timer::cancel";
-        if (m_cb) {
+        if (m_cb || m_recurringCb) {
             m_cb = nullptr;
-            auto it = m_manager->m_timers.find(shared_from_this());
-            m_manager->m_timers.erase(shared_from_this());
+            m_recurringCb.reset();
+            m_manager->eraseTimer(shared_from_this());
             return true;
         }
         return false;
@@ -41,127 +72,219 @@ namespace Server {
 
     bool Timer::reset(uint64_t ms, bool from_now) {
         if (ms == m_ms && !from_now) return true;
-        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it == m_manager->m_timers.end()) return false;
-        m_manager->m_timers.erase(it);
+        TimerManager::MutexType::Lock lock(m_manager->m_shards[m_shard].mutex);
+        if (!m_manager->eraseTimer(shared_from_this())) return false;
         uint64_t start = 0;
-        if (from_now) start = GetCurrentMS();
+        if (from_now) start = GetCachedMS();
         else start = m_next - m_ms;
         m_ms = ms;
-        m_next = start + m_ms;
+        m_next = deadlineFrom(start);
         m_manager->addTimer(shared_from_this());
         return false;
     }
 
     bool Timer::refresh() {
-        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-        if (!m_cb) return false;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it == m_manager->m_timers.end()) return false;
-        m_manager->m_timers.erase(it);
-        m_next = Server::GetCurrentMS() + m_ms;
-        m_manager->m_timers.insert(shared_from_this());
+        TimerManager::MutexType::Lock lock(m_manager->m_shards[m_shard].mutex);
+        if (!m_cb && !m_recurringCb) return false;
+        if (!m_manager->eraseTimer(shared_from_this())) return false;
+        m_next = deadlineFrom(Server::GetCachedMS());
+        m_manager->insertTimer(shared_from_this());
         return true;
     }
 
-    Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
-        Timer::ptr timer(new Timer(ms, std::move(cb), this, recurring));
-        RWMutexType::WriteLock lock(m_mutex);
-        addTimer(timer);
-        ///虽然addTimer的作用是添加定时器，但是返回timer的目的是给调用方能够控制定时器
-        return timer;
-    }
-
-    ///　执行定时任务
-    static void onTimer(const std::weak_ptr<void> &weak_cond, const std::function<void()> &cb) {
-        std::shared_ptr<void> tmp = weak_cond.lock();
-        if (tmp) {
-            cb();
+    /**
+     * @brief 执行时间向上取整到不超过slack的2的幂
+     */
+    static uint64_t apply_slack(uint64_t next, uint64_t slack) {
+        if (slack > 1) {
+            uint64_t granularity = std::bit_floor(slack);
+            next = (next + granularity - 1) & ~(granularity - 1);
         }
+        return next;
     }
 
-    Timer::ptr
-    TimerManager::addConditionTimer(uint64_t ms, const std::function<void()> &cb, const std::weak_ptr<void> &weak_cond,
-                                    bool recurring) {
+    uint64_t Timer::deadlineFrom(uint64_t start) const {
+        return apply_slack(start + m_ms, m_slack);
+    }
 
-        return addTimer(ms, [weak_cond, cb] { return onTimer(weak_cond, cb); }, recurring);
+    Timer::ptr TimerManager::addTimer(uint64_t ms, Task cb, bool recurring, uint64_t slack) {
+        Timer::ptr timer(new Timer(ms, std::move(cb), this, recurring, slack));
+        timer->m_shard = (uint32_t) std::min(currentTimerShard(), sharedTimerShard());
+        MutexType::Lock lock(m_shards[timer->m_shard].mutex);
+        addTimer(timer);
+        ///虽然addTimer的作用是添加定时器，但是返回timer的目的是给调用方能够控制定时器
+        return timer;
     }
 
     uint64_t TimerManager::getNextTimer() {
-        RWMutexType::ReadLock lock(m_mutex);
-        m_tickled = false;
-        if (m_timers.empty()) return ~0ull;
-        auto next_timer = *m_timers.begin();
-        auto now_ms = Server::GetCurrentMS();
+        size_t own = std::min(currentTimerShard(), sharedTimerShard());
+        return std::min(getNextTimer(own), getNextTimer(sharedTimerShard()));
+    }
+
+    uint64_t TimerManager::getNextTimer(size_t shard) {
+        ///调用方要按这个结果重新计算超时了，之后插入到最前面的定时器需要再通知
+        m_shards[shard].tickled = false;
+        /// 时间轮给出的是下一次需要推进的时间，不晚于最近的定时器
+        uint64_t next = m_shards[shard].next.load(std::memory_order_seq_cst);
+        if (next == ~0ull) return ~0ull;
+        auto now_ms = Server::GetCachedMS();
         /* 现在的时间超过了定时器设定的启动时间，那就马上执行*/
-        if (now_ms >= next_timer->m_next) return 0;
+        if (now_ms >= next) return 0;
         /* 周期　＝　next_timer->m_next（定期器的启动时间　＋　周期）　　－　now_ms（定期器的启动时间）*/
         /* 这里计算出的周期，是要作为epoll_wait中的time_out参数，通过epoll_wait定时超过time_out唤醒来
          * 实现定时器的驱动
          * */
-        return next_timer->m_next - now_ms;
+        return next - now_ms;
     }
 
-    void TimerManager::listExpiredTimer(std::vector<std::function<void()>> &cbs) {
-        uint64_t now_ms = Server::GetCurrentMS();
+    void TimerManager::listExpiredTimer(std::vector<Task> &cbs) {
+        size_t own = std::min(currentTimerShard(), sharedTimerShard());
+        listExpiredTimer(cbs, own);
+        if (own != sharedTimerShard()) {
+            listExpiredTimer(cbs, sharedTimerShard());
+        }
+    }
+
+    void TimerManager::listExpiredTimer(std::vector<Task> &cbs, size_t shard_index) {
+        TimerShard &shard = m_shards[shard_index];
+        uint64_t now_ms = Server::GetCachedMS();
+        ///没有到期的定时器就不加锁
+        if (shard.next.load(std::memory_order_acquire) > now_ms) return;
         std::vector<Timer::ptr> expired;
-        {
-            RWMutexType::ReadLock lock(m_mutex);
-            if (m_timers.empty()) return;
+        MutexType::Lock lock(shard.mutex);
+        if (!shard.timeouts->empty()) {
+            ///超时的回调就在锁内执行，cancelTimeout返回之后调用方就可以释放Timeout
+            std::vector<TimerNode *> nodes;
+            shard.timeouts->advance(now_ms, nodes);
+            for (auto node: nodes) {
+                auto *timeout = static_cast<Timeout *>(node);
+                timeout->m_cb(timeout);
+            }
         }
-        RWMutexType::WriteLock lock(m_mutex);
 
-        bool rollover = detectClockRollover(now_ms);
-        if (!rollover && (m_timers.begin()->get()->m_next == now_ms)) {
+        if (shard.timers.empty() && (!shard.wheel || shard.wheel->empty())) {
+            publishNext(shard);
             return;
         }
-
-        Timer::ptr now_timer(new Timer(now_ms));
-        /// lower_bound: 从数组的ｂｅｇｉｎ位置到ｅｎｄ－１位置二分查找到第一个大于等于now_timer的ｉｔｅｒａｔｏｒ
-        auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-        while (it != m_timers.end() && (*it)->m_next == now_ms) {
-            ++it;
+        if (shard.wheel) {
+            ///整槽取出到期的定时器，摘下后接管它们对自己的引用
+            std::vector<TimerNode *> nodes;
+            shard.wheel->advance(now_ms, nodes);
+            expired.reserve(nodes.size());
+            for (auto node: nodes) {
+                expired.push_back(std::move(static_cast<Timer *>(node)->m_wheelRef));
+            }
+        } else {
+            Timer::ptr now_timer(new Timer(now_ms));
+            /// lower_bound: 从数组的ｂｅｇｉｎ位置到ｅｎｄ－１位置二分查找到第一个大于等于now_timer的ｉｔｅｒａｔｏｒ
+            auto it = shard.timers.lower_bound(now_timer);
+            while (it != shard.timers.end() && (*it)->m_next == now_ms) {
+                ++it;
+            }
+            expired.insert(expired.begin(), shard.timers.begin(), it);
+            shard.timers.erase(shard.timers.begin(), it);
         }
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
         //cbs.resize(expired.size());
 
+        cbs.reserve(cbs.size() + expired.size());
         for (auto &timer: expired) {
-            cbs.push_back(timer->m_cb);
             if (timer->m_recurring) {
-                timer->m_next = now_ms + timer->m_ms;
-                m_timers.insert(timer);
+                cbs.emplace_back([cb = timer->m_recurringCb] { (*cb)(); });
+                timer->m_next = timer->deadlineFrom(now_ms);
+                insertTimer(timer);
             } else {
-                timer->m_cb = nullptr;
+                ///一次性定时器不会再执行，直接把回调移出来
+                cbs.push_back(std::move(timer->m_cb));
             }
         }
+        publishNext(shard);
     }
 
     void TimerManager::addTimer(const Timer::ptr &timer) {
-        auto it = m_timers.insert(timer).first;
-        /*插入后就立即检查一下:如果插入的定时器排在最前面,代表它的ms(执行周期)处于最小*/
-        bool at_front = (it == m_timers.begin()) && !m_tickled;
+        TimerShard &shard = m_shards[timer->m_shard];
+        /*插入前后比较一下:如果插入的定时器排在最前面,代表它的ms(执行周期)处于最小*/
+        bool at_front = timer->m_next < shard.next.load(std::memory_order_relaxed);
+        insertTimer(timer);
         if (at_front) {
-            m_tickled = true;
+            notifyFront(timer->m_shard);
+        }
+    }
+
+    void TimerManager::notifyFront(size_t shard) {
+        if (!m_shards[shard].tickled.exchange(true)) {
             /* 新插入timer的ms(执行周期)最小,通知IOSchedule重新设置epoll_wait的超时周期*/
-            onTimerInsertedAtFront();
+            onTimerInsertedAtFront(shard);
+        }
+    }
+
+    void TimerManager::armTimeout(Timeout &timeout, uint64_t ms, uint64_t slack) {
+        timeout.m_shard = (uint32_t) std::min(currentTimerShard(), sharedTimerShard());
+        ///从调用时的真实时间算起：任务可能已经执行了一段时间，用缓存的时间会让SO_RCVTIMEO/SO_SNDTIMEO提前到期
+        timeout.expire = apply_slack(GetMonotonicMS() + ms, slack);
+        TimerShard &shard = m_shards[timeout.m_shard];
+        MutexType::Lock lock(shard.mutex);
+        bool at_front = timeout.expire < shard.next.load(std::memory_order_relaxed);
+        shard.timeouts->insert(&timeout);
+        publishNext(shard);
+        if (at_front) {
+            notifyFront(timeout.m_shard);
         }
     }
 
-    bool TimerManager::detectClockRollover(uint64_t now_ms) {
-        bool rollover = false;
-        if (now_ms < (m_preTime - 3600 * 1000)) {
-            rollover = true;
+    bool TimerManager::cancelTimeout(Timeout &timeout) {
+        TimerShard &shard = m_shards[timeout.m_shard];
+        MutexType::Lock lock(shard.mutex);
+        if (!shard.timeouts->remove(&timeout)) {
+            return false;
         }
-        m_preTime = now_ms;
-        return rollover;
+        publishNext(shard);
+        return true;
+    }
+
+    void TimerManager::insertTimer(const Timer::ptr &timer) {
+        TimerShard &shard = m_shards[timer->m_shard];
+        if (shard.wheel) {
+            timer->expire = timer->m_next;
+            shard.wheel->insert(timer.get());
+            timer->m_wheelRef = timer;
+        } else {
+            shard.timers.insert(timer);
+        }
+        publishNext(shard);
+    }
+
+    bool TimerManager::eraseTimer(const Timer::ptr &timer) {
+        TimerShard &shard = m_shards[timer->m_shard];
+        if (shard.wheel) {
+            if (!shard.wheel->remove(timer.get())) return false;
+            timer->m_wheelRef.reset();
+        } else if (shard.timers.erase(timer) == 0) {
+            return false;
+        }
+        publishNext(shard);
+        return true;
+    }
+
+    void TimerManager::publishNext(TimerShard &shard) {
+        uint64_t next;
+        if (shard.wheel) {
+            next = shard.wheel->nextExpire();
+        } else {
+            next = shard.timers.empty() ? ~0ull : (*shard.timers.begin())->m_next;
+        }
+        next = std::min(next, shard.timeouts->nextExpire());
+        ///和等待线程修改状态后的屏障配对：要么它看到新的到期时间，要么这里的通知能看到它在等待
+        shard.next.store(next, std::memory_order_seq_cst);
     }
 
     bool TimerManager::hasTimer() {
-        RWMutexType::ReadLock lock(m_mutex);
-        return !m_timers.empty();
+        for (size_t i = 0; i < m_shardCount; i++) {
+            if (m_shards[i].next.load(std::memory_order_acquire) != ~0ull) {
+                return true;
+            }
+        }
+        return false;
     }
 
 
-}
\ No newline at end of file
+}
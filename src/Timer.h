@@ -10,21 +10,25 @@
 #include "Mutex.h"
 #include "Util.h"
 #include <functional>
+#include "Task.h"
+#include "TimingWheel.h"
 #include <set>
 #include <vector>
+#include <atomic>
 
 ///enable_shared_from_this的用法：https://blog.csdn.net/breadheart/article/details/112451022
 namespace Server {
     class TimerManager;
 
     ///定时器模块
-    class Timer : public std::enable_shared_from_this<Timer> {
+    ///TimerNode是启用时间轮时挂在轮上的节点
+    class Timer : public std::enable_shared_from_this<Timer>, private TimerNode {
         friend class TimerManager;
 
     public:
         typedef std::shared_ptr<Timer> ptr;
 
-        explicit Timer(uint64_t ms, std::function<void()> cb, TimerManager *manager,bool recurring = false);
+        explicit Timer(uint64_t ms, Task cb, TimerManager *manager, bool recurring = false, uint64_t slack = 0);
 
         explicit Timer(uint64_t next);
 
@@ -40,17 +44,32 @@ namespace Server {
 
         bool reset(uint64_t ms,bool from_now);
 
+    private:
+        /**
+         * @brief 从start开始计算执行时间，允许推迟m_slack毫秒：
+         * 向上取整到不超过m_slack的2的幂，相近的定时器落在同一个时间点，一起到期
+         */
+        uint64_t deadlineFrom(uint64_t start) const;
+
     private:
         //是否循环定时器
         bool m_recurring = false;
         //执行周期　　　
         uint64_t m_ms = 0;
+        //允许推迟执行的毫秒数
+        uint64_t m_slack = 0;
         //定期器的执行时间
         uint64_t m_next = 0;
         //定时器要执行的任务
-        std::function<void()> m_cb;
+        Task m_cb;
+        //循环定时器的任务，每次到期都要执行，所以共享同一个回调
+        std::shared_ptr<Task> m_recurringCb;
 
         TimerManager* m_manager = nullptr;
+        ///所在的分片，创建后不变
+        uint32_t m_shard = 0;
+        ///挂在时间轮上时持有自己，摘下时释放
+        ptr m_wheelRef;
 
     private:
         struct Comparator {
@@ -59,57 +78,166 @@ namespace Server {
                 if (!lhs) return true;
                 if (!rhs) return false;
                 if (lhs->m_next < rhs->m_next) return true;
-                if (lhs->m_next > lhs->m_next) return false;
+                if (lhs->m_next > rhs->m_next) return false;
                 return lhs.get() < rhs.get();
             }
         };
 
     };
 
+    /**
+     * @brief 侵入式的一次性超时，存储由调用方提供(比如放在等待IO的协程栈上)，启动和取消都不分配内存
+     * 不管是否启用timer.wheel，都放在分片的时间轮上
+     */
+    class Timeout : private TimerNode {
+        friend class TimerManager;
+
+    public:
+        /// 到期时在分片的锁内调用：要很短，不能再操作定时器
+        typedef void (*Callback)(Timeout *timeout);
+
+        explicit Timeout(Callback cb) : m_cb(cb) {}
+
+        Timeout(const Timeout &) = delete;
+
+        Timeout &operator=(const Timeout &) = delete;
+
+    private:
+        Callback m_cb;
+        uint32_t m_shard = 0;
+    };
+
+    /**
+     * @brief 定时器管理
+     * 定时器按创建它的线程分片，每个分片有自己的锁和容器(set或时间轮)，最近的到期时间发布在原子变量里，
+     * 等待时不需要加锁；一般由创建线程取出到期的定时器，跨线程插入到分片最前面时才需要唤醒
+     */
     class TimerManager {
         friend class Timer;
 
     public:
-        typedef RWMutex RWMutexType;
+        typedef Mutex MutexType;
 
-        explicit TimerManager();
+        /**
+         * @param[in] shards 分片数，最后一个分片是共享的，非调度线程创建的定时器放在里面
+         */
+        explicit TimerManager(size_t shards = 1);
 
         virtual ~TimerManager();
 
         ///添加定时器任务
-        Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+        ///slack：允许推迟执行的毫秒数，大量精度要求不高的定时器(比如连接超时)设置后可以合并到同一个时间点，减少唤醒
+        Timer::ptr addTimer(uint64_t ms, Task cb, bool recurring = false, uint64_t slack = 0);
 
         ///添加条件定时器任务
         ///std::weak_ptr<void> weak_cond，通过智能指针修饰条件，借助 weak_ptr 类型指针，(不会使这个对象的引用计数＋１)
         ///我们可以获取 shared_ptr 指针的一些状态信息，比如有多少指向相同的 shared_ptr 指针
         ///如果没有指向shared_ptr的指针，代表条件结束．https://c.biancheng.net/view/7918.html
-        Timer::ptr addConditionTimer(uint64_t ms, const std::function<void()>& cb, const std::weak_ptr<void>& weak_cond, bool recurring = false);
+        ///cb和weak_cond打包在同一个lambda里，回调不大时不需要分配内存
+        template<class F>
+        Timer::ptr addConditionTimer(uint64_t ms, F cb, const std::weak_ptr<void>& weak_cond, bool recurring = false,
+                                     uint64_t slack = 0) {
+            return addTimer(ms, [weak_cond, cb = std::move(cb)]() mutable {
+                std::shared_ptr<void> tmp = weak_cond.lock();
+                if (tmp) {
+                    cb();
+                }
+            }, recurring, slack);
+        }
+
+        /**
+         * @brief 启动一次性超时，到期时在分片的锁内调用timeout的回调
+         * 和addTimer不同，超时从调用时的真实时间算起，不用任务开始时缓存的时间
+         * @param[in] slack 允许推迟执行的毫秒数，同addTimer
+         * @pre timeout没有启动；到期或者cancelTimeout返回之前timeout必须一直有效
+         */
+        void armTimeout(Timeout &timeout, uint64_t ms, uint64_t slack = 0);
+
+        /**
+         * @brief 取消超时，返回之后回调不会再执行
+         * @return false表示已经到期，回调已经执行完
+         */
+        bool cancelTimeout(Timeout &timeout);
 
-        ///获取下一个定时器执行的时间
+        ///获取下一个定时器执行的时间：当前线程的分片和共享分片中最近的一个
         uint64_t getNextTimer();
 
-        ///返回已经超时的定时器
-        void listExpiredTimer(std::vector<std::function<void()>>& cbs);
+        ///获取shard分片下一个定时器执行的时间，不加锁
+        uint64_t getNextTimer(size_t shard);
+
+        ///返回当前线程的分片和共享分片中已经超时的定时器
+        void listExpiredTimer(std::vector<Task>& cbs);
 
+        ///返回shard分片中已经超时的定时器
+        void listExpiredTimer(std::vector<Task>& cbs, size_t shard);
+
+        ///所有分片中是否还有定时器，不加锁
         bool hasTimer();
 
     private:
         /**
-         * @brief 检测服务器时间是否被调后了
+         * @brief 一个分片，独占一条cache line
+         */
+        struct alignas(64) TimerShard {
+            MutexType mutex;
+            std::set<Timer::ptr, Timer::Comparator> timers;
+            /// 启用timer.wheel时定时器放在分层时间轮上，timers不再使用
+            std::unique_ptr<TimingWheel> wheel;
+            /// 侵入式的超时
+            std::unique_ptr<TimingWheel> timeouts;
+            /// 最近的到期时间，没有定时器时为~0ull，修改后在锁内发布
+            std::atomic<uint64_t> next = {~0ull};
+            /// 已经通知过，等待线程重新计算超时之前不再通知
+            std::atomic<bool> tickled = {false};
+        };
+
+        /**
+         * @brief 把定时器放进所在分片的容器(set或时间轮)，不通知
+         * @pre 持有分片的锁
+         */
+        void insertTimer(const Timer::ptr &timer);
+
+        /**
+         * @brief 从所在分片的容器中删除定时器
+         * @pre 持有分片的锁
+         * @return false表示不在容器中
+         */
+        bool eraseTimer(const Timer::ptr &timer);
+
+        /**
+         * @brief 发布分片最近的到期时间
+         * @pre 持有分片的锁
          */
-        bool detectClockRollover(uint64_t now_ms);
+        void publishNext(TimerShard &shard);
+
+        /**
+         * @brief 插入到了分片的最前面，还没有通知过时通知等待的线程
+         */
+        void notifyFront(size_t shard);
 
     protected:
-        /// notify
-        virtual void onTimerInsertedAtFront() = 0;
+        /**
+         * @brief 定时器插入到了分片的最前面，等待这个分片的线程需要重新计算超时
+         * 分片所属的线程自己插入时，它回到idle时会重新计算，一般不需要唤醒
+         */
+        virtual void onTimerInsertedAtFront(size_t shard) = 0;
+
+        /**
+         * @brief 当前线程的分片，默认都用共享分片
+         */
+        virtual size_t currentTimerShard() { return sharedTimerShard(); }
+
+        size_t sharedTimerShard() const { return m_shardCount - 1; }
+
+        /**
+         * @brief 插入定时器，必要时通知
+         * @pre 持有分片的锁
+         */
         void addTimer(const Timer::ptr& timer);
 
     private:
-        RWMutexType m_mutex;
-        std::set<Timer::ptr, Timer::Comparator> m_timers;
-        bool m_tickled = false;
-        /// 上次执行时间
-        uint64_t m_preTime{};
+        std::unique_ptr<TimerShard[]> m_shards;
+        size_t m_shardCount;
     };
 }
 
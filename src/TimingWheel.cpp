@@ -0,0 +1,146 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "TimingWheel.h"
+#include <algorithm>
+#include <bit>
+
+namespace Server {
+
+    static constexpr uint64_t WHEEL_MASK = TimingWheel::WHEEL_SIZE - 1;
+
+    TimingWheel::TimingWheel(uint64_t now_ms) : m_current(now_ms) {
+        for (auto &level: m_slots) {
+            for (auto &head: level) {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    void TimingWheel::insert(TimerNode *node) {
+        uint64_t expire = std::max(node->expire, m_current);
+        uint64_t delta = expire - m_current;
+        if (delta >= WHEEL_RANGE) {
+            ///超出范围先放在最高层最远的槽，降级时按真实的到期时间重新插入
+            delta = WHEEL_RANGE - 1;
+            expire = m_current + delta;
+        }
+        int level = 0;
+        while (delta >> (WHEEL_BITS * (level + 1))) {
+            ++level;
+        }
+        int slot = (int) ((expire >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        TimerNode &head = m_slots[level][slot];
+        node->index = (uint16_t) (level * WHEEL_SIZE + slot);
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+        m_bitmap[level] |= 1ull << slot;
+        ++m_size;
+    }
+
+    bool TimingWheel::remove(TimerNode *node) {
+        if (!node->linked()) {
+            return false;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        int level = node->index / WHEEL_SIZE;
+        int slot = node->index % WHEEL_SIZE;
+        TimerNode &head = m_slots[level][slot];
+        if (head.next == &head) {
+            m_bitmap[level] &= ~(1ull << slot);
+        }
+        node->prev = node->next = nullptr;
+        --m_size;
+        return true;
+    }
+
+    void TimingWheel::detach(int level, int slot, TimerNode &list) {
+        TimerNode &head = m_slots[level][slot];
+        if (head.next == &head) {
+            list.prev = list.next = &list;
+            return;
+        }
+        list.next = head.next;
+        list.prev = head.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head.prev = head.next = &head;
+        m_bitmap[level] &= ~(1ull << slot);
+    }
+
+    void TimingWheel::cascade(int level, int slot) {
+        TimerNode list;
+        detach(level, slot, list);
+        for (TimerNode *node = list.next; node != &list;) {
+            TimerNode *next = node->next;
+            --m_size;
+            insert(node);
+            node = next;
+        }
+    }
+
+    void TimingWheel::advance(uint64_t now_ms, std::vector<TimerNode *> &expired) {
+        while (m_size > 0 && m_current <= now_ms) {
+            ///先降级高层，落到当前槽的节点接着在下面到期
+            for (int level = WHEEL_LEVELS - 1; level > 0; --level) {
+                int shift = WHEEL_BITS * level;
+                if ((m_current & ((1ull << shift) - 1)) == 0) {
+                    cascade(level, (int) ((m_current >> shift) & WHEEL_MASK));
+                }
+            }
+            TimerNode list;
+            detach(0, (int) (m_current & WHEEL_MASK), list);
+            for (TimerNode *node = list.next; node != &list;) {
+                TimerNode *next = node->next;
+                node->prev = node->next = nullptr;
+                --m_size;
+                expired.push_back(node);
+                node = next;
+            }
+            ++m_current;
+            ///中间没有要处理的槽，直接跳过去
+            uint64_t next = nextExpire();
+            if (next > m_current) {
+                m_current = std::min(next, now_ms + 1);
+            }
+        }
+        if (m_current <= now_ms) {
+            m_current = now_ms + 1;
+        }
+    }
+
+    uint64_t TimingWheel::nextExpire() const {
+        uint64_t next = ~0ull;
+        for (int level = 0; level < WHEEL_LEVELS; ++level) {
+            if (!m_bitmap[level]) {
+                continue;
+            }
+            ///base是起点不早于m_current的第一个本层周期，第i个非空槽在base + i周期的起点处理
+            int shift = WHEEL_BITS * level;
+            uint64_t base = (m_current + (1ull << shift) - 1) >> shift;
+            uint64_t offset = std::countr_zero(std::rotr(m_bitmap[level], (int) (base & WHEEL_MASK)));
+            next = std::min(next, (base + offset) << shift);
+        }
+        return next;
+    }
+
+    void TimingWheel::clear(std::vector<TimerNode *> &nodes) {
+        for (int level = 0; level < WHEEL_LEVELS; ++level) {
+            for (int slot = 0; slot < WHEEL_SIZE; ++slot) {
+                TimerNode list;
+                detach(level, slot, list);
+                for (TimerNode *node = list.next; node != &list;) {
+                    TimerNode *next = node->next;
+                    node->prev = node->next = nullptr;
+                    nodes.push_back(node);
+                    node = next;
+                }
+            }
+        }
+        m_size = 0;
+    }
+}
@@ -0,0 +1,110 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_TIMINGWHEEL_H
+#define SERVER_TIMINGWHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace Server {
+
+    /**
+     * @brief 时间轮上的侵入式节点，插入和删除都不分配内存
+     */
+    struct TimerNode {
+        TimerNode *prev = nullptr;
+        TimerNode *next = nullptr;
+        /// 到期时间(ms)
+        uint64_t expire = 0;
+        /// 所在的槽：level * WHEEL_SIZE + slot
+        uint16_t index = 0;
+
+        /**
+         * @brief 是否挂在时间轮上
+         */
+        bool linked() const { return next != nullptr; }
+    };
+
+    /**
+     * @brief 分层时间轮，精度1ms
+     * 第L层每个槽覆盖64^L毫秒，到期时间离当前时间越远放在越高的层，时间走到高层槽的起点时把整槽降级(cascade)
+     * 插入和删除是O(1)，到期时整槽取出；超出范围的定时器放在最高层，降级时重新计算位置
+     * 不加锁，由TimerManager保护
+     */
+    class TimingWheel {
+    public:
+        static constexpr int WHEEL_BITS = 6;
+        static constexpr int WHEEL_SIZE = 1 << WHEEL_BITS;
+        static constexpr int WHEEL_LEVELS = 4;
+        /// 能直接表示的最大时间跨度(约4.6小时)
+        static constexpr uint64_t WHEEL_RANGE = 1ull << (WHEEL_BITS * WHEEL_LEVELS);
+
+        /**
+         * @param[in] now_ms 时间轮的起始时间
+         */
+        explicit TimingWheel(uint64_t now_ms);
+
+        /**
+         * @brief 按node->expire插入，已经到期的放在下一个要处理的槽里
+         * @pre node不在时间轮上
+         */
+        void insert(TimerNode *node);
+
+        /**
+         * @brief 从时间轮上摘下节点
+         * @return false表示不在时间轮上
+         */
+        bool remove(TimerNode *node);
+
+        /**
+         * @brief 把时间推进到now_ms，取出所有到期的节点
+         * @param[out] expired 到期的节点追加在后面，按到期时间排序
+         */
+        void advance(uint64_t now_ms, std::vector<TimerNode *> &expired);
+
+        /**
+         * @brief 下一次需要处理的时间(ms)：最近的到期时间，或者更早的降级时间，没有节点时返回~0ull
+         * 返回值不会晚于任何节点的到期时间，可以直接作为等待的截止时间
+         */
+        uint64_t nextExpire() const;
+
+        /**
+         * @brief 摘下所有节点
+         */
+        void clear(std::vector<TimerNode *> &nodes);
+
+        size_t size() const { return m_size; }
+
+        bool empty() const { return m_size == 0; }
+
+    public:
+        TimingWheel(const TimingWheel &) = delete;
+
+        TimingWheel &operator=(const TimingWheel &) = delete;
+
+    private:
+        /**
+         * @brief 把整个槽取下来挂到list(哨兵)上
+         */
+        void detach(int level, int slot, TimerNode &list);
+
+        /**
+         * @brief 把高层的一个槽重新插入，节点会落到更低的层
+         */
+        void cascade(int level, int slot);
+
+    private:
+        /// 下一个要处理的时间，之前的时间都已经处理过
+        uint64_t m_current;
+        size_t m_size = 0;
+        /// 每层非空槽的位图
+        uint64_t m_bitmap[WHEEL_LEVELS] = {};
+        /// 每个槽是一个带哨兵的循环双向链表
+        TimerNode m_slots[WHEEL_LEVELS][WHEEL_SIZE];
+    };
+}
+
+#endif //SERVER_TIMINGWHEEL_H
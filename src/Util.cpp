@@ -58,4 +58,40 @@ namespace Server {
         gettimeofday(&tv, nullptr);
         return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
     }
+
+    static thread_local bool t_clock_cached = false;
+    static thread_local uint64_t t_cached_ms = 0;
+    static thread_local time_t t_cached_time = 0;
+
+    uint64_t GetMonotonicMS() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+    }
+
+    uint64_t GetMonotonicUS() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+    }
+
+    uint64_t GetCachedMS() {
+        return t_clock_cached ? t_cached_ms : GetMonotonicMS();
+    }
+
+    time_t GetCachedTime() {
+        return t_clock_cached ? t_cached_time : time(nullptr);
+    }
+
+    void UpdateCachedClock() {
+        struct timespec ts{};
+        t_cached_ms = GetMonotonicMS();
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        t_cached_time = ts.tv_sec;
+        t_clock_cached = true;
+    }
+
+    void ClearCachedClock() {
+        t_clock_cached = false;
+    }
 }
\ No newline at end of file
@@ -41,6 +41,32 @@ namespace Server {
 
     uint64_t GetCurrentUS();
 
+    /// 单调时钟，不受系统时间调整影响，定时器和计算耗时使用
+    uint64_t GetMonotonicMS();
+
+    uint64_t GetMonotonicUS();
+
+    /**
+     * @brief 本线程缓存的单调时间(ms)，调度线程每轮idle和每个任务之后刷新，没有刷新过或已经离开调度循环的线程直接读时钟
+     * 任务中添加的定时器从任务开始的时间算起，和libuv的uv_now一样
+     */
+    uint64_t GetCachedMS();
+
+    /**
+     * @brief 本线程缓存的墙上时间(s)，日志使用
+     */
+    time_t GetCachedTime();
+
+    /**
+     * @brief 刷新本线程缓存的时间，墙上时间用CLOCK_REALTIME_COARSE，秒级精度足够
+     */
+    void UpdateCachedClock();
+
+    /**
+     * @brief 不再使用本线程缓存的时间，之后直接读时钟，线程离开调度循环时调用
+     */
+    void ClearCachedClock();
+
     /// 抛出栈信息
     void Backtrace(std::vector<std::string> &bt, int size, int skip);
 
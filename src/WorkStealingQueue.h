@@ -0,0 +1,137 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#ifndef SERVER_WORKSTEALINGQUEUE_H
+#define SERVER_WORKSTEALINGQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace Server {
+
+    /**
+     * @brief Chase-Lev 工作窃取双端队列（只存放指针）
+     * 只有owner线程可以push(bottom端)，所有线程(包括owner)都从top端steal，任务按FIFO顺序执行；
+     * 不提供bottom端的LIFO pop：反复YieldToReady的协程会被owner立刻弹出，饿死队列里更早的任务
+     * 参考: Lê, Pop, Cohen, Zappa Nardelli. "Correct and Efficient Work-Stealing for Weak Memory Models"
+     */
+    template<class T>
+    class WorkStealingQueue {
+    private:
+        /**
+         * @brief 环形数组，容量必须是2的幂
+         */
+        struct Array {
+            explicit Array(int64_t cap) : capacity(cap), mask(cap - 1), buffer(new std::atomic<T *>[cap]) {}
+
+            ~Array() { delete[] buffer; }
+
+            T *get(int64_t index) const {
+                return buffer[index & mask].load(std::memory_order_relaxed);
+            }
+
+            void put(int64_t index, T *item) {
+                buffer[index & mask].store(item, std::memory_order_relaxed);
+            }
+
+            Array *grow(int64_t bottom, int64_t top) const {
+                auto *array = new Array(capacity * 2);
+                for (int64_t i = top; i != bottom; ++i) {
+                    array->put(i, get(i));
+                }
+                return array;
+            }
+
+            int64_t capacity;
+            int64_t mask;
+            std::atomic<T *> *buffer;
+        };
+
+    public:
+        explicit WorkStealingQueue(int64_t capacity = 256) : m_array(new Array(capacity)) {}
+
+        ~WorkStealingQueue() {
+            delete m_array.load(std::memory_order_relaxed);
+            reclaim();
+        }
+
+        /**
+         * @brief owner线程压入任务
+         */
+        void push(T *item) {
+            int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+            int64_t top = m_top.load(std::memory_order_acquire);
+            Array *array = m_array.load(std::memory_order_relaxed);
+            if (bottom - top > array->capacity - 1) {
+                ///　窃取线程可能还在读旧数组，旧数组等到没有窃取线程时再释放
+                m_garbage.push_back(array);
+                array = array->grow(bottom, top);
+                m_array.store(array, std::memory_order_seq_cst);
+            }
+            if (!m_garbage.empty() && m_stealers.load(std::memory_order_seq_cst) == 0) {
+                ///新数组先于这次读取发布，之后进入的窃取线程只会读到新数组
+                reclaim();
+            }
+            array->put(bottom, item);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 从top端取任务(FIFO)，任意线程都可以调用
+         */
+        T *steal() {
+            int64_t top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t bottom = m_bottom.load(std::memory_order_acquire);
+            if (top >= bottom) {
+                return nullptr;
+            }
+            ///登记为窃取线程之后再读数组，owner看到没有窃取线程时才释放旧数组
+            m_stealers.fetch_add(1, std::memory_order_seq_cst);
+            Array *array = m_array.load(std::memory_order_seq_cst);
+            T *item = array->get(top);
+            bool taken = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                       std::memory_order_relaxed);
+            m_stealers.fetch_sub(1, std::memory_order_release);
+            return taken ? item : nullptr;
+        }
+
+        bool empty() const {
+            int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+            int64_t top = m_top.load(std::memory_order_relaxed);
+            return bottom <= top;
+        }
+
+        /**
+         * @brief 扩容后还没有释放的旧数组个数，只有owner线程可以调用
+         */
+        size_t retired() const { return m_garbage.size(); }
+
+    public:
+        WorkStealingQueue(const WorkStealingQueue &) = delete;
+
+        WorkStealingQueue &operator=(const WorkStealingQueue &) = delete;
+
+    private:
+        void reclaim() {
+            for (auto array: m_garbage) {
+                delete array;
+            }
+            m_garbage.clear();
+        }
+
+    private:
+        alignas(64) std::atomic<int64_t> m_top{0};
+        alignas(64) std::atomic<int64_t> m_bottom{0};
+        alignas(64) std::atomic<Array *> m_array;
+        /// 正在读数组的窃取线程数
+        alignas(64) std::atomic<int> m_stealers{0};
+        /// 扩容后淘汰的数组(只有owner线程访问)
+        std::vector<Array *> m_garbage;
+    };
+}
+
+#endif //SERVER_WORKSTEALINGQUEUE_H
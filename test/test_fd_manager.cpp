@@ -0,0 +1,40 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "FdManager.h"
+#include "Log.h"
+#include <unistd.h>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 超出当前表大小的fd也能创建上下文，之后查询得到同一个对象，删除后查询不到
+void test_grow() {
+    int fds[2];
+    SERVER_ASSERT(pipe(fds) == 0)
+    auto *manager = Server::FdMgr::GetInstance();
+    for (int fd: {300, 1000}) {
+        SERVER_ASSERT(dup2(fds[0], fd) == fd)
+        SERVER_ASSERT(!manager->get(fd))
+        Server::FdCtx::ptr ctx = manager->get(fd, true);
+        SERVER_ASSERT(ctx)
+        SERVER_ASSERT(manager->get(fd) == ctx)
+        SERVER_ASSERT(manager->get(fd, true) == ctx)
+        manager->del(fd);
+        SERVER_ASSERT(!manager->get(fd))
+        close(fd);
+    }
+    ///表扩大之后原来的fd仍然可以查询
+    Server::FdCtx::ptr low = manager->get(fds[0], true);
+    SERVER_ASSERT(low && manager->get(fds[0]) == low)
+    manager->del(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    LOGI(g_logger) << "test_grow passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_grow();
+    return 0;
+}
@@ -0,0 +1,206 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Fiber.h"
+#include "FiberContext.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Thread.h"
+#include <atomic>
+#include <cfenv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sched.h>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <xmmintrin.h>
+#endif
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+static Server::FiberContext s_main_ctx;
+static Server::FiberContext s_fiber_ctx;
+static uint64_t s_switches = 0;
+static bool s_fiber_ok = true;
+
+/**
+ * @brief 协程入口：每次切进来检查栈对齐、浮点环境，弄乱被调用者保存的寄存器后切回去
+ */
+static void ping_pong_entry() {
+    ///协程有自己的舍入模式，切走再切回来要保持
+    fesetround(FE_UPWARD);
+    while (true) {
+        alignas(16) char aligned[16];
+        if ((uintptr_t) aligned % 16 != 0) {
+            s_fiber_ok = false;
+        }
+        ///printf系列的函数用movaps访问栈，栈没有按16字节对齐时会崩溃
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.3f", (double) s_switches / 3);
+#ifndef SERVER_FIBER_USE_UCONTEXT
+        ///fegetround只读x87控制字，SSE的舍入模式在mxcsr里
+        if (fegetround() != FE_UPWARD) {
+            s_fiber_ok = false;
+        }
+#if defined(__x86_64__)
+        if ((_mm_getcsr() & _MM_ROUND_MASK) != _MM_ROUND_UP) {
+            s_fiber_ok = false;
+        }
+#endif
+#endif
+        ++s_switches;
+#if defined(__x86_64__)
+        ///切换必须恢复主上下文的rbx、rbp、r12-r15，这里故意把它们清零
+        asm volatile("xorq %%rbx, %%rbx\n\txorq %%r12, %%r12\n\txorq %%r13, %%r13\n\t"
+                     "xorq %%r14, %%r14\n\txorq %%r15, %%r15"
+                     ::: "rbx", "r12", "r13", "r14", "r15");
+#endif
+        Server::context_swap(s_fiber_ctx, s_main_ctx);
+    }
+}
+
+/**
+ * @brief 多个值跨切换保持在被调用者保存的寄存器里
+ */
+__attribute__((noinline, optimize("O2")))
+static uint64_t ping_pong(uint64_t rounds) {
+    uint64_t a = 1, b = 2, c = 3, d = 4, e = 5, f = 6;
+    for (uint64_t i = 0; i < rounds; i++) {
+        a += i;
+        b ^= i * 3;
+        c += a ^ b;
+        d = d * 31 + i;
+        e += d >> 3;
+        f ^= c + e;
+        Server::context_swap(s_main_ctx, s_fiber_ctx);
+    }
+    return a + b * 3 + c * 5 + d * 7 + e * 11 + f * 13;
+}
+
+/// 不切换时同样的计算，作为对照
+__attribute__((noinline))
+static uint64_t ping_pong_expect(uint64_t rounds) {
+    uint64_t a = 1, b = 2, c = 3, d = 4, e = 5, f = 6;
+    for (uint64_t i = 0; i < rounds; i++) {
+        a += i;
+        b ^= i * 3;
+        c += a ^ b;
+        d = d * 31 + i;
+        e += d >> 3;
+        f ^= c + e;
+    }
+    return a + b * 3 + c * 5 + d * 7 + e * 11 + f * 13;
+}
+
+/// 直接用context_make/context_swap来回切换，寄存器、栈对齐和浮点环境都要保持
+void test_raw_switch() {
+    const size_t size = 64 * 1024;
+    void *stack = malloc(size);
+    Server::context_make(s_fiber_ctx, stack, size, &ping_pong_entry);
+    const uint64_t rounds = 100000;
+#ifndef SERVER_FIBER_USE_UCONTEXT
+    int round_mode = fegetround();
+#if defined(__x86_64__)
+    unsigned int mxcsr = _mm_getcsr();
+#endif
+#endif
+    SERVER_ASSERT(ping_pong(rounds) == ping_pong_expect(rounds))
+    SERVER_ASSERT(s_switches == rounds)
+    SERVER_ASSERT(s_fiber_ok)
+#ifndef SERVER_FIBER_USE_UCONTEXT
+    SERVER_ASSERT(fegetround() == round_mode)
+#if defined(__x86_64__)
+    SERVER_ASSERT(_mm_getcsr() == mxcsr)
+#endif
+#endif
+    free(stack);
+    LOGI(g_logger) << "test_raw_switch passed, switches=" << s_switches;
+}
+
+/// 调度器里的协程反复让出，局部变量保持，协程栈上抛出的异常在协程内被捕获
+void test_fiber_yield() {
+    const int rounds = 10000;
+    std::atomic<bool> ok = {false};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "context"));
+        scheduler->post(Server::Fiber::ptr(new Server::Fiber([&ok]() {
+            uint64_t sum = 0;
+            double product = 1.0;
+            for (int i = 0; i < rounds; i++) {
+                sum += i;
+                product *= 1.0001;
+                Server::Fiber::YieldToReady();
+            }
+            bool caught = false;
+            try {
+                throw std::runtime_error("unwind on fiber stack");
+            } catch (const std::runtime_error &) {
+                caught = true;
+            }
+            double expect = 1.0;
+            for (int i = 0; i < rounds; i++) {
+                expect *= 1.0001;
+            }
+            ok = caught && sum == (uint64_t) rounds * (rounds - 1) / 2 && product == expect;
+        })));
+        scheduler->stop();
+    }
+    SERVER_ASSERT(ok)
+    LOGI(g_logger) << "test_fiber_yield passed";
+}
+
+/**
+ * @brief 协程YieldToHold之后，另一个线程一看到HOLD就把它投递回调度器，由另一个调度线程恢复执行
+ * HOLD只能在上下文保存完之后出现，否则恢复的是没保存完的上下文，局部变量和返回地址都不对
+ */
+void test_hold_after_saved() {
+    const int rounds = 20000;
+    Server::Fiber::ptr parked;
+    std::atomic<bool> has_parked = {false};
+    std::atomic<bool> done = {false};
+    std::atomic<bool> ok = {true};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(2, false, "hold"));
+        Server::Thread::ptr waker(new Server::Thread([&]() {
+            while (!done) {
+                if (!has_parked) {
+                    sched_yield();
+                    continue;
+                }
+                while (parked->getState() != Server::Fiber::HOLD) {
+                    sched_yield();
+                }
+                Server::Fiber::ptr fiber = std::move(parked);
+                has_parked = false;
+                scheduler->post(fiber);
+            }
+        }, "hold_waker"));
+        scheduler->post(Server::Fiber::ptr(new Server::Fiber([&]() {
+            for (int i = 0; i < rounds; i++) {
+                volatile uint64_t canary = i * 0x9E3779B97F4A7C15ull;
+                parked = Server::Fiber::GetThis();
+                has_parked = true;
+                Server::Fiber::YieldToHold();
+                if (canary != i * 0x9E3779B97F4A7C15ull) {
+                    ok = false;
+                }
+            }
+            done = true;
+        })));
+        waker->join();
+        scheduler->stop();
+    }
+    SERVER_ASSERT(ok)
+    LOGI(g_logger) << "test_hold_after_saved passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_raw_switch();
+    test_fiber_yield();
+    test_hold_after_saved();
+    return 0;
+}
@@ -0,0 +1,94 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "Fiber.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Thread.h"
+#include <atomic>
+#include <memory>
+#include <set>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 最后一个引用释放后协程回到当前线程的协程池，下一次Create复用同一个对象；入池时释放回调捕获的对象
+void test_reuse() {
+    Server::Thread::ptr thread(new Server::Thread([]() {
+        auto captured = std::make_shared<int>(0);
+        Server::Fiber::ptr fiber = Server::Fiber::Create([captured]() {});
+        Server::Fiber *raw = fiber.get();
+        SERVER_ASSERT(captured.use_count() == 2)
+        fiber.reset();
+        SERVER_ASSERT(captured.use_count() == 1)
+        fiber = Server::Fiber::Create([]() {});
+        SERVER_ASSERT(fiber.get() == raw)
+        SERVER_ASSERT(fiber->getState() == Server::Fiber::INIT)
+
+        ///直接new的协程不入池
+        uint64_t total = Server::Fiber::TotalFibers();
+        Server::Fiber::ptr plain(new Server::Fiber([]() {}));
+        plain.reset();
+        SERVER_ASSERT(Server::Fiber::TotalFibers() == total)
+    }, "fiber_reuse"));
+    thread->join();
+    LOGI(g_logger) << "test_reuse passed";
+}
+
+/// 协程池最多缓存fiber.pool.local_max个协程，线程退出时删除池里的协程
+void test_local_max() {
+    const uint32_t local_max = 4;
+    Server::Config::Lookup<uint32_t>("fiber.pool.local_max")->setValue(local_max);
+    uint64_t before = Server::Fiber::TotalFibers();
+    Server::Thread::ptr thread(new Server::Thread([before, local_max]() {
+        std::vector<Server::Fiber::ptr> fibers;
+        for (int i = 0; i < 10; i++) {
+            fibers.push_back(Server::Fiber::Create([]() {}));
+        }
+        fibers.clear();
+        SERVER_ASSERT(Server::Fiber::TotalFibers() == before + local_max)
+    }, "fiber_local_max"));
+    thread->join();
+    SERVER_ASSERT(Server::Fiber::TotalFibers() == before)
+    Server::Config::Lookup<uint32_t>("fiber.pool.local_max")->setValue(16);
+    LOGI(g_logger) << "test_local_max passed";
+}
+
+/// 调度器执行完的协程回到工作线程的协程池，之后在同一线程Create的协程复用它们并执行新的回调
+void test_run_reused() {
+    const int rounds = 1000;
+    std::atomic<int> executed = {0};
+    std::set<Server::Fiber *> objects;
+    std::set<uint64_t> ids;
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "fiber_pool"));
+        scheduler->post([&]() {
+            for (int i = 0; i < rounds; i++) {
+                Server::Fiber::ptr fiber = Server::Fiber::Create([&executed, &ids]() {
+                    ids.insert(Server::Fiber::GetFiberId());
+                    ++executed;
+                });
+                objects.insert(fiber.get());
+                scheduler->post(std::move(fiber));
+                ///单线程调度，让出之后上面的协程执行完并回到协程池
+                Server::Fiber::YieldToReady();
+            }
+        });
+        scheduler->stop();
+    }
+    SERVER_ASSERT(executed == rounds)
+    ///复用的协程换了id
+    SERVER_ASSERT(ids.size() == (size_t) rounds)
+    SERVER_ASSERT(objects.size() <= 2)
+    LOGI(g_logger) << "test_run_reused passed, objects=" << objects.size();
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_reuse();
+    test_local_max();
+    test_run_reused();
+    return 0;
+}
@@ -0,0 +1,162 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "Fiber.h"
+#include "FiberStack.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Thread.h"
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <set>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 线程缓存后进先出，同一档位释放的栈马上被下一次分配复用；不在档位上的大小不缓存
+void test_local_reuse() {
+    const size_t size = Server::StackPool::DefaultSize();
+    for (size_t class_size: {size, size >> 1, size >> 2}) {
+        void *first = Server::StackPool::Alloc(class_size);
+        Server::StackPool::Dealloc(first, class_size);
+        void *second = Server::StackPool::Alloc(class_size);
+        SERVER_ASSERT(first == second)
+        Server::StackPool::Dealloc(second, class_size);
+    }
+    size_t global = Server::StackPool::GlobalCached();
+    const size_t odd_size = size - 4096;
+    std::vector<void *> stacks;
+    for (int i = 0; i < 64; i++) {
+        stacks.push_back(Server::StackPool::Alloc(odd_size));
+    }
+    for (auto vp: stacks) {
+        Server::StackPool::Dealloc(vp, odd_size);
+    }
+    SERVER_ASSERT(Server::StackPool::GlobalCached() == global)
+    LOGI(g_logger) << "test_local_reuse passed";
+}
+
+/// 线程缓存超出local_max时一半还给全局链表，别的线程从全局链表取回；线程退出时缓存也还给全局链表
+void test_global_overflow() {
+    const size_t size = Server::StackPool::DefaultSize();
+    const uint32_t local_max = 4;
+    Server::Config::Lookup<uint32_t>("fiber.stack_pool.local_max")->setValue(local_max);
+    std::set<void *> freed;
+    size_t before = Server::StackPool::GlobalCached();
+    Server::Thread::ptr producer(new Server::Thread([&]() {
+        std::vector<void *> stacks;
+        for (int i = 0; i < 10; i++) {
+            stacks.push_back(Server::StackPool::Alloc(size));
+        }
+        for (auto vp: stacks) {
+            freed.insert(vp);
+            Server::StackPool::Dealloc(vp, size);
+        }
+        ///线程缓存最多保留local_max个，其他的已经在全局链表里
+        SERVER_ASSERT(Server::StackPool::GlobalCached() >= before + 10 - local_max)
+    }, "stack_producer"));
+    producer->join();
+    ///线程退出后剩下的也还给了全局链表
+    SERVER_ASSERT(Server::StackPool::GlobalCached() == before + 10)
+
+    Server::Thread::ptr consumer(new Server::Thread([&]() {
+        void *vp = Server::StackPool::Alloc(size);
+        SERVER_ASSERT(freed.count(vp))
+        ///一次取回local_max / 2个
+        SERVER_ASSERT(Server::StackPool::GlobalCached() == before + 10 - local_max / 2)
+        Server::StackPool::Dealloc(vp, size);
+    }, "stack_consumer"));
+    consumer->join();
+    Server::Config::Lookup<uint32_t>("fiber.stack_pool.local_max")->setValue(16);
+    LOGI(g_logger) << "test_global_overflow passed";
+}
+
+/// 栈底下面是保护页：栈内可以写，越过栈底一个字节就SIGSEGV
+void test_guard_page() {
+    SERVER_ASSERT(Server::StackPool::HasGuardPage())
+    const size_t size = Server::StackPool::DefaultSize();
+    void *vp = Server::StackPool::Alloc(size);
+    pid_t pid = fork();
+    SERVER_ASSERT(pid >= 0)
+    if (pid == 0) {
+        auto *bottom = (volatile char *) vp;
+        bottom[0] = 1;
+        bottom[-1] = 1;
+        _exit(0);
+    }
+    int status = 0;
+    SERVER_ASSERT(waitpid(pid, &status, 0) == pid)
+    SERVER_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV)
+    Server::StackPool::Dealloc(vp, size);
+    LOGI(g_logger) << "test_guard_page passed";
+}
+
+/// fiber.stack_release=dontneed时放回池里的栈归还物理页(再访问读到0)，只保留栈顶一页
+void test_stack_release() {
+    const size_t size = Server::StackPool::DefaultSize();
+    const size_t page = sysconf(_SC_PAGESIZE);
+    Server::Config::Lookup<std::string>("fiber.stack_release")->setValue("dontneed");
+    void *vp = Server::StackPool::Alloc(size);
+    memset(vp, 0xAB, size);
+    Server::StackPool::Dealloc(vp, size);
+    void *again = Server::StackPool::Alloc(size);
+    SERVER_ASSERT(again == vp)
+    auto *stack = (unsigned char *) again;
+    SERVER_ASSERT(stack[0] == 0 && stack[size - page - 1] == 0)
+    SERVER_ASSERT(stack[size - 1] == 0xAB)
+    Server::StackPool::Dealloc(again, size);
+    Server::Config::Lookup<std::string>("fiber.stack_release")->setValue("none");
+    LOGI(g_logger) << "test_stack_release passed";
+}
+
+static void site_a() {
+}
+
+static void site_b() {
+}
+
+/// 开启采样后只统计知道创建点的协程
+void test_profile_skips_unknown_site() {
+    auto sites = []() {
+        std::stringstream ss;
+        Server::StackProfiler::Dump(ss);
+        return std::count(std::istreambuf_iterator<char>(ss), {}, '\n') - 1;
+    };
+    Server::Config::Lookup<bool>("fiber.stack_profile.enable")->setValue(true);
+    Server::Config::Lookup<uint32_t>("fiber.stack_profile.sample_rate")->setValue(1);
+    long before = sites();
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "profile"));
+        scheduler->post(Server::Fiber::ptr(new Server::Fiber(&site_a)));
+        scheduler->post(Server::Fiber::ptr(new Server::Fiber(std::function<void()>(&site_b))));
+        scheduler->stop();
+    }
+    std::stringstream ss;
+    Server::StackProfiler::Dump(ss);
+    std::stringstream address;
+    address << "site=" << reinterpret_cast<const void *>(&site_a) << " ";
+    SERVER_ASSERT(ss.str().find(address.str()) != std::string::npos)
+    SERVER_ASSERT(sites() == before + 1)
+    Server::Config::Lookup<bool>("fiber.stack_profile.enable")->setValue(false);
+    Server::Config::Lookup<uint32_t>("fiber.stack_profile.sample_rate")->setValue(16);
+    LOGI(g_logger) << "test_profile_skips_unknown_site passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    ///分配方式在第一次分配栈时确定，保护页和归还物理页只有mmap的栈才有
+    Server::Config::Lookup<std::string>("fiber.stack_allocator")->setValue("mmap");
+    test_local_reuse();
+    test_global_overflow();
+    test_guard_page();
+    test_stack_release();
+    test_profile_skips_unknown_site();
+    return 0;
+}
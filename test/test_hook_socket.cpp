@@ -0,0 +1,204 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "FdManager.h"
+#include "Hook.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/**
+ * @brief 在127.0.0.1的随机端口上监听
+ * @param[out] addr 监听的地址
+ */
+static int listen_loopback(sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    SERVER_ASSERT(fd >= 0)
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    SERVER_ASSERT(bind(fd, (const sockaddr *) &addr, sizeof(addr)) == 0)
+    socklen_t len = sizeof(addr);
+    SERVER_ASSERT(getsockname(fd, (sockaddr *) &addr, &len) == 0)
+    SERVER_ASSERT(listen(fd, 16) == 0)
+    return fd;
+}
+
+/**
+ * @brief 通过hook的connect/accept建立一条回环连接，connect等待的是WRITE事件
+ */
+static void connected_pair(int &client, int &server) {
+    sockaddr_in addr{};
+    int listen_fd = listen_loopback(addr);
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    SERVER_ASSERT(connect(client, (const sockaddr *) &addr, sizeof(addr)) == 0)
+    server = accept(listen_fd, nullptr, nullptr);
+    SERVER_ASSERT(server >= 0)
+    close(listen_fd);
+}
+
+static void set_timeout(int fd, int type, int ms) {
+    timeval tv{ms / 1000, ms % 1000 * 1000};
+    SERVER_ASSERT(setsockopt(fd, SOL_SOCKET, type, &tv, sizeof(tv)) == 0)
+}
+
+/// hook的socket创建FdCtx，识别为socket并在内核中设为非阻塞，对用户仍表现为阻塞
+void test_socket_init() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    auto ctx = Server::FdMgr::GetInstance()->get(fd);
+    SERVER_ASSERT(ctx)
+    SERVER_ASSERT(ctx->isSocket())
+    SERVER_ASSERT(ctx->getSysNonblock())
+    SERVER_ASSERT(!ctx->getUserNonblock())
+    SERVER_ASSERT(fcntl_f(fd, F_GETFL) & O_NONBLOCK)
+    SERVER_ASSERT(!(fcntl(fd, F_GETFL) & O_NONBLOCK))
+    ///close走hook，删除FdCtx
+    SERVER_ASSERT(close(fd) == 0)
+    SERVER_ASSERT(!Server::FdMgr::GetInstance()->get(fd))
+    LOGI(g_logger) << "test_socket_init passed";
+}
+
+/// 阻塞socket的connect等待连接完成，连接被拒绝时返回真实的错误而不是EBADF
+void test_connect() {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    close(client);
+    close(server);
+
+    sockaddr_in addr{};
+    int listen_fd = listen_loopback(addr);
+    close(listen_fd);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    SERVER_ASSERT(connect(fd, (const sockaddr *) &addr, sizeof(addr)) == -1)
+    SERVER_ASSERT(errno == ECONNREFUSED)
+    close(fd);
+    LOGI(g_logger) << "test_connect passed";
+}
+
+/// 发送缓冲区写满后协程等待WRITE(EPOLLOUT)，对端读走数据后被唤醒继续写
+void test_write_wait(const Server::IOSchedule::ptr &scheduler, std::atomic<int> &finished) {
+    static const size_t total = 8 * 1024 * 1024;
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    set_timeout(client, SO_SNDTIMEO, 5000);
+    set_timeout(server, SO_RCVTIMEO, 5000);
+    scheduler->post([client, &finished]() {
+        std::string buffer(64 * 1024, 'x');
+        size_t sent = 0;
+        while (sent < total) {
+            ssize_t n = write(client, &buffer[0], std::min(buffer.size(), total - sent));
+            SERVER_ASSERT(n > 0)
+            sent += n;
+        }
+        close(client);
+        ++finished;
+    });
+    scheduler->post([server, &finished]() {
+        std::string buffer(64 * 1024, 0);
+        size_t received = 0;
+        ssize_t n;
+        while ((n = read(server, &buffer[0], buffer.size())) > 0) {
+            received += n;
+        }
+        SERVER_ASSERT(n == 0)
+        SERVER_ASSERT(received == total)
+        close(server);
+        ++finished;
+        LOGI(g_logger) << "test_write_wait passed";
+    });
+}
+
+/// 关闭正在被等待读的socket，等待的协程被唤醒并返回错误
+void test_close_wakes_waiter(const Server::IOSchedule::ptr &scheduler, std::atomic<int> &finished) {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    scheduler->post([server, &finished]() {
+        char c;
+        SERVER_ASSERT(recv(server, &c, 1, 0) == -1)
+        ++finished;
+    });
+    ///单线程调度，上面的协程挂起等待之后才执行这里
+    scheduler->post([client, server, &finished]() {
+        SERVER_ASSERT(close(server) == 0)
+        SERVER_ASSERT(!Server::FdMgr::GetInstance()->get(server))
+        close(client);
+        ++finished;
+        LOGI(g_logger) << "test_close_wakes_waiter passed";
+    });
+}
+
+/// 持久注册模式下MSG_PEEK读不满不能把fd记成没有就绪，否则接着的recv会跳过系统调用一直等到超时
+void test_peek_keeps_ready() {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    set_timeout(server, SO_RCVTIMEO, 1000);
+    SERVER_ASSERT(send(client, "x", 1, 0) == 1)
+    char buffer[16];
+    SERVER_ASSERT(recv(server, buffer, sizeof(buffer), MSG_PEEK) == 1)
+    sockaddr_in from{};
+    socklen_t len = sizeof(from);
+    SERVER_ASSERT(recvfrom(server, buffer, sizeof(buffer), MSG_PEEK, (sockaddr *) &from, &len) == 1)
+    SERVER_ASSERT(recv(server, buffer, sizeof(buffer), 0) == 1)
+    SERVER_ASSERT(buffer[0] == 'x')
+    close(client);
+    close(server);
+    LOGI(g_logger) << "test_peek_keeps_ready passed";
+}
+
+/// use_caller的线程跑完调度循环后hook关闭，之后的close等直接走系统调用
+void test_hook_disabled_after_run() {
+    SERVER_ASSERT(!Server::is_hook_enable())
+    bool enabled_inside = false;
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, true, "hook_caller"));
+        scheduler->post([&]() { enabled_inside = Server::is_hook_enable(); });
+        scheduler->stop();
+    }
+    SERVER_ASSERT(enabled_inside)
+    SERVER_ASSERT(!Server::is_hook_enable())
+    LOGI(g_logger) << "test_hook_disabled_after_run passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    std::atomic<int> finished = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "hook_socket"));
+        scheduler->post([&]() {
+            test_socket_init();
+            test_connect();
+            test_write_wait(scheduler, finished);
+            test_close_wakes_waiter(scheduler, finished);
+        });
+        scheduler->stop();
+    }
+    Server::Config::Lookup<bool>("io.epoll.persistent")->setValue(true);
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "hook_persistent"));
+        SERVER_ASSERT(scheduler->isPersistent())
+        scheduler->post([&]() {
+            test_peek_keeps_ready();
+            ++finished;
+        });
+        scheduler->stop();
+    }
+    Server::Config::Lookup<bool>("io.epoll.persistent")->setValue(false);
+    SERVER_ASSERT(finished == 5)
+    test_hook_disabled_after_run();
+    return 0;
+}
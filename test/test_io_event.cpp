@@ -0,0 +1,246 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "IOSchedule.h"
+#include "Log.h"
+#include <atomic>
+#include <climits>
+#include <functional>
+#include <malloc.h>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 在调度线程里执行fn并等它返回，addEvent要在调度器的协程里调用
+template<class Fn>
+static void run_in(const Server::IOSchedule::ptr &scheduler, Fn fn) {
+    std::atomic<bool> done = {false};
+    scheduler->post([&]() {
+        fn();
+        done = true;
+    });
+    while (!done) {
+        usleep(1000);
+    }
+}
+
+/// 事件触发后上下文被清空，回调里可以在同一个fd上再次注册；触发后不再持有回调捕获的对象
+void test_readd_after_trigger() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "readd"));
+    int fds[2];
+    SERVER_ASSERT(pipe(fds) == 0)
+    const int rounds = 3;
+    auto token = std::make_shared<int>(0);
+    std::atomic<int> fired = {0};
+    std::function<void()> wait = [&]() {
+        scheduler->addEvent(fds[0], Server::IOSchedule::READ, [&, token]() {
+            char c;
+            SERVER_ASSERT(read(fds[0], &c, 1) == 1)
+            if (++fired < rounds) {
+                wait();
+            }
+        });
+    };
+    run_in(scheduler, wait);
+    for (int i = 0; i < rounds; i++) {
+        SERVER_ASSERT(write(fds[1], "x", 1) == 1)
+        while (fired < i + 1) {
+            usleep(1000);
+        }
+    }
+    scheduler->stop();
+    SERVER_ASSERT(token.use_count() == 1)
+    close(fds[0]);
+    close(fds[1]);
+    LOGI(g_logger) << "test_readd_after_trigger passed";
+}
+
+/// 当前已经分配的堆内存
+static size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/// 当前的分配器是否在mallinfo2里统计(sanitizer换掉了malloc时不统计)
+static bool heap_observable() {
+    size_t before = heap_in_use();
+    void *volatile block = malloc(16 * 1024);
+    bool observed = heap_in_use() - before >= 16 * 1024;
+    free(block);
+    return observed;
+}
+
+/// FdContext和它所在的页第一次注册事件时才分配，同一页里的其他fd不再分配页
+void test_lazy_pages() {
+    if (!heap_observable()) {
+        LOGI(g_logger) << "test_lazy_pages skipped, heap usage not observable";
+        return;
+    }
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "lazy_pages"));
+    int fds[2];
+    SERVER_ASSERT(pipe(fds) == 0)
+    ///还没有用过的页里的两个相邻fd
+    const int first = 3072;
+    SERVER_ASSERT(dup2(fds[0], first) == first && dup2(fds[0], first + 1) == first + 1)
+    size_t page_grow = 0;
+    size_t slot_grow = 0;
+    run_in(scheduler, [&]() {
+        ///没有上下文的fd不会因为查询而分配
+        size_t before = heap_in_use();
+        SERVER_ASSERT(!scheduler->cancelEvent(first, Server::IOSchedule::READ))
+        SERVER_ASSERT(!scheduler->removeEvent(first, Server::IOSchedule::READ))
+        SERVER_ASSERT(!scheduler->cancelAllEvent(first))
+        SERVER_ASSERT(heap_in_use() == before)
+
+        before = heap_in_use();
+        SERVER_ASSERT(scheduler->addEvent(first, Server::IOSchedule::READ, []() {}) == 0)
+        page_grow = heap_in_use() - before;
+        ///页已经存在，查询同一页里的其他fd也不分配FdContext
+        before = heap_in_use();
+        SERVER_ASSERT(!scheduler->cancelEvent(first + 1, Server::IOSchedule::READ))
+        SERVER_ASSERT(heap_in_use() == before)
+        before = heap_in_use();
+        SERVER_ASSERT(scheduler->addEvent(first + 1, Server::IOSchedule::READ, []() {}) == 0)
+        slot_grow = heap_in_use() - before;
+        scheduler->removeEvent(first, Server::IOSchedule::READ);
+        scheduler->removeEvent(first + 1, Server::IOSchedule::READ);
+    });
+    scheduler->stop();
+    ///一页是1024个指针
+    SERVER_ASSERT(page_grow >= 1024 * sizeof(void *))
+    SERVER_ASSERT(slot_grow < 1024)
+    close(first);
+    close(first + 1);
+    close(fds[0]);
+    close(fds[1]);
+    LOGI(g_logger) << "test_lazy_pages passed, page=" << page_grow << " slot=" << slot_grow;
+}
+
+/// 页边界两侧的fd各自有独立的上下文，事件回调到正确的fd上
+void test_page_boundaries() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "page_boundaries"));
+    const std::vector<int> targets = {510, 511, 1022, 1023, 1024, 1025, 2047, 2048};
+    std::vector<int> writers;
+    for (int target: targets) {
+        int fds[2];
+        SERVER_ASSERT(pipe(fds) == 0)
+        SERVER_ASSERT(dup2(fds[0], target) == target)
+        close(fds[0]);
+        writers.push_back(fds[1]);
+    }
+    std::vector<std::atomic<int>> fired(targets.size());
+    run_in(scheduler, [&]() {
+        for (size_t i = 0; i < targets.size(); i++) {
+            int fd = targets[i];
+            SERVER_ASSERT(scheduler->addEvent(fd, Server::IOSchedule::READ, [fd, i, &fired]() {
+                char c;
+                SERVER_ASSERT(read(fd, &c, 1) == 1)
+                SERVER_ASSERT(c == (char) ('a' + i))
+                ++fired[i];
+            }) == 0)
+        }
+    });
+    ///倒序触发，每次只有对应的一个回调执行
+    for (size_t i = targets.size(); i-- > 0;) {
+        char c = (char) ('a' + i);
+        SERVER_ASSERT(write(writers[i], &c, 1) == 1)
+        while (fired[i] == 0) {
+            usleep(1000);
+        }
+        for (size_t j = 0; j < targets.size(); j++) {
+            SERVER_ASSERT(fired[j] == (j >= i ? 1 : 0))
+        }
+    }
+    scheduler->stop();
+    for (size_t i = 0; i < targets.size(); i++) {
+        close(targets[i]);
+        close(writers[i]);
+    }
+    LOGI(g_logger) << "test_page_boundaries passed";
+}
+
+/// 超出两级表范围的fd注册失败，其他操作返回false
+void test_out_of_range() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "out_of_range"));
+    run_in(scheduler, [&]() {
+        for (int fd: {-1, INT_MAX, 1 << 30}) {
+            SERVER_ASSERT(scheduler->addEvent(fd, Server::IOSchedule::READ, []() {}) == -1)
+            SERVER_ASSERT(!scheduler->removeEvent(fd, Server::IOSchedule::READ))
+            SERVER_ASSERT(!scheduler->cancelEvent(fd, Server::IOSchedule::READ))
+            SERVER_ASSERT(!scheduler->cancelAllEvent(fd))
+            SERVER_ASSERT(!scheduler->isKnownNotReady(fd, Server::IOSchedule::READ))
+        }
+    });
+    scheduler->stop();
+    LOGI(g_logger) << "test_out_of_range passed";
+}
+
+/**
+ * @brief 注册回调时在堆上分配的Callback在触发、取消、删除事件时都被释放，回调捕获的对象随之析构
+ */
+void test_callback_ownership() {
+    auto token = std::make_shared<int>(0);
+    std::atomic<int> ran = {0};
+    int fds[2];
+    SERVER_ASSERT(pipe(fds) == 0)
+    auto wait_released = [&token]() {
+        ///回调执行完后协程回收时才释放
+        for (int i = 0; i < 1000 && token.use_count() != 1; i++) {
+            usleep(1000);
+        }
+        return token.use_count() == 1;
+    };
+    auto add = [&](Server::IOSchedule *scheduler) {
+        SERVER_ASSERT(scheduler->addEvent(fds[0], Server::IOSchedule::READ, [token, &ran]() { ++ran; }) == 0)
+    };
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "callback"));
+        ///删除事件：不执行直接释放
+        run_in(scheduler, [&]() {
+            add(scheduler.get());
+            SERVER_ASSERT(token.use_count() == 2)
+            SERVER_ASSERT(scheduler->removeEvent(fds[0], Server::IOSchedule::READ))
+            SERVER_ASSERT(token.use_count() == 1)
+        });
+        SERVER_ASSERT(ran == 0)
+
+        ///取消事件：执行一次后释放
+        run_in(scheduler, [&]() {
+            add(scheduler.get());
+            SERVER_ASSERT(scheduler->cancelEvent(fds[0], Server::IOSchedule::READ))
+        });
+        SERVER_ASSERT(wait_released() && ran == 1)
+
+        ///事件触发：执行一次后释放
+        run_in(scheduler, [&]() { add(scheduler.get()); });
+        SERVER_ASSERT(token.use_count() == 2)
+        SERVER_ASSERT(write(fds[1], "x", 1) == 1)
+        SERVER_ASSERT(wait_released() && ran == 2)
+        char c;
+        SERVER_ASSERT(read(fds[0], &c, 1) == 1)
+
+        ///关闭fd前取消所有事件：执行一次后释放
+        run_in(scheduler, [&]() {
+            add(scheduler.get());
+            SERVER_ASSERT(scheduler->cancelAllEvent(fds[0]))
+        });
+        SERVER_ASSERT(wait_released() && ran == 3)
+        scheduler->stop();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    LOGI(g_logger) << "test_callback_ownership passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_readd_after_trigger();
+    test_lazy_pages();
+    test_page_boundaries();
+    test_out_of_range();
+    test_callback_ownership();
+    return 0;
+}
@@ -0,0 +1,211 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "Hook.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Util.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 内核是否允许创建io_uring，不支持时跳过测试
+static bool uring_supported() {
+    io_uring_params params{};
+    int fd = (int) syscall(__NR_io_uring_setup, 4, &params);
+    if (fd < 0) {
+        LOGI(g_logger) << "io_uring_setup failed errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    close_f(fd);
+    return true;
+}
+
+/**
+ * @brief 进程里io_uring已经提交的sqe总数(fdinfo中的SqTail)，内核不提供时返回-1
+ */
+static long uring_submitted() {
+    DIR *dir = opendir("/proc/self/fd");
+    long total = -1;
+    while (dirent *entry = readdir(dir)) {
+        std::string path = std::string("/proc/self/fd/") + entry->d_name;
+        char target[64] = {};
+        if (readlink(path.c_str(), target, sizeof(target) - 1) <= 0 || strcmp(target, "anon_inode:[io_uring]") != 0) {
+            continue;
+        }
+        std::ifstream info(std::string("/proc/self/fdinfo/") + entry->d_name);
+        std::string key;
+        while (info >> key) {
+            if (key == "SqTail:") {
+                long tail = 0;
+                info >> tail;
+                total = (total < 0 ? 0 : total) + tail;
+            }
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+/// 检查这段时间里提交的sqe数，内核不提供fdinfo时不检查
+static void expect_submitted(long before, long count) {
+    long after = uring_submitted();
+    if (before >= 0 && after >= 0) {
+        SERVER_ASSERT(after - before == count)
+    }
+}
+
+static sockaddr_in loopback(int fd) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    SERVER_ASSERT(bind(fd, (const sockaddr *) &addr, sizeof(addr)) == 0)
+    socklen_t len = sizeof(addr);
+    SERVER_ASSERT(getsockname(fd, (sockaddr *) &addr, &len) == 0)
+    return addr;
+}
+
+/// 通过hook的socket/connect/accept建立一条回环TCP连接
+static void connected_pair(int &client, int &server) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = loopback(listen_fd);
+    SERVER_ASSERT(listen(listen_fd, 4) == 0)
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    SERVER_ASSERT(connect(client, (const sockaddr *) &addr, sizeof(addr)) == 0)
+    server = accept(listen_fd, nullptr, nullptr);
+    SERVER_ASSERT(server >= 0)
+    close(listen_fd);
+}
+
+/// 读在io_uring上等待数据，写由io_uring完成；各提交一个sqe，没有走epoll
+void test_read_write(Server::IOSchedule *scheduler, std::atomic<int> &finished) {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    long before = uring_submitted();
+    scheduler->post([=, &finished]() {
+        char buffer[16] = {};
+        SERVER_ASSERT(read(server, buffer, sizeof(buffer)) == 5)
+        SERVER_ASSERT(memcmp(buffer, "hello", 5) == 0)
+        expect_submitted(before, 2);
+        close(client);
+        close(server);
+        ++finished;
+        LOGI(g_logger) << "test_read_write passed";
+    });
+    ///单线程调度，上面的协程挂起等待之后才执行这里
+    scheduler->post([=]() {
+        SERVER_ASSERT(write(client, "hello", 5) == 5)
+    });
+}
+
+/// recvfrom/sendto用RECVMSG/SENDMSG实现，对端地址要带回来
+void test_recvfrom_sendto(Server::IOSchedule *scheduler, std::atomic<int> &finished) {
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in to = loopback(receiver);
+    sockaddr_in sender_addr = loopback(sender);
+    long before = uring_submitted();
+    scheduler->post([=, &finished]() {
+        char buffer[16] = {};
+        ///缓冲区比实际地址大，返回时addrlen要改成实际长度
+        sockaddr_storage storage{};
+        socklen_t len = sizeof(storage);
+        SERVER_ASSERT(recvfrom(receiver, buffer, sizeof(buffer), 0, (sockaddr *) &storage, &len) == 4)
+        SERVER_ASSERT(memcmp(buffer, "ping", 4) == 0)
+        SERVER_ASSERT(len == sizeof(sockaddr_in))
+        auto *from = (const sockaddr_in *) &storage;
+        SERVER_ASSERT(from->sin_port == sender_addr.sin_port)
+        SERVER_ASSERT(from->sin_addr.s_addr == sender_addr.sin_addr.s_addr)
+        expect_submitted(before, 2);
+        close(receiver);
+        close(sender);
+        ++finished;
+        LOGI(g_logger) << "test_recvfrom_sendto passed";
+    });
+    scheduler->post([=]() {
+        SERVER_ASSERT(sendto(sender, "ping", 4, 0, (const sockaddr *) &to, sizeof(to)) == 4)
+    });
+}
+
+/// 设置了接收超时的读，链接一个LINK_TIMEOUT，到期时请求被取消，返回ETIMEDOUT
+void test_timeout(Server::IOSchedule *, std::atomic<int> &finished) {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    timeval tv{0, 50 * 1000};
+    SERVER_ASSERT(setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0)
+    long before = uring_submitted();
+    uint64_t start = Server::GetMonotonicMS();
+    char c;
+    SERVER_ASSERT(read(server, &c, 1) == -1)
+    SERVER_ASSERT(errno == ETIMEDOUT)
+    SERVER_ASSERT(Server::GetMonotonicMS() - start >= 50)
+    expect_submitted(before, 2);
+    ///超时之后连接仍然可用
+    SERVER_ASSERT(write(client, "x", 1) == 1)
+    SERVER_ASSERT(read(server, &c, 1) == 1 && c == 'x')
+    close(client);
+    close(server);
+    ++finished;
+    LOGI(g_logger) << "test_timeout passed";
+}
+
+/// 关闭正在io_uring上等待读的fd，close先提交ASYNC_CANCEL，等待的协程拿到ECANCELED
+void test_close_cancels(Server::IOSchedule *scheduler, std::atomic<int> &finished) {
+    int client = -1;
+    int server = -1;
+    connected_pair(client, server);
+    scheduler->post([server, &finished]() {
+        char c;
+        SERVER_ASSERT(read(server, &c, 1) == -1)
+        SERVER_ASSERT(errno == ECANCELED)
+        ++finished;
+        LOGI(g_logger) << "test_close_cancels passed";
+    });
+    scheduler->post([client, server]() {
+        long before = uring_submitted();
+        SERVER_ASSERT(close(server) == 0)
+        expect_submitted(before, 1);
+        close(client);
+    });
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    if (!uring_supported()) {
+        LOGI(g_logger) << "io_uring not supported, skipped";
+        return 0;
+    }
+    Server::Config::Lookup<bool>("io.uring.enable")->setValue(true);
+    std::atomic<int> finished = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "uring"));
+        SERVER_ASSERT(scheduler->hasUring())
+        ///一次只跑一个用例，提交的sqe数才只属于这个用例
+        int expected = 0;
+        for (auto test: {test_read_write, test_recvfrom_sendto, test_timeout, test_close_cancels}) {
+            scheduler->post([test, &scheduler, &finished]() { test(scheduler.get(), finished); });
+            ++expected;
+            while (finished < expected) {
+                usleep(1000);
+            }
+        }
+        scheduler->stop();
+    }
+    Server::Config::Lookup<bool>("io.uring.enable")->setValue(false);
+    return 0;
+}
@@ -0,0 +1,436 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "Fiber.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Util.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <sched.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/**
+ * @brief 让每个调度线程各执行一个任务，拿到所有调度线程的id，返回时它们都回到了idle
+ */
+static std::vector<int> worker_ids(const Server::IOSchedule::ptr &scheduler, int threads) {
+    std::vector<std::atomic<int>> ids(threads);
+    std::atomic<int> arrived = {0};
+    for (int i = 0; i < threads; i++) {
+        scheduler->post([&ids, &arrived, threads]() {
+            ids[arrived++] = Server::GetThreadId();
+            while (arrived < threads) {
+                sched_yield();
+            }
+        });
+    }
+    while (arrived < threads) {
+        usleep(1000);
+    }
+    usleep(50 * 1000);
+    return {ids.begin(), ids.end()};
+}
+
+/// 线程主动让出CPU的次数，睡眠中的线程不会变化，每被唤醒一次再睡下去加一
+static long voluntary_switches(int tid) {
+    std::ifstream status("/proc/self/task/" + std::to_string(tid) + "/status");
+    std::string key;
+    long value = -1;
+    while (status >> key) {
+        if (key == "voluntary_ctxt_switches:") {
+            status >> value;
+        }
+    }
+    return value;
+}
+
+/// 线程正阻塞在哪个系统调用上
+static long blocked_syscall(int tid) {
+    std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/syscall");
+    long nr = -1;
+    in >> nr;
+    return nr;
+}
+
+/// 线程占用的CPU时间(纳秒)
+static uint64_t cpu_ns(int tid) {
+    std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/schedstat");
+    uint64_t ns = 0;
+    in >> ns;
+    return ns;
+}
+
+/// 投递一个空任务并等它执行完，调度线程回到idle后按当前配置重新等待
+static void restart_wait(const Server::IOSchedule::ptr &scheduler) {
+    std::atomic<bool> ran = {false};
+    scheduler->post([&ran]() { ran = true; });
+    while (!ran) {
+        usleep(1000);
+    }
+    usleep(5 * 1000);
+}
+
+static bool in_epoll_wait(int tid) {
+    long nr = blocked_syscall(tid);
+#ifdef SYS_epoll_wait
+    if (nr == SYS_epoll_wait) {
+        return true;
+    }
+#endif
+    return nr == SYS_epoll_pwait;
+}
+
+static bool in_poll(int tid) {
+    long nr = blocked_syscall(tid);
+#ifdef SYS_poll
+    if (nr == SYS_poll) {
+        return true;
+    }
+#endif
+    return nr == SYS_ppoll;
+}
+
+/// 所有线程空闲时只有一个leader在epoll_wait上，其他follower在各自的eventfd上等待；投递一个任务只唤醒一个线程
+void test_tickle_wakes_one() {
+    const int threads = 4;
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(threads, false, "wakeup"));
+    std::vector<int> ids = worker_ids(scheduler, threads);
+    int leaders = 0;
+    int followers = 0;
+    for (int id: ids) {
+        leaders += in_epoll_wait(id);
+        followers += in_poll(id);
+    }
+    SERVER_ASSERT(leaders == 1 && followers == threads - 1)
+
+    for (int round = 0; round < 3; round++) {
+        std::vector<long> before;
+        for (int id: ids) {
+            before.push_back(voluntary_switches(id));
+        }
+        std::atomic<int> ran = {-1};
+        scheduler->post([&ran]() { ran = Server::GetThreadId(); });
+        while (ran == -1) {
+            usleep(1000);
+        }
+        usleep(20 * 1000);
+        int woken = 0;
+        for (int i = 0; i < threads; i++) {
+            if (voluntary_switches(ids[i]) != before[i]) {
+                ++woken;
+                SERVER_ASSERT(ids[i] == ran)
+            }
+        }
+        SERVER_ASSERT(woken == 1)
+    }
+    scheduler->stop();
+    LOGI(g_logger) << "test_tickle_wakes_one passed";
+}
+
+/// leader去执行任务时叫醒一个follower接替它等待IO事件，leader忙的时候IO事件由接替的线程处理
+void test_leader_handover() {
+    const int threads = 3;
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(threads, false, "handover"));
+    int fds[2];
+    SERVER_ASSERT(pipe(fds) == 0)
+    std::atomic<int> io_thread = {-1};
+    std::atomic<bool> registered = {false};
+    scheduler->post([&]() {
+        scheduler->addEvent(fds[0], Server::IOSchedule::READ, [&io_thread]() {
+            io_thread = Server::GetThreadId();
+        });
+        registered = true;
+    });
+    while (!registered) {
+        usleep(1000);
+    }
+    std::vector<int> ids = worker_ids(scheduler, threads);
+    int leader = -1;
+    for (int id: ids) {
+        if (in_epoll_wait(id)) {
+            SERVER_ASSERT(leader == -1)
+            leader = id;
+        }
+    }
+    SERVER_ASSERT(leader != -1)
+
+    std::atomic<bool> busy = {false};
+    std::atomic<bool> timed_out = {false};
+    scheduler->post([&]() {
+        busy = true;
+        uint64_t start = Server::GetMonotonicMS();
+        while (io_thread == -1) {
+            if (Server::GetMonotonicMS() - start > 2000) {
+                timed_out = true;
+                break;
+            }
+            sched_yield();
+        }
+    }, leader);
+    while (!busy) {
+        usleep(1000);
+    }
+    usleep(30 * 1000);
+    int new_leader = -1;
+    for (int id: ids) {
+        if (id != leader && in_epoll_wait(id)) {
+            new_leader = id;
+        }
+    }
+    SERVER_ASSERT(new_leader != -1)
+    SERVER_ASSERT(write(fds[1], "x", 1) == 1)
+    scheduler->stop();
+    SERVER_ASSERT(!timed_out)
+    SERVER_ASSERT(io_thread != -1 && io_thread != leader)
+    close(fds[0]);
+    close(fds[1]);
+    LOGI(g_logger) << "test_leader_handover passed";
+}
+
+/**
+ * @brief 每线程epoll模式下注册读事件，回调记录执行的线程，之后再注册一次，一共等待rounds次
+ */
+struct PipeWaiter {
+    int fds[2] = {-1, -1};
+    int rounds = 0;
+    std::vector<int> threads;
+    std::atomic<int> *done = nullptr;
+
+    void wait(Server::IOSchedule *scheduler) {
+        scheduler->addEvent(fds[0], Server::IOSchedule::READ, [this, scheduler]() {
+            char c;
+            SERVER_ASSERT(read(fds[0], &c, 1) == 1)
+            threads.push_back(Server::GetThreadId());
+            if ((int) threads.size() < rounds) {
+                wait(scheduler);
+            }
+            ++*done;
+        });
+    }
+};
+
+/// 每线程epoll模式下fd归注册它的线程(current)，事件的回调都在这个线程上执行
+void test_per_thread_owner() {
+    const int threads = 3;
+    const int per_thread = 4;
+    const int rounds = 3;
+    Server::Config::Lookup<bool>("io.epoll.per_thread")->setValue(true);
+    Server::Config::Lookup<std::string>("io.epoll.fd_assign")->setValue("current");
+    std::vector<PipeWaiter> waiters(threads * per_thread);
+    std::vector<int> owners(waiters.size(), -1);
+    std::atomic<int> done = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(threads, false, "per_thread"));
+        std::atomic<int> arrived = {0};
+        for (int t = 0; t < threads; t++) {
+            ///每个任务占住一个线程，在不同的线程上注册
+            scheduler->post([&, t]() {
+                ++arrived;
+                while (arrived < threads) {
+                    sched_yield();
+                }
+                for (int i = t * per_thread; i < (t + 1) * per_thread; i++) {
+                    SERVER_ASSERT(pipe(waiters[i].fds) == 0)
+                    waiters[i].rounds = rounds;
+                    waiters[i].done = &done;
+                    owners[i] = Server::GetThreadId();
+                    waiters[i].wait(scheduler.get());
+                }
+                ++arrived;
+            });
+        }
+        while (arrived < 2 * threads) {
+            usleep(1000);
+        }
+        for (int round = 0; round < rounds; round++) {
+            for (auto &waiter: waiters) {
+                SERVER_ASSERT(write(waiter.fds[1], "x", 1) == 1)
+            }
+            while (done < (int) waiters.size() * (round + 1)) {
+                usleep(1000);
+            }
+        }
+        scheduler->stop();
+    }
+    for (size_t i = 0; i < waiters.size(); i++) {
+        SERVER_ASSERT(waiters[i].threads.size() == (size_t) rounds)
+        for (int id: waiters[i].threads) {
+            SERVER_ASSERT(id == owners[i])
+        }
+        close(waiters[i].fds[0]);
+        close(waiters[i].fds[1]);
+    }
+    LOGI(g_logger) << "test_per_thread_owner passed";
+}
+
+/// round_robin把同一个线程注册的fd轮流分给各个线程，之后这个fd的事件一直在分到的线程上处理
+void test_per_thread_round_robin() {
+    const int threads = 3;
+    const int rounds = 3;
+    Server::Config::Lookup<bool>("io.epoll.per_thread")->setValue(true);
+    Server::Config::Lookup<std::string>("io.epoll.fd_assign")->setValue("round_robin");
+    std::vector<PipeWaiter> waiters(threads * 2);
+    std::atomic<int> done = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(threads, false, "round_robin"));
+        std::atomic<bool> registered = {false};
+        scheduler->post([&]() {
+            for (auto &waiter: waiters) {
+                SERVER_ASSERT(pipe(waiter.fds) == 0)
+                waiter.rounds = rounds;
+                waiter.done = &done;
+                waiter.wait(scheduler.get());
+            }
+            registered = true;
+        });
+        while (!registered) {
+            usleep(1000);
+        }
+        for (int round = 0; round < rounds; round++) {
+            for (auto &waiter: waiters) {
+                SERVER_ASSERT(write(waiter.fds[1], "x", 1) == 1)
+            }
+            while (done < (int) waiters.size() * (round + 1)) {
+                usleep(1000);
+            }
+        }
+        scheduler->stop();
+    }
+    std::vector<int> used;
+    for (auto &waiter: waiters) {
+        SERVER_ASSERT(waiter.threads.size() == (size_t) rounds)
+        for (int id: waiter.threads) {
+            SERVER_ASSERT(id == waiter.threads[0])
+        }
+        if (std::find(used.begin(), used.end(), waiter.threads[0]) == used.end()) {
+            used.push_back(waiter.threads[0]);
+        }
+        close(waiter.fds[0]);
+        close(waiter.fds[1]);
+    }
+    SERVER_ASSERT(used.size() == (size_t) threads)
+    Server::Config::Lookup<bool>("io.epoll.per_thread")->setValue(false);
+    LOGI(g_logger) << "test_per_thread_round_robin passed";
+}
+
+/// io.epoll.max_timeout运行时修改后，空闲线程按新的超时醒来
+void test_max_timeout_runtime() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "max_timeout"));
+    int id = worker_ids(scheduler, 1)[0];
+    Server::Config::Lookup<int>("io.epoll.max_timeout")->setValue(10);
+    restart_wait(scheduler);
+    long before = voluntary_switches(id);
+    usleep(200 * 1000);
+    SERVER_ASSERT(voluntary_switches(id) - before >= 5)
+
+    Server::Config::Lookup<int>("io.epoll.max_timeout")->setValue(3000);
+    restart_wait(scheduler);
+    before = voluntary_switches(id);
+    usleep(200 * 1000);
+    SERVER_ASSERT(voluntary_switches(id) - before <= 1)
+    scheduler->stop();
+    LOGI(g_logger) << "test_max_timeout_runtime passed";
+}
+
+/// io.epoll.busy_poll_us运行时修改后，空闲线程先忙等再睡眠；改回0后直接睡眠，不占CPU
+void test_busy_poll_runtime() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "busy_poll"));
+    int id = worker_ids(scheduler, 1)[0];
+    Server::Config::Lookup<int>("io.epoll.busy_poll_us")->setValue(300 * 1000);
+    restart_wait(scheduler);
+    uint64_t before = cpu_ns(id);
+    usleep(100 * 1000);
+    SERVER_ASSERT(cpu_ns(id) - before > 50 * 1000 * 1000)
+
+    Server::Config::Lookup<int>("io.epoll.busy_poll_us")->setValue(0);
+    restart_wait(scheduler);
+    before = cpu_ns(id);
+    usleep(100 * 1000);
+    SERVER_ASSERT(cpu_ns(id) - before < 10 * 1000 * 1000)
+    scheduler->stop();
+    LOGI(g_logger) << "test_busy_poll_runtime passed";
+}
+
+/**
+ * @brief 几个fd同时就绪，回调在让出前后各记录一次：一次epoll_wait取回所有事件时先全部开始再依次结束，
+ *        每次只取一个事件时一个回调结束后下一个事件才被取出
+ */
+static std::vector<int> ready_together(const Server::IOSchedule::ptr &scheduler, int count) {
+    std::vector<std::array<int, 2>> pipes(count);
+    std::vector<int> order;
+    std::atomic<int> done = {0};
+    std::atomic<bool> release = {false};
+    std::atomic<bool> registered = {false};
+    ///占住唯一的调度线程，所有管道都写完后才回到epoll_wait
+    scheduler->post([&]() {
+        for (int i = 0; i < count; i++) {
+            SERVER_ASSERT(pipe(pipes[i].data()) == 0)
+            scheduler->addEvent(pipes[i][0], Server::IOSchedule::READ, [&, i]() {
+                order.push_back(i + 1);
+                Server::Fiber::YieldToReady();
+                order.push_back(-(i + 1));
+                ++done;
+            });
+        }
+        registered = true;
+        while (!release) {
+            sched_yield();
+        }
+    });
+    while (!registered) {
+        usleep(1000);
+    }
+    for (auto &fds: pipes) {
+        SERVER_ASSERT(write(fds[1], "x", 1) == 1)
+    }
+    release = true;
+    while (done < count) {
+        usleep(1000);
+    }
+    for (auto &fds: pipes) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    return order;
+}
+
+/// io.epoll.max_events运行时修改后，下一次epoll_wait按新的大小取事件
+void test_max_events_runtime() {
+    Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, "max_events"));
+    std::vector<int> order = ready_together(scheduler, 4);
+    SERVER_ASSERT(order.size() == 8)
+    for (int i = 0; i < 4; i++) {
+        SERVER_ASSERT(order[i] > 0 && order[i + 4] < 0)
+    }
+
+    Server::Config::Lookup<int>("io.epoll.max_events")->setValue(1);
+    order = ready_together(scheduler, 4);
+    SERVER_ASSERT(order.size() == 8)
+    for (int i = 0; i < 4; i++) {
+        SERVER_ASSERT(order[2 * i] > 0 && order[2 * i + 1] == -order[2 * i])
+    }
+    Server::Config::Lookup<int>("io.epoll.max_events")->setValue(256);
+    scheduler->stop();
+    LOGI(g_logger) << "test_max_events_runtime passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_tickle_wakes_one();
+    test_leader_handover();
+    test_per_thread_owner();
+    test_per_thread_round_robin();
+    test_max_timeout_runtime();
+    test_busy_poll_runtime();
+    test_max_events_runtime();
+    return 0;
+}
@@ -0,0 +1,65 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Log.h"
+#include "Mutex.h"
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/**
+ * @brief 只记录加锁、解锁次数的读写锁
+ */
+struct CountingRWMutex {
+    void rdlock() { ++reads; }
+
+    void wrlock() { ++writes; }
+
+    void unlock() { ++unlocks; }
+
+    int reads = 0;
+    int writes = 0;
+    int unlocks = 0;
+};
+
+/// 提前unlock的锁析构时不再解锁，重新lock之后析构时解锁一次
+void test_scoped_unlock_once() {
+    CountingRWMutex mutex;
+    {
+        Server::ReadScopedLockImpl<CountingRWMutex> lock(mutex);
+        lock.unlock();
+        lock.unlock();
+    }
+    SERVER_ASSERT(mutex.reads == 1 && mutex.unlocks == 1)
+    {
+        Server::ReadScopedLockImpl<CountingRWMutex> lock(mutex);
+        lock.unlock();
+        lock.lock();
+    }
+    SERVER_ASSERT(mutex.reads == 3 && mutex.unlocks == 3)
+    {
+        Server::WriteScopedLockImpl<CountingRWMutex> lock(mutex);
+        lock.unlock();
+    }
+    SERVER_ASSERT(mutex.writes == 1 && mutex.unlocks == 4)
+    LOGI(g_logger) << "test_scoped_unlock_once passed";
+}
+
+/// 读锁提前释放后同一线程可以拿到写锁
+void test_read_then_write() {
+    Server::RWMutex mutex;
+    {
+        Server::RWMutex::ReadLock read_lock(mutex);
+        read_lock.unlock();
+        Server::RWMutex::WriteLock write_lock(mutex);
+    }
+    Server::RWMutex::WriteLock write_lock(mutex);
+    LOGI(g_logger) << "test_read_then_write passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_scoped_unlock_once();
+    test_read_then_write();
+    return 0;
+}
@@ -0,0 +1,304 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "Log.h"
+#include "MpscQueue.h"
+#include "IOSchedule.h"
+#include "Thread.h"
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+struct Node {
+    int producer = -1;
+    int seq = 0;
+    std::atomic<Node *> next = {nullptr};
+};
+
+/// 多个生产者同时压入，消费者按计数取出：每个节点恰好取出一次，同一生产者的节点保持顺序
+void test_mpsc_multi_producer() {
+    const int producers = 4;
+    const int per_producer = 200000;
+    Server::MpscQueue<Node> queue;
+    std::atomic<size_t> count = {0};
+    std::vector<Node> nodes(producers * per_producer);
+    std::vector<Server::Thread::ptr> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back(new Server::Thread([&, p]() {
+            for (int i = 0; i < per_producer; i++) {
+                Node &node = nodes[p * per_producer + i];
+                node.producer = p;
+                node.seq = i;
+                ++count;
+                queue.push(&node);
+            }
+        }, "producer_" + std::to_string(p)));
+    }
+    std::vector<int> expect(producers, 0);
+    size_t received = 0;
+    while (received < nodes.size()) {
+        if (count == 0) {
+            continue;
+        }
+        Node *node = queue.pop();
+        if (!node) {
+            continue;
+        }
+        --count;
+        SERVER_ASSERT(node->seq == expect[node->producer])
+        ++expect[node->producer];
+        ++received;
+    }
+    for (auto &thread: threads) {
+        thread->join();
+    }
+    SERVER_ASSERT(count == 0)
+    SERVER_ASSERT(queue.pop() == nullptr)
+    LOGI(g_logger) << "test_mpsc_multi_producer passed, received=" << received;
+}
+
+/// 多个外部线程同时向同一个调度线程投递指定线程的任务，所有任务都要执行，stop不能卡住
+void test_pinned_multi_producer() {
+    const int producers = 4;
+    const int per_producer = 20000;
+    std::atomic<int> target = {-1};
+    std::atomic<int> done = {0};
+    std::atomic<int> wrong_thread = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(2, false, "pinned"));
+        scheduler->post([&target]() { target = Server::GetThreadId(); });
+        while (target == -1) {
+            usleep(1000);
+        }
+        std::vector<Server::Thread::ptr> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back(new Server::Thread([&]() {
+                for (int i = 0; i < per_producer; i++) {
+                    scheduler->post([&]() {
+                        if (Server::GetThreadId() != target) {
+                            ++wrong_thread;
+                        }
+                        ++done;
+                    }, target);
+                }
+            }, "poster_" + std::to_string(p)));
+        }
+        for (auto &thread: threads) {
+            thread->join();
+        }
+        scheduler->stop();
+    }
+    SERVER_ASSERT(done == producers * per_producer)
+    SERVER_ASSERT(wrong_thread == 0)
+    LOGI(g_logger) << "test_pinned_multi_producer passed, done=" << done;
+}
+
+/// 共享栈协程绑定在不同线程上，批量投递时要各自回到绑定的线程
+void test_batch_mixed_bound_threads() {
+    const int per_thread = 50;
+    Server::Config::Lookup<bool>("fiber.shared_stack.enable")->setValue(true);
+    std::atomic<int> parked = {0};
+    std::atomic<int> finished = {0};
+    std::atomic<int> wrong_thread = {0};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(2, false, "bound"));
+        ///第一个任务占住一个线程，第二个任务只能在另一个线程上执行，这样拿到两个线程id
+        int ids[2] = {-1, -1};
+        std::atomic<int> arrived = {0};
+        for (int i = 0; i < 2; i++) {
+            scheduler->post([&ids, &arrived]() {
+                ids[arrived++] = Server::GetThreadId();
+                while (arrived < 2) {
+                    sched_yield();
+                }
+            });
+        }
+        while (arrived < 2) {
+            usleep(1000);
+        }
+        SERVER_ASSERT(ids[0] != ids[1])
+        std::mutex mutex;
+        std::vector<Server::Fiber::ptr> fibers[2];
+        for (int k = 0; k < 2; k++) {
+            for (int i = 0; i < per_thread; i++) {
+                scheduler->post(Server::Fiber::ptr(new Server::Fiber([&, k]() {
+                    int first = Server::GetThreadId();
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        fibers[k].push_back(Server::Fiber::GetThis());
+                    }
+                    ++parked;
+                    Server::Fiber::YieldToHold();
+                    if (Server::GetThreadId() != first) {
+                        ++wrong_thread;
+                    }
+                    ++finished;
+                })), ids[k]);
+            }
+        }
+        while (parked < 2 * per_thread) {
+            usleep(1000);
+        }
+        ///两个线程的协程交替排列，整批以任意线程投递
+        std::vector<Server::Fiber::ptr> batch;
+        for (int i = 0; i < per_thread; i++) {
+            for (auto &list: fibers) {
+                while (list[i]->getState() != Server::Fiber::HOLD) {
+                    sched_yield();
+                }
+                SERVER_ASSERT(list[i]->getBoundThread() != -1)
+                batch.push_back(list[i]);
+            }
+        }
+        fibers[0].clear();
+        fibers[1].clear();
+        scheduler->post(batch);
+        scheduler->stop();
+    }
+    Server::Config::Lookup<bool>("fiber.shared_stack.enable")->setValue(false);
+    SERVER_ASSERT(finished == 2 * per_thread)
+    SERVER_ASSERT(wrong_thread == 0)
+    LOGI(g_logger) << "test_batch_mixed_bound_threads passed, finished=" << finished;
+}
+
+/**
+ * @brief 先占住单线程调度器，投递的任务都排在队列里，放开之后记录执行顺序
+ * @param[in] post_tasks 投递任务，参数是记录执行顺序的函数
+ */
+template<class PostTasks>
+static std::vector<int> run_queued(PostTasks post_tasks, const char *name, int settle_ms = 0) {
+    std::mutex mutex;
+    std::vector<int> order;
+    std::atomic<bool> release = {false};
+    std::atomic<bool> blocked = {false};
+    {
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, false, name));
+        scheduler->post([&]() {
+            blocked = true;
+            while (!release) {
+                sched_yield();
+            }
+        });
+        while (!blocked) {
+            usleep(1000);
+        }
+        post_tasks(*scheduler, [&](int id) {
+            return [&, id]() {
+                std::lock_guard<std::mutex> lock(mutex);
+                order.push_back(id);
+            };
+        });
+        usleep(settle_ms * 1000);
+        release = true;
+        scheduler->stop();
+    }
+    return order;
+}
+
+/// CRITICAL任务先于之前投递的普通任务执行；没有到截止时间的后台任务在普通任务之后执行
+void test_priority_order() {
+    auto order = run_queued([](Server::Scheduler &scheduler, auto record) {
+        scheduler.post(record(-1), Server::Scheduler::BACKGROUND);
+        for (int i = 0; i < 3; i++) {
+            scheduler.post(record(i));
+        }
+        scheduler.post(record(100), Server::Scheduler::CRITICAL);
+        scheduler.post(record(101), Server::Scheduler::CRITICAL);
+    }, "priority");
+    SERVER_ASSERT((order == std::vector<int>{100, 101, 0, 1, 2, -1}))
+    LOGI(g_logger) << "test_priority_order passed";
+}
+
+/// 到了截止时间的后台任务先于普通任务执行，截止时间早的先执行
+void test_background_deadline() {
+    auto order = run_queued([](Server::Scheduler &scheduler, auto record) {
+        scheduler.post(record(-3), Server::Scheduler::BACKGROUND);
+        scheduler.post(record(-2), Server::Scheduler::BACKGROUND, 20);
+        scheduler.post(record(-1), Server::Scheduler::BACKGROUND, 10);
+        for (int i = 0; i < 3; i++) {
+            scheduler.post(record(i));
+        }
+    }, "deadline", 50);
+    SERVER_ASSERT((order == std::vector<int>{-1, -2, 0, 1, 2, -3}))
+    LOGI(g_logger) << "test_background_deadline passed";
+}
+
+/// 普通任务源源不断时，后台任务也会在连续执行budget个普通任务之后得到执行
+void test_background_budget() {
+    const int budget = (int) Server::Config::Lookup<uint32_t>("scheduler.background_budget")->getValue();
+    const int normals = budget * 2 + 10;
+    auto order = run_queued([normals](Server::Scheduler &scheduler, auto record) {
+        scheduler.post(record(-1), Server::Scheduler::BACKGROUND);
+        scheduler.post(record(-2), Server::Scheduler::BACKGROUND);
+        for (int i = 0; i < normals; i++) {
+            scheduler.post(record(i));
+        }
+    }, "budget");
+    SERVER_ASSERT(order.size() == (size_t) normals + 2)
+    SERVER_ASSERT(order[budget] == -1)
+    SERVER_ASSERT(order[2 * budget + 1] == -2)
+    LOGI(g_logger) << "test_background_budget passed";
+}
+
+/// 调度器创建后修改后台任务预算也要生效：连续执行budget个普通任务后执行一个后台任务
+void test_background_budget_live() {
+    const int normals = 10;
+    auto order = run_queued([](Server::Scheduler &scheduler, auto record) {
+        Server::Config::Lookup<uint32_t>("scheduler.background_budget")->setValue(2);
+        scheduler.post(record(-1), Server::Scheduler::BACKGROUND);
+        for (int i = 0; i < normals; i++) {
+            scheduler.post(record(i));
+        }
+    }, "budget_live");
+    Server::Config::Lookup<uint32_t>("scheduler.background_budget")->setValue(64);
+    SERVER_ASSERT(order.size() == (size_t) normals + 1)
+    SERVER_ASSERT(order[2] == -1)
+    LOGI(g_logger) << "test_background_budget_live passed";
+}
+
+/// 共享栈协程绑定的线程不在目标调度器里，投递时断言失败，不能换到别的线程执行
+void test_bound_fiber_to_other_scheduler() {
+    pid_t pid = fork();
+    SERVER_ASSERT(pid >= 0)
+    if (pid == 0) {
+        Server::Config::Lookup<bool>("fiber.shared_stack.enable")->setValue(true);
+        Server::IOSchedule::ptr owner(new Server::IOSchedule(1, false, "owner"));
+        Server::IOSchedule::ptr other(new Server::IOSchedule(1, false, "other"));
+        std::atomic<bool> parked = {false};
+        Server::Fiber::ptr fiber(new Server::Fiber([&parked]() {
+            parked = true;
+            Server::Fiber::YieldToHold();
+        }));
+        owner->post(fiber);
+        while (!parked || fiber->getState() != Server::Fiber::HOLD) {
+            usleep(1000);
+        }
+        SERVER_ASSERT(fiber->getBoundThread() != -1)
+        other->post(fiber);
+        _exit(0);
+    }
+    int status = 0;
+    SERVER_ASSERT(waitpid(pid, &status, 0) == pid)
+    SERVER_ASSERT(WIFSIGNALED(status))
+    LOGI(g_logger) << "test_bound_fiber_to_other_scheduler passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_mpsc_multi_producer();
+    test_pinned_multi_producer();
+    test_batch_mixed_bound_threads();
+    test_priority_order();
+    test_background_deadline();
+    test_background_budget();
+    test_background_budget_live();
+    test_bound_fiber_to_other_scheduler();
+    return 0;
+}
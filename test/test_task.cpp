@@ -0,0 +1,163 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Log.h"
+#include "Task.h"
+#include <functional>
+#include <memory>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/**
+ * @brief 大小为Size的可调用对象，记录被调用时自己的地址，统计存活的个数
+ */
+template<size_t Size>
+struct Probe {
+    static_assert(Size >= sizeof(const void **) + sizeof(int *));
+
+    Probe(const void **where, int *live) : where(where), live(live) {
+        ++*live;
+    }
+
+    Probe(const Probe &other) : where(other.where), live(other.live) {
+        ++*live;
+    }
+
+    Probe(Probe &&other) noexcept: where(other.where), live(other.live) {
+        ++*live;
+    }
+
+    ~Probe() {
+        --*live;
+    }
+
+    void operator()() {
+        *where = this;
+    }
+
+    const void **where;
+    int *live;
+    char padding[Size - sizeof(const void **) - sizeof(int *)] = {};
+};
+
+/// 调用时对象的地址在Task内部就是放在内部缓冲区
+static bool stored_inline(Server::Task &task, const void *&where) {
+    task();
+    auto *begin = reinterpret_cast<const char *>(&task);
+    auto *at = static_cast<const char *>(where);
+    return at >= begin && at < begin + sizeof(Server::Task);
+}
+
+/// 不超过INLINE_SIZE的放在内部缓冲区，超过的放到堆上，移动之后仍然放在原来的地方
+void test_inline_and_heap() {
+    const void *where = nullptr;
+    int live = 0;
+    Server::Task small(Probe<Server::Task::INLINE_SIZE>(&where, &live));
+    SERVER_ASSERT(stored_inline(small, where))
+    Server::Task large(Probe<Server::Task::INLINE_SIZE + 8>(&where, &live));
+    SERVER_ASSERT(!stored_inline(large, where))
+    const void *heap = where;
+    Server::Task moved(std::move(large));
+    SERVER_ASSERT(!large)
+    moved();
+    SERVER_ASSERT(where == heap)
+    Server::Task moved_small(std::move(small));
+    SERVER_ASSERT(stored_inline(moved_small, where))
+    SERVER_ASSERT(live == 2)
+    LOGI(g_logger) << "test_inline_and_heap passed";
+}
+
+/// 只能移动的捕获，Task移动之后还能调用
+void test_move_only_capture() {
+    auto value = std::make_unique<int>(1);
+    int seen = 0;
+    Server::Task task([value = std::move(value), &seen]() { seen = *value; });
+    Server::Task other(std::move(task));
+    SERVER_ASSERT(!task && other)
+    other();
+    SERVER_ASSERT(seen == 1)
+    LOGI(g_logger) << "test_move_only_capture passed";
+}
+
+/// 空的std::function和空指针构造出空Task
+void test_empty() {
+    SERVER_ASSERT(!Server::Task())
+    SERVER_ASSERT(!Server::Task(nullptr))
+    SERVER_ASSERT(!Server::Task(std::function<void()>()))
+    void (*fn)() = nullptr;
+    SERVER_ASSERT(!Server::Task(fn))
+    SERVER_ASSERT(Server::Task(std::function<void()>([]() {})))
+    LOGI(g_logger) << "test_empty passed";
+}
+
+/// 移动、赋值、置空、交换之后每个对象恰好析构一次
+template<size_t Size>
+void check_destroy_count() {
+    const void *where = nullptr;
+    int live = 0;
+    {
+        Server::Task a(Probe<Size>(&where, &live));
+        SERVER_ASSERT(live == 1)
+        Server::Task b(std::move(a));
+        SERVER_ASSERT(live == 1)
+        a = Server::Task(Probe<Size>(&where, &live));
+        SERVER_ASSERT(live == 2)
+        ///赋值析构原来的对象
+        b = std::move(a);
+        SERVER_ASSERT(live == 1 && !a && b)
+        a.swap(b);
+        SERVER_ASSERT(live == 1 && a && !b)
+        a = nullptr;
+        SERVER_ASSERT(live == 0)
+        b = Server::Task(Probe<Size>(&where, &live));
+        SERVER_ASSERT(live == 1)
+    }
+    SERVER_ASSERT(live == 0)
+}
+
+void test_destroy_count() {
+    check_destroy_count<Server::Task::INLINE_SIZE>();
+    check_destroy_count<Server::Task::INLINE_SIZE * 2>();
+    LOGI(g_logger) << "test_destroy_count passed";
+}
+
+static void site_a() {
+}
+
+static void site_b() {
+}
+
+/// 函数指针按指向的函数区分创建点，std::function和std::bind不知道创建点，其他可调用对象按类型区分
+void test_task_site() {
+    SERVER_ASSERT(Server::Task().site() == nullptr)
+    SERVER_ASSERT(Server::Task(&site_a).site() == reinterpret_cast<const void *>(&site_a))
+    SERVER_ASSERT(Server::Task(&site_a).site() != Server::Task(&site_b).site())
+    SERVER_ASSERT(Server::Task(std::function<void()>(&site_a)).site() == nullptr)
+    SERVER_ASSERT(Server::Task(std::bind(&site_a)).site() == nullptr)
+
+    auto small = []() {};
+    auto other = []() {};
+    char payload[2 * Server::Task::INLINE_SIZE] = {};
+    auto large = [payload]() { (void) payload; };
+    Server::Task first(small);
+    Server::Task second(small);
+    SERVER_ASSERT(first.site() && first.site() == second.site())
+    SERVER_ASSERT(Server::Task(other).site() != first.site())
+    Server::Task heap(large);
+    const void *site = heap.site();
+    SERVER_ASSERT(site && site != first.site())
+    Server::Task moved(std::move(heap));
+    SERVER_ASSERT(moved.site() == site)
+    LOGI(g_logger) << "test_task_site passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_inline_and_heap();
+    test_move_only_capture();
+    test_empty();
+    test_destroy_count();
+    test_task_site();
+    return 0;
+}
@@ -0,0 +1,256 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Config.h"
+#include "IOSchedule.h"
+#include "Log.h"
+#include "Timer.h"
+#include "Util.h"
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 模拟调度线程的分片下标，超出范围时落到共享分片
+static thread_local size_t t_shard = ~0ul;
+
+class TestTimerManager : public Server::TimerManager {
+public:
+    explicit TestTimerManager(size_t shards) : TimerManager(shards) {}
+
+    /// 被通知过的分片，按通知顺序
+    std::vector<size_t> notified;
+
+protected:
+    void onTimerInsertedAtFront(size_t shard) override {
+        notified.push_back(shard);
+    }
+
+    size_t currentTimerShard() override {
+        return t_shard;
+    }
+};
+
+/// 忙等到单调时钟走过deadline，再刷新缓存的时间
+static void wait_until(uint64_t deadline) {
+    while (Server::GetMonotonicMS() < deadline) {
+    }
+    Server::UpdateCachedClock();
+}
+
+/// 剩余时间：堆是精确的；时间轮可能要先在到期前把高层的槽降级，只保证不晚于最近的定时器
+static bool next_within(uint64_t next, uint64_t ms) {
+    if (Server::Config::Lookup<bool>("timer.wheel")->getValue()) {
+        return next <= ms;
+    }
+    return next == ms;
+}
+
+/// 乱序加入的定时器按到期时间取出，没到期的留在管理器里；取空之后再取不会出错
+void test_expiry_order() {
+    TestTimerManager manager(1);
+    Server::UpdateCachedClock();
+    uint64_t start = Server::GetCachedMS();
+    std::vector<int> order;
+    ///到期时间和分配顺序(地址)交错，比较函数退化成比较地址时顺序就乱了
+    for (int ms: {50, 10, 80, 30, 60, 20, 70, 40}) {
+        manager.addTimer(ms, [&order, ms]() { order.push_back(ms); });
+    }
+    SERVER_ASSERT(next_within(manager.getNextTimer(0), 10))
+    auto run_expired = [&manager]() {
+        std::vector<Server::Task> cbs;
+        manager.listExpiredTimer(cbs, 0);
+        for (auto &cb: cbs) {
+            cb();
+        }
+    };
+    wait_until(start + 45);
+    run_expired();
+    ///线程被抢占时缓存的时间可能已经过了start + 50，按实际经过的时间算应该到期的定时器
+    std::vector<int> expected;
+    for (int ms = 10; ms <= 80 && start + ms <= Server::GetCachedMS(); ms += 10) {
+        expected.push_back(ms);
+    }
+    SERVER_ASSERT(expected.size() >= 4 && order == expected)
+    SERVER_ASSERT(manager.hasTimer() == (expected.size() < 8))
+    wait_until(start + 81);
+    run_expired();
+    SERVER_ASSERT((order == std::vector<int>{10, 20, 30, 40, 50, 60, 70, 80}))
+    SERVER_ASSERT(!manager.hasTimer())
+    run_expired();
+    SERVER_ASSERT(order.size() == 8)
+    Server::ClearCachedClock();
+    LOGI(g_logger) << "test_expiry_order passed";
+}
+
+/// 定时器放进创建线程的分片，线程只取自己和共享分片的定时器，插入到分片最前面时通知一次
+void test_shard_selection() {
+    TestTimerManager manager(3);
+    const size_t shared = 2;
+    Server::UpdateCachedClock();
+    uint64_t start = Server::GetCachedMS();
+    bool fired[3] = {false, false, false};
+
+    t_shard = 0;
+    manager.addTimer(40, [&fired]() { fired[0] = true; });
+    t_shard = 1;
+    manager.addTimer(20, [&fired]() { fired[1] = true; });
+    t_shard = 7;
+    manager.addTimer(10, [&fired]() { fired[2] = true; });
+    SERVER_ASSERT((manager.notified == std::vector<size_t>{0, 1, shared}))
+
+    ///缓存的时间没有刷新，剩余时间不会比定时器晚
+    SERVER_ASSERT(next_within(manager.getNextTimer(0), 40))
+    SERVER_ASSERT(next_within(manager.getNextTimer(1), 20))
+    SERVER_ASSERT(next_within(manager.getNextTimer(shared), 10))
+    t_shard = 0;
+    SERVER_ASSERT(next_within(manager.getNextTimer(), 10))
+
+    ///通知过之后，直到重新取超时之前都不再通知
+    manager.notified.clear();
+    auto early = manager.addTimer(5, []() {});
+    auto earlier = manager.addTimer(3, []() {});
+    SERVER_ASSERT((manager.notified == std::vector<size_t>{0}))
+    SERVER_ASSERT(next_within(manager.getNextTimer(0), 3))
+    auto earliest = manager.addTimer(1, []() {});
+    SERVER_ASSERT((manager.notified == std::vector<size_t>{0, 0}))
+
+    ///在别的线程取消，从定时器所在的分片删除
+    t_shard = 1;
+    SERVER_ASSERT(early->cancel())
+    SERVER_ASSERT(earlier->cancel())
+    SERVER_ASSERT(earliest->cancel())
+    SERVER_ASSERT(!earliest->cancel())
+    SERVER_ASSERT(next_within(manager.getNextTimer(0), 40))
+
+    wait_until(start + 50);
+    std::vector<Server::Task> cbs;
+    manager.listExpiredTimer(cbs);
+    SERVER_ASSERT(cbs.size() == 2)
+    for (auto &cb: cbs) {
+        cb();
+    }
+    SERVER_ASSERT(!fired[0] && fired[1] && fired[2])
+    cbs.clear();
+    manager.listExpiredTimer(cbs, 0);
+    SERVER_ASSERT(cbs.size() == 1)
+    cbs[0]();
+    SERVER_ASSERT(fired[0])
+    SERVER_ASSERT(!manager.hasTimer())
+    t_shard = ~0ul;
+    LOGI(g_logger) << "test_shard_selection passed";
+}
+
+/// 线程离开调度循环后不再使用缓存的时间
+void test_clock_cleared_after_run() {
+    {
+        ///use_caller的调度器在stop中由当前线程执行调度循环
+        Server::IOSchedule::ptr scheduler(new Server::IOSchedule(1, true, "clock"));
+        scheduler->post([]() {});
+        scheduler->stop();
+    }
+    uint64_t start = Server::GetMonotonicMS();
+    while (Server::GetMonotonicMS() < start + 20) {
+    }
+    SERVER_ASSERT(Server::GetCachedMS() >= start + 20)
+    LOGI(g_logger) << "test_clock_cleared_after_run passed";
+}
+
+static bool s_timeout_fired = false;
+
+static void on_timeout(Server::Timeout *) {
+    s_timeout_fired = true;
+}
+
+/// 超时从启动时的真实时间算起，任务执行了一段时间之后启动的超时不会提前到期
+void test_timeout_from_real_clock() {
+    TestTimerManager manager(1);
+    Server::UpdateCachedClock();
+    uint64_t start = Server::GetCachedMS();
+    ///模拟任务执行了30ms，缓存的时间还停在任务开始时
+    while (Server::GetMonotonicMS() < start + 30) {
+    }
+    Server::Timeout timeout(&on_timeout);
+    manager.armTimeout(timeout, 50);
+    ///启动时读到的时间可能已经比start + 30晚，到期时间不晚于启动之后的时间 + 50
+    uint64_t armed = Server::GetMonotonicMS();
+    std::vector<Server::Task> cbs;
+    ///从任务开始算已经过了50ms，从启动超时算还没有
+    wait_until(start + 60);
+    manager.listExpiredTimer(cbs, 0);
+    SERVER_ASSERT(!s_timeout_fired)
+    wait_until(armed + 50);
+    manager.listExpiredTimer(cbs, 0);
+    SERVER_ASSERT(s_timeout_fired)
+    SERVER_ASSERT(!manager.cancelTimeout(timeout))
+    Server::ClearCachedClock();
+    LOGI(g_logger) << "test_timeout_from_real_clock passed";
+}
+
+/**
+ * @brief 单独放在一个定时器管理里，取出它的绝对执行时间
+ */
+static uint64_t deadline_of(uint64_t ms, uint64_t slack, uint64_t &now) {
+    TestTimerManager manager(1);
+    Server::UpdateCachedClock();
+    now = Server::GetCachedMS();
+    manager.addTimer(ms, []() {}, false, slack);
+    return now + manager.getNextTimer(0);
+}
+
+/// 执行时间向上取整到不超过slack的2的幂，相近的定时器落在同一个时间点
+void test_slack_rounding() {
+    uint64_t now = 0;
+    SERVER_ASSERT(deadline_of(1000, 0, now) == now + 1000)
+    SERVER_ASSERT(deadline_of(1000, 1, now) == now + 1000)
+    const uint64_t slacks[] = {2, 3, 64, 100, 1000, 4096};
+    for (uint64_t slack: slacks) {
+        uint64_t granularity = 1;
+        while (granularity * 2 <= slack) {
+            granularity *= 2;
+        }
+        for (uint64_t ms = 1000; ms < 1000 + 2 * granularity; ms += 7) {
+            uint64_t deadline = deadline_of(ms, slack, now);
+            SERVER_ASSERT(deadline % granularity == 0)
+            SERVER_ASSERT(deadline >= now + ms)
+            SERVER_ASSERT(deadline < now + ms + granularity)
+            SERVER_ASSERT(deadline - (now + ms) <= slack)
+        }
+    }
+
+    ///reset之后按原来的slack重新取整
+    TestTimerManager manager(1);
+    Server::UpdateCachedClock();
+    now = Server::GetCachedMS();
+    auto timer = manager.addTimer(1000, []() {}, false, 256);
+    timer->reset(3000, true);
+    uint64_t deadline = now + manager.getNextTimer(0);
+    SERVER_ASSERT(deadline % 256 == 0 && deadline >= now + 3000 && deadline < now + 3256)
+    timer->cancel();
+
+    ///超时也一样取整：放在时间轮的第0层，取到的时间是精确的
+    Server::Timeout timeout(&on_timeout);
+    uint64_t before = Server::GetMonotonicMS();
+    manager.armTimeout(timeout, 20, 16);
+    Server::UpdateCachedClock();
+    now = Server::GetCachedMS();
+    deadline = now + manager.getNextTimer(0);
+    SERVER_ASSERT(deadline % 16 == 0 && deadline >= before + 20 && deadline < now + 20 + 16)
+    SERVER_ASSERT(manager.cancelTimeout(timeout))
+    Server::ClearCachedClock();
+    LOGI(g_logger) << "test_slack_rounding passed";
+}
+
+int main() {
+    test_clock_cleared_after_run();
+    test_timeout_from_real_clock();
+    test_slack_rounding();
+    test_expiry_order();
+    test_shard_selection();
+    ///时间轮模式下取出顺序和分片的行为一样
+    Server::Config::Lookup<bool>("timer.wheel")->setValue(true);
+    test_expiry_order();
+    test_shard_selection();
+    Server::Config::Lookup<bool>("timer.wheel")->setValue(false);
+    return 0;
+}
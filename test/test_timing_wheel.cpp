@@ -0,0 +1,155 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Log.h"
+#include "TimingWheel.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+using Server::TimerNode;
+using Server::TimingWheel;
+
+/// 每次推进到nextExpire()，每个节点都恰好在到期时间取出，覆盖各层的降级和超出范围的节点
+void test_expire_exactly() {
+    const uint64_t start = 1000;
+    TimingWheel wheel(start);
+    SERVER_ASSERT(wheel.nextExpire() == ~0ull)
+    const uint64_t deltas[] = {0, 1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300000,
+                               TimingWheel::WHEEL_RANGE - 1, TimingWheel::WHEEL_RANGE,
+                               TimingWheel::WHEEL_RANGE + 123, 3 * TimingWheel::WHEEL_RANGE + 7};
+    std::vector<TimerNode> nodes(sizeof(deltas) / sizeof(deltas[0]));
+    for (size_t i = 0; i < nodes.size(); i++) {
+        nodes[i].expire = start + deltas[i];
+        wheel.insert(&nodes[i]);
+        SERVER_ASSERT(nodes[i].linked())
+    }
+    SERVER_ASSERT(wheel.size() == nodes.size())
+    std::vector<TimerNode *> expired;
+    uint64_t last = start;
+    size_t fired = 0;
+    while (!wheel.empty()) {
+        uint64_t now = wheel.nextExpire();
+        SERVER_ASSERT(now >= last)
+        last = now;
+        expired.clear();
+        wheel.advance(now, expired);
+        for (auto node: expired) {
+            SERVER_ASSERT(node->expire == now)
+            SERVER_ASSERT(!node->linked())
+        }
+        fired += expired.size();
+    }
+    SERVER_ASSERT(fired == nodes.size())
+    SERVER_ASSERT(wheel.nextExpire() == ~0ull)
+
+    ///已经过期的节点放进下一个要处理的槽
+    TimerNode late;
+    late.expire = start;
+    wheel.insert(&late);
+    SERVER_ASSERT(wheel.nextExpire() == last + 1)
+    expired.clear();
+    wheel.advance(last + 1, expired);
+    SERVER_ASSERT(expired.size() == 1 && expired[0] == &late)
+    LOGI(g_logger) << "test_expire_exactly passed";
+}
+
+/// 删除的节点不会到期，重复删除返回false，删除后可以重新插入
+void test_remove() {
+    TimingWheel wheel(0);
+    TimerNode a, b, c;
+    a.expire = 10;
+    b.expire = 10;
+    c.expire = 5000;
+    wheel.insert(&a);
+    wheel.insert(&b);
+    wheel.insert(&c);
+    SERVER_ASSERT(wheel.remove(&a))
+    SERVER_ASSERT(!wheel.remove(&a))
+    SERVER_ASSERT(wheel.remove(&c))
+    SERVER_ASSERT(wheel.size() == 1)
+    SERVER_ASSERT(wheel.nextExpire() == 10)
+    std::vector<TimerNode *> expired;
+    wheel.advance(100, expired);
+    SERVER_ASSERT(expired.size() == 1 && expired[0] == &b)
+    SERVER_ASSERT(wheel.nextExpire() == ~0ull)
+
+    c.expire = 200;
+    wheel.insert(&c);
+    std::vector<TimerNode *> nodes;
+    wheel.clear(nodes);
+    SERVER_ASSERT(nodes.size() == 1 && nodes[0] == &c && !c.linked())
+    SERVER_ASSERT(wheel.empty())
+    LOGI(g_logger) << "test_remove passed";
+}
+
+/// 随机插入、删除、推进，和按到期时间排序的参考模型对比
+void test_random_against_model() {
+    std::mt19937_64 rng(20261018);
+    const uint64_t ranges[] = {64, 4096, 262144, TimingWheel::WHEEL_RANGE, 2 * TimingWheel::WHEEL_RANGE};
+    const uint64_t start = 123456789;
+    TimingWheel wheel(start);
+    std::vector<std::unique_ptr<TimerNode>> pool;
+    std::multimap<uint64_t, TimerNode *> model;
+    std::vector<TimerNode *> expired;
+    uint64_t current = start;
+    for (int step = 0; step < 200000; step++) {
+        int op = (int) (rng() % 10);
+        if (op < 5) {
+            pool.emplace_back(new TimerNode());
+            TimerNode *node = pool.back().get();
+            node->expire = current + rng() % ranges[rng() % 5];
+            wheel.insert(node);
+            model.emplace(node->expire, node);
+        } else if (op < 7) {
+            if (model.empty()) {
+                continue;
+            }
+            auto it = model.lower_bound(current + rng() % 300000);
+            if (it == model.end()) {
+                it = model.begin();
+            }
+            SERVER_ASSERT(wheel.remove(it->second))
+            model.erase(it);
+        } else {
+            ///小步推进、推进到下一个到期时间、大步跳过都要覆盖
+            uint64_t now;
+            if (op == 7) {
+                now = current + rng() % 100;
+            } else if (op == 8) {
+                now = std::min(wheel.nextExpire(), current + TimingWheel::WHEEL_RANGE);
+            } else {
+                now = current + rng() % ranges[rng() % 5];
+            }
+            expired.clear();
+            wheel.advance(now, expired);
+            std::multiset<TimerNode *> expect;
+            while (!model.empty() && model.begin()->first <= now) {
+                expect.insert(model.begin()->second);
+                model.erase(model.begin());
+            }
+            SERVER_ASSERT(std::multiset<TimerNode *>(expired.begin(), expired.end()) == expect)
+            current = std::max(current, now + 1);
+        }
+        SERVER_ASSERT(wheel.size() == model.size())
+        if (!model.empty()) {
+            SERVER_ASSERT(wheel.nextExpire() <= model.begin()->first)
+            SERVER_ASSERT(wheel.nextExpire() >= current)
+        } else {
+            SERVER_ASSERT(wheel.nextExpire() == ~0ull)
+        }
+    }
+    LOGI(g_logger) << "test_random_against_model passed, pending=" << model.size();
+}
+
+int main() {
+    test_expire_exactly();
+    test_remove();
+    test_random_against_model();
+    return 0;
+}
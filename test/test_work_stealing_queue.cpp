@@ -0,0 +1,85 @@
+//
+// Created by czr on 26-10-18.
+//
+
+#include "Log.h"
+#include "Thread.h"
+#include "WorkStealingQueue.h"
+#include <atomic>
+#include <vector>
+
+static Server::Logger::ptr g_logger = LOG_ROOT();
+
+/// 单线程按FIFO顺序取出，扩容淘汰的旧数组在没有窃取线程时马上释放
+void test_fifo_and_grow() {
+    Server::WorkStealingQueue<int> queue(4);
+    std::vector<int> items(1000);
+    SERVER_ASSERT(queue.empty())
+    for (size_t i = 0; i < items.size(); i++) {
+        items[i] = (int) i;
+        queue.push(&items[i]);
+        SERVER_ASSERT(queue.retired() == 0)
+    }
+    for (size_t i = 0; i < items.size(); i++) {
+        int *item = queue.steal();
+        SERVER_ASSERT(item == &items[i])
+    }
+    SERVER_ASSERT(queue.steal() == nullptr)
+    SERVER_ASSERT(queue.empty())
+    LOGI(g_logger) << "test_fifo_and_grow passed";
+}
+
+/// owner一边压入一边取，多个线程同时窃取：每个元素恰好被取出一次，窃取线程退出后旧数组全部释放
+void test_concurrent_steal() {
+    const int stealers = 3;
+    const int total = 200000;
+    Server::WorkStealingQueue<int> queue(4);
+    std::vector<int> items(total);
+    std::vector<std::atomic<int>> taken(total);
+    std::atomic<int> count = {0};
+    std::atomic<bool> done = {false};
+    auto take = [&](int *item) {
+        ++taken[item - &items[0]];
+        ++count;
+    };
+    std::vector<Server::Thread::ptr> threads;
+    for (int t = 0; t < stealers; t++) {
+        threads.emplace_back(new Server::Thread([&]() {
+            while (!done || !queue.empty()) {
+                if (int *item = queue.steal()) {
+                    take(item);
+                }
+            }
+        }, "stealer_" + std::to_string(t)));
+    }
+    for (int i = 0; i < total; i++) {
+        queue.push(&items[i]);
+        if (i % 3 == 0) {
+            if (int *item = queue.steal()) {
+                take(item);
+            }
+        }
+    }
+    done = true;
+    for (auto &thread: threads) {
+        thread->join();
+    }
+    while (int *item = queue.steal()) {
+        take(item);
+    }
+    SERVER_ASSERT(count == total)
+    for (auto &n: taken) {
+        SERVER_ASSERT(n == 1)
+    }
+    int last = 0;
+    queue.push(&last);
+    SERVER_ASSERT(queue.retired() == 0)
+    LOGI(g_logger) << "test_concurrent_steal passed";
+}
+
+int main() {
+    g_logger->setLevel(Server::LogLevel::INFO);
+    test_fifo_and_grow();
+    test_concurrent_steal();
+    return 0;
+}